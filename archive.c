@@ -0,0 +1,655 @@
+/**
+* @file archive.c
+* @brief Archives: a directory packed into one file, with a file table to
+* list and extract members without reading the others.
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include "archive.h"
+
+/**
+* Compare two members by path, for qsort() and bsearch().
+* @param p1 first member
+* @param p2 second member
+* @return the result of strcmp()
+*/
+static int cmpentry(const void *p1, const void *p2){
+  return strcmp(((const TArchiveEntry *)p1)->path,
+                                         ((const TArchiveEntry *)p2)->path);
+}
+
+/**
+* Add a member to the archive. Call with the archive mutex locked when the
+* threads are writing it.
+* @param archive
+* @param path path relative to the directory archived
+* @param length length of the path
+* @return new member
+*/
+static TArchiveEntry *entry_add(TArchive *archive, const char *path,
+                                                              size_t length){
+  TArchiveEntry *entry = NULL;
+
+  if (archive->used == archive->size) {
+    archive->size = archive->size ? archive->size * 2 : 64;
+    archive->entries = realloc(archive->entries,
+                                      archive->size * sizeof(TArchiveEntry));
+  }
+  entry = &archive->entries[archive->used++];
+  entry->path = MALLOC(length + 1);
+  memcpy(entry->path, path, length);
+  entry->path[length] = '\0';
+
+  return entry;
+}
+
+/**
+* Check the path of a member before a file is created for it: relative,
+* without empty, "." or ".." components.
+* @param path
+* @return 1 if it is safe, 0 if not
+*/
+static int member_path_valid(const char *path){
+  const char *component = path;
+  size_t length;
+
+  if (*path == '\0' || *path == '/') {
+    return 0;
+  }
+  while (*component != '\0') {
+    length = strcspn(component, "/");
+    if (length == 0 || (length == 1 && component[0] == '.') ||
+                     (length == 2 && component[0] == '.' && component[1] == '.')) {
+      return 0;
+    }
+    component += length;
+    if (*component == '/') {
+      component++;
+      if (*component == '\0') {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+/**
+* Create the directories of a path that don't exist yet.
+* @param path file path, its last component is not created
+* @return 0 or ERR_FOPEN
+*/
+static int make_parents(char *path){
+  char *slash = path;
+
+  while ((slash = strchr(slash + 1, '/')) != NULL) {
+    *slash = '\0';
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+      *slash = '/';
+      return ERR_FOPEN;
+    }
+    *slash = '/';
+  }
+
+  return 0;
+}
+
+/**
+* Check if filename has the .palza extension.
+* @param filename
+* @return 1 if true, 0 if false
+*/
+int is_dot_palza(const char *filename){
+  char *dot = strrchr(filename, '.');
+
+  return dot != NULL && strcasecmp(dot, ARCHIVE_EXTENSION) == 0;
+}
+
+/**
+* Start writing an archive, to a temporary file next to it.
+* @param archive where to store the archive
+* @param filename archive file
+* @param directory directory archived, with a trailing '/'
+* @return 0 or ERR_FOPEN
+*/
+int archive_create(TArchive **archive, const char *filename,
+                                                      const char *directory){
+  TArchive *aux = MALLOC(sizeof(TArchive));
+  int fd;
+
+  aux->filename = MALLOC(strlen(filename) + 1);
+  strcpy(aux->filename, filename);
+  aux->temporary = MALLOC(strlen(filename) + 8);
+  sprintf(aux->temporary, "%s.XXXXXX", filename);
+  aux->directory = MALLOC(strlen(directory) + 1);
+  strcpy(aux->directory, directory);
+  aux->entries = NULL;
+  aux->used = 0;
+  aux->size = 0;
+  aux->text_size = 0;
+  aux->fp = NULL;
+  *archive = aux;
+
+  if ((errno = pthread_mutex_init(&aux->mutex, NULL)) != 0) {
+    ERROR(C_ERRO_MUTEX_INIT, "pthread_mutex_init() failed!");
+  }
+
+  if ((fd = mkstemp(aux->temporary)) == -1 ||
+                                     (aux->fp = fdopen(fd, "wb")) == NULL) {
+    if (fd != -1) {
+      close(fd);
+      unlink(aux->temporary);
+    }
+    FREE(aux->temporary);
+    return ERR_FOPEN;
+  }
+  fputs(ARCHIVE_MAGIC, aux->fp);
+  aux->end = strlen(ARCHIVE_MAGIC);
+
+  return 0;
+}
+
+/**
+* Temporary file for the .palz image of a big member, next to the archive
+* and already unlinked.
+* @param archive
+* @return open file or NULL
+*/
+static FILE *member_file(TArchive *archive){
+  char *name = MALLOC(strlen(archive->filename) + 8);
+  FILE *fp = NULL;
+  int fd;
+
+  sprintf(name, "%s.XXXXXX", archive->filename);
+  if ((fd = mkstemp(name)) != -1) {
+    unlink(name);
+    if ((fp = fdopen(fd, "w+b")) == NULL) {
+      close(fd);
+    }
+  }
+  FREE(name);
+
+  return fp;
+}
+
+/**
+* Compress a text file into the archive. The .palz image is encoded in
+* memory, or to a temporary file for members over ARCHIVE_MAX_IMAGE, so the
+* threads only wait for each other to copy it at the end of the archive.
+* @param archive
+* @param context compression context of the thread
+* @param path file found in the directory archived
+* @return 0 or an error code
+*/
+int archive_add(TArchive *archive, TCompressContext *context, char *path){
+  size_t length = strlen(archive->directory);
+  TArchiveEntry *entry = NULL;
+  char *name = path;
+  char *image = NULL;
+  size_t size = 0;
+  struct stat st, image_st;
+  off_t offset = 0;
+  FILE *fp = NULL;
+  int big, error;
+
+  if (stat(path, &st) != 0) {
+    return ERR_FSTATUS;
+  }
+  if (strncmp(path, archive->directory, length) == 0) {
+    name = path + length;
+  }
+  big = st.st_size > ARCHIVE_MAX_IMAGE;
+  if ((fp = big ? member_file(archive) : open_memstream(&image, &size)) ==
+                                                                      NULL) {
+    return ERR_FOPEN;
+  }
+  error = compress_stream(context, path, NULL, fp);
+  if (big && !error) {
+    if (fflush(fp) != 0 || fstat(fileno(fp), &image_st) != 0) {
+      error = ERR_FOPEN;
+    }
+    size = image_st.st_size;
+  } else if (fclose(fp) != 0 && !error) {
+    error = ERR_FOPEN;
+  }
+  if (error) {
+    if (big) {
+      fclose(fp);
+    }
+    free(image);
+    return error;
+  }
+
+  pthread_mutex_lock(&archive->mutex);
+  if (big ? fflush(archive->fp) != 0 || file_copy(fileno(fp), &offset,
+                            fileno(archive->fp), size) != (long long)size ||
+                                      fseeko(archive->fp, 0, SEEK_END) != 0 :
+                          fwrite(image, 1, size, archive->fp) != size) {
+    error = ERR_FOPEN;
+  } else {
+    entry = entry_add(archive, name, strlen(name));
+    entry->offset = archive->end;
+    entry->size = size;
+    entry->text_size = st.st_size;
+    archive->end += size;
+    archive->text_size += st.st_size;
+  }
+  pthread_mutex_unlock(&archive->mutex);
+  if (big) {
+    fclose(fp);
+  }
+  free(image);
+
+  return error;
+}
+
+/**
+* Write the file table and the end of an archive, and rename it to its
+* final name.
+* @param archive
+* @return 0 or ERR_FOPEN (the archive is removed then)
+*/
+int archive_finish(TArchive *archive){
+  unsigned char *table = NULL;
+  unsigned char end[ARCHIVE_END_SIZE];
+  size_t length = 4, used = 4, path;
+  mode_t mask = umask(0);
+  int i, error = 0;
+
+  umask(mask);
+  qsort(archive->entries, archive->used, sizeof(TArchiveEntry), cmpentry);
+
+  for (i = 0; i < archive->used; i++) {
+    length += ARCHIVE_ENTRY_SIZE + strlen(archive->entries[i].path);
+  }
+  table = MALLOC(length);
+  le_store(table, archive->used, 4);
+  for (i = 0; i < archive->used; i++) {
+    path = strlen(archive->entries[i].path);
+    le_store(table + used, archive->entries[i].offset, 8);
+    le_store(table + used + 8, archive->entries[i].size, 8);
+    le_store(table + used + 16, archive->entries[i].text_size, 8);
+    le_store(table + used + 24, path, 4);
+    memcpy(table + used + ARCHIVE_ENTRY_SIZE, archive->entries[i].path, path);
+    used += ARCHIVE_ENTRY_SIZE + path;
+  }
+
+  le_store(end, archive->end, 8);
+  le_store(end + 8, length, 8);
+  memcpy(end + 16, ARCHIVE_END_MAGIC, 8);
+  if (block_write(archive->fp, ARCHIVE_BLOCK_TABLE, table, length) != 0 ||
+                   fwrite(end, 1, ARCHIVE_END_SIZE, archive->fp) != ARCHIVE_END_SIZE) {
+    error = ERR_FOPEN;
+  }
+  FREE(table);
+
+  /* mkstemp() made it 0600: the mode fopen() gives the other outputs */
+  if (fchmod(fileno(archive->fp), 0666 & ~mask) != 0) {
+    error = ERR_FOPEN;
+  }
+
+  if (fclose(archive->fp) != 0 || error ||
+                           rename(archive->temporary, archive->filename) != 0) {
+    error = ERR_FOPEN;
+    unlink(archive->temporary);
+  }
+  archive->fp = NULL;
+
+  return error;
+}
+
+/**
+* Open an archive and read its file table, found from the end of the file.
+* @param archive where to store the archive
+* @param filename archive file
+* @return 0 or an error code
+*/
+int archive_open(TArchive **archive, const char *filename){
+  TArchive *aux = MALLOC(sizeof(TArchive));
+  TArchiveEntry *entry = NULL;
+  unsigned char end[ARCHIVE_END_SIZE];
+  unsigned char *table = NULL;
+  char magic[sizeof(ARCHIVE_MAGIC)];
+  unsigned long long offset, length, used, path;
+  unsigned int count, i;
+  size_t got;
+  struct stat st;
+  int type, corrupted = 0;
+
+  aux->filename = MALLOC(strlen(filename) + 1);
+  strcpy(aux->filename, filename);
+  aux->temporary = NULL;
+  aux->directory = NULL;
+  aux->entries = NULL;
+  aux->used = 0;
+  aux->size = 0;
+  aux->text_size = 0;
+  *archive = aux;
+
+  if ((errno = pthread_mutex_init(&aux->mutex, NULL)) != 0) {
+    ERROR(C_ERRO_MUTEX_INIT, "pthread_mutex_init() failed!");
+  }
+
+  if ((aux->fp = fopen(filename, "rb")) == NULL) {
+    return ERR_FOPEN;
+  }
+  if (fstat(fileno(aux->fp), &st) != 0) {
+    return ERR_FSTATUS;
+  }
+
+  /* Magic line, end and table block, which must end where the end starts */
+  if ((unsigned long long)st.st_size < strlen(ARCHIVE_MAGIC) +
+                                  PALZ_BLOCK_HEADER + 4 + ARCHIVE_END_SIZE ||
+          fread(magic, 1, strlen(ARCHIVE_MAGIC), aux->fp) != strlen(ARCHIVE_MAGIC) ||
+          memcmp(magic, ARCHIVE_MAGIC, strlen(ARCHIVE_MAGIC)) != 0 ||
+          fseek(aux->fp, -ARCHIVE_END_SIZE, SEEK_END) != 0 ||
+          fread(end, 1, ARCHIVE_END_SIZE, aux->fp) != ARCHIVE_END_SIZE ||
+          memcmp(end + 16, ARCHIVE_END_MAGIC, 8) != 0) {
+    return ERR_PALZEXTENSION;
+  }
+  offset = le_load(end, 8);
+  length = le_load(end + 8, 8);
+  if (length < 4 || length > (unsigned long long)st.st_size ||
+          offset + PALZ_BLOCK_HEADER + length + 4 + ARCHIVE_END_SIZE !=
+                                           (unsigned long long)st.st_size ||
+          fseek(aux->fp, offset, SEEK_SET) != 0) {
+    return ERR_PALZCORRUPTED;
+  }
+  table = MALLOC(length);
+  if (block_read(aux->fp, &type, table, length, &got) != 0 ||
+                              type != ARCHIVE_BLOCK_TABLE || got != length) {
+    FREE(table);
+    return ERR_PALZCORRUPTED;
+  }
+
+  /* Members must be within the archive, before the table */
+  count = le_load(table, 4);
+  for (i = 0, used = 4; i < count && !corrupted; i++) {
+    if (used + ARCHIVE_ENTRY_SIZE > length ||
+           (path = le_load(table + used + 24, 4)) == 0 ||
+           path > length - used - ARCHIVE_ENTRY_SIZE ||
+           memchr(table + used + ARCHIVE_ENTRY_SIZE, '\0', path) != NULL) {
+      corrupted = 1;
+      break;
+    }
+    entry = entry_add(aux, (char *)table + used + ARCHIVE_ENTRY_SIZE, path);
+    entry->offset = le_load(table + used, 8);
+    entry->size = le_load(table + used + 8, 8);
+    entry->text_size = le_load(table + used + 16, 8);
+    aux->text_size += entry->text_size;
+    if (entry->offset < strlen(ARCHIVE_MAGIC) || entry->size > offset ||
+                                        entry->offset > offset - entry->size) {
+      corrupted = 1;
+    }
+    used += ARCHIVE_ENTRY_SIZE + path;
+  }
+  if (used != length) {
+    corrupted = 1;
+  }
+  aux->end = offset;
+  FREE(table);
+
+  return corrupted ? ERR_PALZCORRUPTED : 0;
+}
+
+/**
+* Free an archive, closing its file.
+* @param archive
+*/
+void archive_free(TArchive **archive){
+  TArchive *aux = *archive;
+  int i;
+
+  if (aux->fp != NULL) {
+    fclose(aux->fp);
+    if (aux->temporary != NULL) {
+      unlink(aux->temporary);
+    }
+  }
+  for (i = 0; i < aux->used; i++) {
+    FREE(aux->entries[i].path);
+  }
+  free(aux->entries);
+  pthread_mutex_destroy(&aux->mutex);
+  FREE(aux->filename);
+  FREE(aux->temporary);
+  FREE(aux->directory);
+  FREE(*archive);
+}
+
+/**
+* Print the members of an archive: text size, compressed size and path.
+* @param filename archive file
+* @param out where to print them
+* @return 0 or an error code
+*/
+int archive_list(const char *filename, FILE *out){
+  TArchive *archive = NULL;
+  int i, error;
+
+  if ((error = archive_open(&archive, filename)) == 0) {
+    for (i = 0; i < archive->used; i++) {
+      fprintf(out, "%12llu %12llu  %s\n", archive->entries[i].text_size,
+                       archive->entries[i].size, archive->entries[i].path);
+    }
+  }
+  archive_free(&archive);
+
+  return error;
+}
+
+/**
+* Extract one member of an archive to the standard output, or every member
+* to a directory. Only the file table and the members extracted are read.
+* @param context decompression context
+* @param filename archive file
+* @param member path of the member, or NULL for all of them
+* @param directory where to write all the members, with a trailing '/'
+* @return number of members that failed, or an error code
+*/
+int archive_extract(TDecompressContext *context, const char *filename,
+                                   const char *member, const char *directory){
+  TArchive *archive = NULL;
+  TArchiveEntry *entry = NULL;
+  TArchiveEntry key;
+  char *path = NULL;
+  FILE *fpFinal = NULL;
+  int i, error, failed = 0;
+
+  if ((error = archive_open(&archive, filename)) != 0) {
+    archive_free(&archive);
+    return error;
+  }
+  setvbuf(archive->fp, context->source_buffer, _IOFBF, DECOMPRESS_IO_BUFFER);
+
+  if (member != NULL) {
+    key.path = (char *)member;
+    if ((entry = bsearch(&key, archive->entries, archive->used,
+                             sizeof(TArchiveEntry), cmpentry)) == NULL) {
+      error = ERR_ARCHIVEMEMBER;
+    } else if (fseek(archive->fp, entry->offset, SEEK_SET) != 0) {
+      error = ERR_FOPEN;
+    } else if ((error = decompress_stream(context, archive->fp, entry->size,
+                                                              stdout)) == 0) {
+      error = fflush(stdout) != 0 ? ERR_FOPEN : 0;
+    }
+    archive_free(&archive);
+    return error;
+  }
+
+  for (i = 0; i < archive->used; i++) {
+    entry = &archive->entries[i];
+    path = realloc(path, strlen(directory) + strlen(entry->path) + 1);
+    strcpy(path, directory);
+    strcat(path, entry->path);
+
+    if (!member_path_valid(entry->path)) {
+      error = ERR_PALZCORRUPTED;
+    } else if ((error = make_parents(path)) == 0 &&
+                                       (fpFinal = fopen(path, "w")) == NULL) {
+      error = ERR_FOPEN;
+    }
+    if (!error) {
+      setvbuf(fpFinal, NULL, _IONBF, 0);
+      if (fseek(archive->fp, entry->offset, SEEK_SET) != 0) {
+        error = ERR_FOPEN;
+      } else {
+        error = decompress_stream(context, archive->fp, entry->size, fpFinal);
+      }
+      if (fclose(fpFinal) != 0 && !error) {
+        error = ERR_FOPEN;
+      }
+      /* Never leave a partially decoded file behind */
+      if (error) {
+        unlink(path);
+      }
+    }
+    if (error) {
+      get_error_msg(error, entry->path);
+      failed++;
+    }
+  }
+  FREE(path);
+  archive_free(&archive);
+
+  return failed;
+}
+
+/**
+* Pack the text files of a folder and its sub-folders into one archive,
+* compressing them with threads. Every member has its own dictionary.
+* @param directory main directory where to start, with a trailing '/'
+* @param filename archive file
+* @param max_threads maximum number of threads
+* @return number of files that failed, or an error code
+* @see archive_add()
+*/
+int parallel_folder_archive(char *directory, char *filename, int max_threads){
+  char **files_to_archive = NULL;
+  int amount = 0;
+  float output = 0;
+
+  pthread_t thr[max_threads];
+
+  PARAM_T param;
+
+  /* Initialize the mutex */
+  if ((errno = pthread_mutex_init(&param.mutex, NULL)) != 0) {
+    ERROR(C_ERRO_MUTEX_INIT, "pthread_mutex_init() failed!");
+  }
+
+  /* Initialize the condition variable */
+  if ((errno = pthread_cond_init(&param.cond, NULL)) != 0) {
+    ERROR(C_ERRO_CONDITION_INIT, "pthread_cond_init() failed!");
+  }
+
+  /* Initialize other parameters */
+  param.buffer = MALLOC(max_threads*sizeof(char*));
+  param.index_reading = 0;
+  param.index_writing = 0;
+  param.total = 0;
+  param.stop = 0;
+  param.max = max_threads;
+  param.mode = ARCHIVE_MODE;
+  param.failed = 0;
+  param.matched = 0;
+  param.manifest = NULL;
+  param.io = NULL;
+  param.progress = NULL;
+  param.journal = NULL;
+
+  int i;
+
+  /* Search for all non-palz files, before the archive is in the folder */
+  if ((output = get_files_from_dir(directory, &files_to_archive, &amount,
+                                                        COMPRESS_MODE)) < 0) {
+    get_error_msg(output, NULL);
+  }
+
+  if ((output = archive_create(&param.archive, filename, directory)) < 0) {
+    for (i = 0; i < amount; i++) {
+      FREE(files_to_archive[i]);
+    }
+    FREE(files_to_archive);
+    archive_free(&param.archive);
+    FREE(param.buffer);
+    return output;
+  }
+
+  for(i=0; i<param.max; i++){
+    param.buffer[i] = NULL;
+  }
+
+  /* Create the threads */
+  for(i=0; i<max_threads; i++){
+    if ((errno = pthread_create(&thr[i], NULL, consumer, &param) != 0)) {
+      ERROR(C_ERRO_PTHREAD_CREATE, "pthread_create() failed!");
+    }
+  }
+
+  /* Give all files but archives to write on buffer */
+  for(i = 0; i<amount; i++){
+    if (!is_dot_palza(files_to_archive[i])) {
+      write_on_buffer(files_to_archive[i], &param);
+    }
+    FREE(files_to_archive[i]);
+  }
+  FREE(files_to_archive);
+
+  /* Enters critical section */
+  if ((errno = pthread_mutex_lock(&(param.mutex))) != 0) {
+    WARNING("pthread_mutex_lock() failed\n");
+    return 0;
+  }
+
+  /* Stop production */
+  param.stop = 1;
+
+  /* Notify all threads */
+  if ((errno = pthread_cond_broadcast(&(param.cond))) != 0) {
+    WARNING("pthread_cond_broadcast() failed");
+    return 0;
+  }
+
+  /* Exits critical section */
+  if ((errno = pthread_mutex_unlock(&(param.mutex))) != 0) {
+    WARNING("pthread_mutex_unlock() failed");
+    return 0;
+  }
+
+  /* Wait for the threads to finish */
+  for(i=0; i<max_threads; i++) {
+    if ((errno = pthread_join(thr[i], NULL)) != 0) {
+      ERROR(C_ERRO_PTHREAD_JOIN, "pthread_join() failed!");
+    }
+  }
+
+  /* Free the mutex */
+  if ((errno = pthread_mutex_destroy(&param.mutex)) != 0) {
+    ERROR(C_ERRO_MUTEX_DESTROY, "pthread_mutex_destroy() failed!");
+  }
+
+  /* Free consumer condition variable */
+  if ((errno = pthread_cond_destroy(&param.cond)) != 0) {
+    ERROR(C_ERRO_CONDITION_DESTROY, "pthread_cond_destroy() failed!");
+  }
+
+  /* Free buffer */
+  for (i=0; i<param.max; i++){
+    FREE(param.buffer[i]);
+  }
+  FREE(param.buffer);
+
+  /* The table goes after the last member */
+  if ((output = archive_finish(param.archive)) < 0) {
+    archive_free(&param.archive);
+    return output;
+  }
+  fprintf(stderr, "Compression ratio: %s (%d files) %.2f %%\n", filename,
+          param.archive->used, compress_ratio(get_size(filename),
+                                              param.archive->text_size));
+  archive_free(&param.archive);
+
+  return param.failed;
+}
@@ -0,0 +1,70 @@
+/**
+* @file archive.h
+* @brief The header file for archive.c
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include "common.h"
+#include "compress.h"
+#include "decompress.h"
+
+/**
+* An archive starts with its magic line, then the .palz image of every member
+* back to back, the file table in one checksummed block and a fixed-size end:
+* the offset and payload length of the table block, and ARCHIVE_END_MAGIC.
+*/
+#define ARCHIVE_MAGIC                   "PALZA1\n"
+#define ARCHIVE_EXTENSION               ".palza"
+#define ARCHIVE_BLOCK_TABLE             'T'
+#define ARCHIVE_END_MAGIC               "PALZAEND"
+#define ARCHIVE_END_SIZE                24
+/* Table entry: offset, size and text size, path length, then the path */
+#define ARCHIVE_ENTRY_SIZE              28
+/* Bigger members are encoded to a temporary file instead of memory */
+#define ARCHIVE_MAX_IMAGE               (64 << 20)
+
+/* A member of an archive */
+typedef struct archive_entry{
+  /* path relative to the directory archived */
+  char *path;
+  /* .palz image of the member in the archive */
+  unsigned long long offset;
+  unsigned long long size;
+  /* size of the text file */
+  unsigned long long text_size;
+}TArchiveEntry;
+
+/* An archive being written by the compression threads, or read */
+typedef struct archive{
+  char *filename;
+  /* temporary file renamed to filename by archive_finish() */
+  char *temporary;
+  char *directory;
+  FILE *fp;
+  /* end of the last member written */
+  unsigned long long end;
+  /* members, sorted by path once the archive is finished or read */
+  TArchiveEntry *entries;
+  int used;
+  int size;
+  unsigned long long text_size;
+  pthread_mutex_t mutex;
+}TArchive;
+
+int archive_create(TArchive **archive, const char *filename,
+                                                      const char *directory);
+int archive_add(TArchive *archive, TCompressContext *context, char *path);
+int archive_finish(TArchive *archive);
+int archive_open(TArchive **archive, const char *filename);
+void archive_free(TArchive **archive);
+int archive_list(const char *filename, FILE *out);
+int archive_extract(TDecompressContext *context, const char *filename,
+                                  const char *member, const char *directory);
+int is_dot_palza(const char *filename);
+int parallel_folder_archive(char *directory, char *filename, int max_threads);
+
+#endif
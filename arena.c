@@ -0,0 +1,136 @@
+/**
+* @file arena.c
+* @brief Bump allocator for the many small objects of one file (hashtable
+* entries and keys, word counts and IDs, words), released all at once when
+* the file is done. Each compression or decompression context owns one, so
+* the worker threads of the folder modes never share it: no locking, and
+* the chunks it keeps are that thread's cache for its next file.
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include <string.h>
+
+#include "arena.h"
+#include "memory.h"
+
+/* Objects start after the chunk header, aligned */
+#define ARENA_HEADER ((sizeof(TArenaChunk) + ARENA_ALIGN - 1) & \
+                                                 ~(size_t)(ARENA_ALIGN - 1))
+
+/**
+* Create an empty arena. No memory is taken until the first object.
+* @return new arena
+*/
+TArena *arena_create(void){
+  TArena *arena = MALLOC(sizeof(TArena));
+
+  arena->chunks = NULL;
+  arena->spare = NULL;
+  arena->kept = 0;
+
+  return arena;
+}
+
+/**
+* New chunk of at least size bytes.
+* @param size
+* @return chunk, not linked yet
+*/
+static TArenaChunk *chunk_create(size_t size){
+  TArenaChunk *chunk = MALLOC(ARENA_HEADER + size);
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+
+  return chunk;
+}
+
+/**
+* Allocate an object from an arena. It is freed by arena_reset() or
+* arena_free() only.
+* @param arena
+* @param size bytes of the object
+* @return object, aligned to ARENA_ALIGN
+*/
+void *arena_alloc(TArena *arena, size_t size){
+  TArenaChunk *chunk = arena->chunks;
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  /* A big object goes after the current chunk, which is still used */
+  if (size > ARENA_CHUNK_SIZE / 4) {
+    chunk = chunk_create(size);
+    chunk->used = size;
+    if (arena->chunks != NULL) {
+      chunk->next = arena->chunks->next;
+      arena->chunks->next = chunk;
+    } else {
+      arena->chunks = chunk;
+    }
+    return (char *)chunk + ARENA_HEADER;
+  }
+
+  if (chunk == NULL || chunk->used + size > chunk->size) {
+    if ((chunk = arena->spare) != NULL) {
+      arena->spare = chunk->next;
+      arena->kept--;
+      chunk->used = 0;
+    } else {
+      chunk = chunk_create(ARENA_CHUNK_SIZE);
+    }
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+  chunk->used += size;
+
+  return (char *)chunk + ARENA_HEADER + chunk->used - size;
+}
+
+/**
+* Copy a string to an arena.
+* @param arena
+* @param text
+* @return copy of text
+*/
+char *arena_strdup(TArena *arena, const char *text){
+  size_t length = strlen(text) + 1;
+
+  return memcpy(arena_alloc(arena, length), text, length);
+}
+
+/**
+* Release every object of an arena. Up to ARENA_KEEP_CHUNKS chunks are kept
+* for the objects of the next file, the others (and big objects) freed.
+* @param arena
+*/
+void arena_reset(TArena *arena){
+  TArenaChunk *chunk = NULL;
+
+  while ((chunk = arena->chunks) != NULL) {
+    arena->chunks = chunk->next;
+    if (chunk->size == ARENA_CHUNK_SIZE && arena->kept < ARENA_KEEP_CHUNKS) {
+      chunk->next = arena->spare;
+      arena->spare = chunk;
+      arena->kept++;
+    } else {
+      FREE(chunk);
+    }
+  }
+}
+
+/**
+* Free an arena, its objects and the chunks it kept.
+* @param arena
+*/
+void arena_free(TArena **arena){
+  TArenaChunk *chunk = NULL;
+
+  arena_reset(*arena);
+  while ((chunk = (*arena)->spare) != NULL) {
+    (*arena)->spare = chunk->next;
+    FREE(chunk);
+  }
+  FREE(*arena);
+}
@@ -0,0 +1,43 @@
+/**
+* @file arena.h
+* @brief The header file for arena.c
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/**
+* Bytes per chunk (bigger objects get a chunk of their own), chunks an arena
+* keeps for the next file and alignment of every object.
+*/
+#define ARENA_CHUNK_SIZE                65536
+#define ARENA_KEEP_CHUNKS               64
+#define ARENA_ALIGN                     8
+
+/* Chunk of memory objects are cut from, front to back */
+typedef struct arena_chunk{
+  struct arena_chunk *next;
+  size_t size;
+  size_t used;
+}TArenaChunk;
+
+/* Objects of one file, owned by the context of one thread */
+typedef struct arena{
+  /* chunks in use, the current one first */
+  TArenaChunk *chunks;
+  /* chunks kept by arena_reset() */
+  TArenaChunk *spare;
+  int kept;
+}TArena;
+
+TArena *arena_create(void);
+void *arena_alloc(TArena *arena, size_t size);
+char *arena_strdup(TArena *arena, const char *text);
+void arena_reset(TArena *arena);
+void arena_free(TArena **arena);
+
+#endif
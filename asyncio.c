@@ -0,0 +1,710 @@
+/**
+* @file asyncio.c
+* @brief Asynchronous I/O of the folder modes: the next files are read ahead
+* and the output files written in the background while the workers compress,
+* with io_uring or, without it, a few I/O threads.
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include "asyncio.h"
+
+#ifdef ASYNCIO_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/* Global vars */
+int asyncio_backend = ASYNCIO_OFF;
+
+/* External variables */
+extern int stats_enabled;
+extern int progress_enabled;
+
+#ifdef ASYNCIO_HAVE_URING
+/* Submission and completion rings shared with the kernel */
+typedef struct asyncio_ring{
+  int fd;
+  void *sq;
+  void *cq;
+  size_t sq_size;
+  size_t cq_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* entries filled since the last io_uring_enter() */
+  unsigned int to_submit;
+}TAsyncRing;
+#endif
+
+/**
+* Next request queued, in order. Call with the mutex locked.
+* @param io
+* @return request or NULL
+*/
+static TAsyncRequest *request_next(TAsyncIO *io){
+  TAsyncRequest *request = io->head;
+
+  while (request != NULL && request->state != ASYNCIO_QUEUED) {
+    request = request->next;
+  }
+
+  return request;
+}
+
+/**
+* Remove a request from the list and free it. Call with the mutex locked.
+* @param io
+* @param request
+*/
+static void request_remove(TAsyncIO *io, TAsyncRequest *request){
+  TAsyncRequest *previous = NULL;
+  TAsyncRequest *aux = io->head;
+
+  while (aux != request) {
+    previous = aux;
+    aux = aux->next;
+  }
+  if (previous == NULL) {
+    io->head = request->next;
+  } else {
+    previous->next = request->next;
+  }
+  if (io->tail == request) {
+    io->tail = previous;
+  }
+  free(request->data);
+  FREE(request->path);
+  FREE(request);
+}
+
+/**
+* Open the file of a request. Reads get a buffer of the size of the file;
+* files too large or not regular are left to the worker.
+* @param request
+* @return 1 if there are bytes to transfer, 0 if the request is finished
+*/
+static int request_open(TAsyncRequest *request){
+  struct stat st;
+  char *partial = NULL;
+
+  /* Written under the partial name, renamed by request_finish() */
+  if (request->write) {
+    partial = partial_filename(request->path);
+    request->fd = open(partial, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    FREE(partial);
+  } else {
+    request->fd = open(request->path, O_RDONLY);
+  }
+  if (request->fd < 0) {
+    request->error = 1;
+    return 0;
+  }
+
+  if (!request->write) {
+    if (fstat(request->fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+                                               st.st_size > ASYNCIO_MAX_FILE) {
+      request->error = 1;
+      return 0;
+    }
+    request->size = st.st_size;
+    request->data = malloc(request->size ? request->size : 1);
+  }
+
+  return request->done < request->size;
+}
+
+/**
+* Account for a read or write of a request.
+* @param request
+* @param result bytes transferred or -errno
+* @return 1 if there are bytes left to transfer, 0 if the request is finished
+*/
+static int request_advance(TAsyncRequest *request, long result){
+  if (result == -EINTR || result == -EAGAIN) {
+    return 1;
+  }
+  if (result < 0) {
+    request->error = 1;
+    return 0;
+  }
+  /* A file that got shorter since fstat() */
+  if (result == 0) {
+    if (request->write) {
+      request->error = 1;
+    }
+    request->size = request->done;
+    return 0;
+  }
+  request->done += result;
+
+  return request->done < request->size;
+}
+
+/**
+* Close the file of a finished request and hand it over: reads wait for
+* their worker, writes are freed. Call with the mutex locked.
+* @param io
+* @param request
+*/
+static void request_finish(TAsyncIO *io, TAsyncRequest *request){
+  char *partial = NULL;
+
+  if (request->fd >= 0 && close(request->fd) != 0 && request->write) {
+    request->error = 1;
+  }
+  request->fd = -1;
+
+  if (request->write) {
+    io->pending -= request->size;
+    io->writes--;
+    /* Never leave a partially written file behind */
+    partial = partial_filename(request->path);
+    if (!request->error && rename(partial, request->path) != 0) {
+      request->error = 1;
+    }
+    if (request->error) {
+      fprintf(stderr, "Failed: could not write %s\n", request->path);
+      unlink(partial);
+      io->failed++;
+    }
+    FREE(partial);
+    request_remove(io, request);
+  } else {
+    request->state = ASYNCIO_DONE;
+  }
+  pthread_cond_broadcast(&io->finished);
+}
+
+/**
+* I/O thread of the thread backend: requests are run one at a time with
+* blocking calls, ASYNCIO_WORKERS of them at once.
+* @param args I/O state
+*/
+static void *thread_worker(void *args){
+  TAsyncIO *io = args;
+  TAsyncRequest *request = NULL;
+  ssize_t result;
+
+  pthread_mutex_lock(&io->mutex);
+  for (;;) {
+    while ((request = request_next(io)) == NULL && !io->stop) {
+      pthread_cond_wait(&io->queued, &io->mutex);
+    }
+    if (request == NULL) {
+      break;
+    }
+    request->state = ASYNCIO_RUNNING;
+    pthread_mutex_unlock(&io->mutex);
+
+    if (request_open(request)) {
+      do {
+        if (request->write) {
+          result = write(request->fd, request->data + request->done,
+                                          request->size - request->done);
+        } else {
+          result = read(request->fd, request->data + request->done,
+                                          request->size - request->done);
+        }
+      } while (request_advance(request, result < 0 ? -errno : result));
+    }
+
+    pthread_mutex_lock(&io->mutex);
+    request_finish(io, request);
+  }
+  pthread_mutex_unlock(&io->mutex);
+
+  return NULL;
+}
+
+#ifdef ASYNCIO_HAVE_URING
+/**
+* Set up an io_uring instance and map its rings. Kernels without
+* IORING_OP_READ and IORING_OP_WRITE (before 5.6) are refused.
+* @return ring or NULL
+*/
+static TAsyncRing *ring_create(void){
+  TAsyncRing *ring = MALLOC(sizeof(TAsyncRing));
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+  if ((ring->fd = syscall(__NR_io_uring_setup, ASYNCIO_DEPTH, &params)) < 0) {
+    FREE(ring);
+    return NULL;
+  }
+  if (!(params.features & IORING_FEAT_CUR_PERSONALITY)) {
+    close(ring->fd);
+    FREE(ring);
+    return NULL;
+  }
+
+  ring->sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+  ring->cq_size = params.cq_off.cqes +
+                             params.cq_entries*sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+  ring->sq = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq == MAP_FAILED || ring->cq == MAP_FAILED ||
+                                                 ring->sqes == MAP_FAILED) {
+    if (ring->sq != MAP_FAILED) {
+      munmap(ring->sq, ring->sq_size);
+    }
+    if (ring->cq != MAP_FAILED) {
+      munmap(ring->cq, ring->cq_size);
+    }
+    if (ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqes_size);
+    }
+    close(ring->fd);
+    FREE(ring);
+    return NULL;
+  }
+
+  ring->sq_head = (unsigned int *)((char *)ring->sq + params.sq_off.head);
+  ring->sq_tail = (unsigned int *)((char *)ring->sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned int *)((char *)ring->sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)((char *)ring->sq + params.sq_off.array);
+  ring->cq_head = (unsigned int *)((char *)ring->cq + params.cq_off.head);
+  ring->cq_tail = (unsigned int *)((char *)ring->cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned int *)((char *)ring->cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq + params.cq_off.cqes);
+  ring->to_submit = 0;
+
+  return ring;
+}
+
+/**
+* Unmap and close an io_uring instance.
+* @param ring
+*/
+static void ring_free(TAsyncRing **ring){
+  TAsyncRing *aux = *ring;
+
+  munmap(aux->sq, aux->sq_size);
+  munmap(aux->cq, aux->cq_size);
+  munmap(aux->sqes, aux->sqes_size);
+  close(aux->fd);
+  FREE(*ring);
+}
+
+/**
+* Queue the next read or write of a request in the submission ring. There
+* is room: at most ASYNCIO_DEPTH requests are in flight.
+* @param ring
+* @param request
+*/
+static void ring_submit(TAsyncRing *ring, TAsyncRequest *request){
+  unsigned int tail = *ring->sq_tail;
+  unsigned int index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  size_t length = request->size - request->done;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = request->fd;
+  sqe->off = request->done;
+  sqe->addr = (unsigned long)(request->data + request->done);
+  sqe->len = length > (1U << 30) ? (1U << 30) : length;
+  sqe->user_data = (unsigned long)request;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+/**
+* Submit the queued entries and wait for at least one completion.
+* @param ring
+*/
+static void ring_enter(TAsyncRing *ring){
+  int submitted;
+
+  submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                                          IORING_ENTER_GETEVENTS, NULL, 0);
+  if (submitted > 0) {
+    ring->to_submit -= submitted;
+  }
+}
+
+/**
+* I/O thread of the io_uring backend: up to ASYNCIO_DEPTH requests are in
+* flight, files are opened and closed here.
+* @param args I/O state
+*/
+static void *ring_worker(void *args){
+  TAsyncIO *io = args;
+  TAsyncRing *ring = io->ring;
+  TAsyncRequest *request = NULL;
+  struct io_uring_cqe *cqe = NULL;
+  unsigned int head;
+  int inflight = 0;
+
+  pthread_mutex_lock(&io->mutex);
+  for (;;) {
+    while (inflight < ASYNCIO_DEPTH && (request = request_next(io)) != NULL) {
+      request->state = ASYNCIO_RUNNING;
+      pthread_mutex_unlock(&io->mutex);
+      if (request_open(request)) {
+        ring_submit(ring, request);
+        inflight++;
+        pthread_mutex_lock(&io->mutex);
+      } else {
+        pthread_mutex_lock(&io->mutex);
+        request_finish(io, request);
+      }
+    }
+    if (inflight == 0) {
+      if (io->stop) {
+        break;
+      }
+      pthread_cond_wait(&io->queued, &io->mutex);
+      continue;
+    }
+    pthread_mutex_unlock(&io->mutex);
+
+    ring_enter(ring);
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring->cqes[head & *ring->cq_mask];
+      request = (TAsyncRequest *)(unsigned long)cqe->user_data;
+      head++;
+      if (request_advance(request, cqe->res)) {
+        ring_submit(ring, request);
+      } else {
+        inflight--;
+        pthread_mutex_lock(&io->mutex);
+        request_finish(io, request);
+        pthread_mutex_unlock(&io->mutex);
+      }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&io->mutex);
+  }
+  pthread_mutex_unlock(&io->mutex);
+
+  return NULL;
+}
+#endif
+
+/**
+* Start the I/O of a folder mode.
+* @param backend ASYNCIO_AUTO (io_uring when the kernel has it, threads
+* otherwise), ASYNCIO_URING, ASYNCIO_THREADS or ASYNCIO_OFF
+* @return I/O state, NULL with ASYNCIO_OFF
+*/
+TAsyncIO *asyncio_create(int backend){
+  TAsyncIO *io = NULL;
+  int i;
+
+  if (backend == ASYNCIO_OFF) {
+    return NULL;
+  }
+
+  io = MALLOC(sizeof(TAsyncIO));
+  io->head = NULL;
+  io->tail = NULL;
+  io->pending = 0;
+  io->writes = 0;
+  io->failed = 0;
+  io->stop = 0;
+  io->ring = NULL;
+  if ((errno = pthread_mutex_init(&io->mutex, NULL)) != 0) {
+    ERROR(C_ERRO_MUTEX_INIT, "pthread_mutex_init() failed!");
+  }
+  if ((errno = pthread_cond_init(&io->queued, NULL)) != 0 ||
+                     (errno = pthread_cond_init(&io->finished, NULL)) != 0) {
+    ERROR(C_ERRO_CONDITION_INIT, "pthread_cond_init() failed!");
+  }
+
+#ifdef ASYNCIO_HAVE_URING
+  /* Kernels without io_uring, or where it is disabled, use threads */
+  if (backend != ASYNCIO_THREADS) {
+    io->ring = ring_create();
+  }
+#endif
+  if (io->ring != NULL) {
+    io->backend = ASYNCIO_URING;
+    io->nthreads = 1;
+  } else {
+    io->backend = ASYNCIO_THREADS;
+    io->nthreads = ASYNCIO_WORKERS;
+  }
+
+  for (i = 0; i < io->nthreads; i++) {
+#ifdef ASYNCIO_HAVE_URING
+    if (io->ring != NULL) {
+      errno = pthread_create(&io->threads[i], NULL, ring_worker, io);
+    } else
+#endif
+    errno = pthread_create(&io->threads[i], NULL, thread_worker, io);
+    if (errno != 0) {
+      ERROR(C_ERRO_PTHREAD_CREATE, "pthread_create() failed!");
+    }
+  }
+
+  return io;
+}
+
+/**
+* Wait for the writes still pending and stop the I/O.
+* @param io
+* @return number of output files that could not be written
+*/
+int asyncio_free(TAsyncIO **io){
+  TAsyncIO *aux = *io;
+  int i, failed;
+
+  pthread_mutex_lock(&aux->mutex);
+  aux->stop = 1;
+  pthread_cond_broadcast(&aux->queued);
+  pthread_mutex_unlock(&aux->mutex);
+
+  for (i = 0; i < aux->nthreads; i++) {
+    if ((errno = pthread_join(aux->threads[i], NULL)) != 0) {
+      ERROR(C_ERRO_PTHREAD_JOIN, "pthread_join() failed!");
+    }
+  }
+
+  /* Files read ahead and never taken */
+  while (aux->head != NULL) {
+    request_remove(aux, aux->head);
+  }
+#ifdef ASYNCIO_HAVE_URING
+  if (aux->ring != NULL) {
+    ring_free(&aux->ring);
+  }
+#endif
+  pthread_mutex_destroy(&aux->mutex);
+  pthread_cond_destroy(&aux->queued);
+  pthread_cond_destroy(&aux->finished);
+  failed = aux->failed;
+  FREE(*io);
+
+  return failed;
+}
+
+/**
+* Add a request at the end of the list. Call with the mutex locked.
+* @param io
+* @param path
+* @param write 1 for a write, 0 for a read
+* @return request
+*/
+static TAsyncRequest *request_add(TAsyncIO *io, const char *path, int write){
+  TAsyncRequest *request = MALLOC(sizeof(TAsyncRequest));
+
+  request->path = MALLOC(strlen(path) + 1);
+  strcpy(request->path, path);
+  request->write = write;
+  request->data = NULL;
+  request->size = 0;
+  request->done = 0;
+  request->fd = -1;
+  request->state = ASYNCIO_QUEUED;
+  request->error = 0;
+  request->next = NULL;
+  if (io->tail == NULL) {
+    io->head = request;
+  } else {
+    io->tail->next = request;
+  }
+  io->tail = request;
+  pthread_cond_signal(&io->queued);
+
+  return request;
+}
+
+/**
+* Start reading a file the workers will take soon (the producer calls it
+* before queueing the path).
+* @param io
+* @param path
+*/
+void asyncio_read(TAsyncIO *io, const char *path){
+  pthread_mutex_lock(&io->mutex);
+  request_add(io, path, 0);
+  pthread_mutex_unlock(&io->mutex);
+}
+
+/**
+* Take the contents of a file read ahead, waiting for the read to finish.
+* @param io
+* @param path file given to asyncio_read()
+* @param data where to store the contents, freed by the caller
+* @param size where to store their size
+* @return 0, or 1 if the file was not read ahead (too large, not found or an
+* error) and the caller must read it
+*/
+int asyncio_take(TAsyncIO *io, const char *path, char **data, size_t *size){
+  TAsyncRequest *request = NULL;
+  int error;
+
+  pthread_mutex_lock(&io->mutex);
+  for (request = io->head; request != NULL; request = request->next) {
+    if (!request->write && strcmp(request->path, path) == 0) {
+      break;
+    }
+  }
+  if (request == NULL) {
+    pthread_mutex_unlock(&io->mutex);
+    return 1;
+  }
+  while (request->state != ASYNCIO_DONE) {
+    pthread_cond_wait(&io->finished, &io->mutex);
+  }
+
+  if (!(error = request->error)) {
+    *data = request->data;
+    *size = request->done;
+    request->data = NULL;
+  }
+  request_remove(io, request);
+  pthread_mutex_unlock(&io->mutex);
+
+  return error ? 1 : 0;
+}
+
+/**
+* Write an output file in the background. Workers wait here while too many
+* bytes or files are waiting for the disk.
+* @param io
+* @param path
+* @param data contents, freed once written
+* @param size
+*/
+void asyncio_write(TAsyncIO *io, const char *path, char *data, size_t size){
+  TAsyncRequest *request = NULL;
+
+  pthread_mutex_lock(&io->mutex);
+  while (io->writes > 0 && (io->pending + size > ASYNCIO_MAX_PENDING ||
+                                          io->writes >= ASYNCIO_MAX_WRITES)) {
+    pthread_cond_wait(&io->finished, &io->mutex);
+  }
+  request = request_add(io, path, 1);
+  request->data = data;
+  request->size = size;
+  io->pending += size;
+  io->writes++;
+  pthread_mutex_unlock(&io->mutex);
+}
+
+/**
+* Compress a file read ahead to a .palz image in memory, written in the
+* background. Files that were not read ahead go through compress_file().
+* @param io
+* @param context compression context
+* @param path
+* @return compress_ratio() or an error code
+*/
+float asyncio_compress_file(TAsyncIO *io, TCompressContext *context,
+                                                                char *path){
+  char *data = NULL, *image = NULL, *final_filename = NULL;
+  size_t size = 0, image_size = 0;
+  FILE *fpSource = NULL, *fpImage = NULL;
+  int error;
+
+  /* fmemopen() refuses empty buffers */
+  if (asyncio_take(io, path, &data, &size) != 0 || size == 0 ||
+                      (fpSource = fmemopen(data, size, "r")) == NULL) {
+    free(data);
+    return compress_file(context, path);
+  }
+  if ((fpImage = open_memstream(&image, &image_size)) == NULL) {
+    fclose(fpSource);
+    free(data);
+    return ERR_FOPEN;
+  }
+
+  error = compress_stream(context, path, fpSource, fpImage);
+  fclose(fpSource);
+  free(data);
+  if (fclose(fpImage) != 0 && !error) {
+    error = ERR_FOPEN;
+  }
+  if (error) {
+    free(image);
+    return error;
+  }
+
+  final_filename = MALLOC(strlen(path) + 6);
+  strcpy(final_filename, path);
+  strcat(final_filename, ".palz");
+  asyncio_write(io, final_filename, image, image_size);
+  FREE(final_filename);
+
+  context->stats.bytes_read = size;
+  context->stats.bytes_written = image_size;
+  if (stats_enabled) {
+    stats_print(&context->stats, "compress", path);
+  }
+  if (!progress_enabled) {
+    fprintf(stderr,"Compression ratio: %s ", path);
+  }
+
+  return compress_ratio(image_size, size);
+}
+
+/**
+* Decompress a .palz file read ahead to its text in memory, written in the
+* background. Files that were not read ahead go through decompress_file().
+* @param io
+* @param context decompression context
+* @param path .palz file
+* @return compress_ratio() or an error code
+*/
+float asyncio_decompress_file(TAsyncIO *io, TDecompressContext *context,
+                                                                char *path){
+  char *data = NULL, *image = NULL, *final_filename = NULL;
+  size_t size = 0, image_size = 0;
+  FILE *fpSource = NULL, *fpImage = NULL;
+  int error;
+
+  if (!is_dot_palz(path) || asyncio_take(io, path, &data, &size) != 0 ||
+       size == 0 || (fpSource = fmemopen(data, size, "r")) == NULL) {
+    free(data);
+    return decompress_file(context, path);
+  }
+  if ((fpImage = open_memstream(&image, &image_size)) == NULL) {
+    fclose(fpSource);
+    free(data);
+    return ERR_FOPEN;
+  }
+
+  error = decompress_stream(context, fpSource, size, fpImage);
+  fclose(fpSource);
+  free(data);
+  if (fclose(fpImage) != 0 && !error) {
+    error = ERR_FOPEN;
+  }
+  if (error) {
+    free(image);
+    return error;
+  }
+
+  final_filename = MALLOC(strlen(path) + 1);
+  strcpy(final_filename, path);
+  remove_dot_palz(final_filename);
+  asyncio_write(io, final_filename, image, image_size);
+
+  if (stats_enabled) {
+    context->stats.bytes_read = size;
+    context->stats.bytes_written = image_size;
+    stats_print(&context->stats, "decompress", final_filename);
+  }
+  fprintf(stderr,"Compression ratio: %s ", final_filename);
+  FREE(final_filename);
+
+  return compress_ratio(size, image_size);
+}
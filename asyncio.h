@@ -0,0 +1,88 @@
+/**
+* @file asyncio.h
+* @brief The header file for asyncio.c
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#ifndef __ASYNCIO_H__
+#define __ASYNCIO_H__
+
+#include "common.h"
+#include "compress.h"
+#include "decompress.h"
+
+/* io_uring through its system calls, when the kernel headers have it */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ASYNCIO_HAVE_URING
+#endif
+#endif
+
+/* --io backends */
+#define ASYNCIO_OFF                     0
+#define ASYNCIO_AUTO                    1
+#define ASYNCIO_URING                   2
+#define ASYNCIO_THREADS                 3
+
+/* Larger files are not read ahead but by the worker itself */
+#define ASYNCIO_MAX_FILE                (64 << 20)
+/* Output bytes and files waiting for the disk before workers wait too */
+#define ASYNCIO_MAX_PENDING             (64 << 20)
+#define ASYNCIO_MAX_WRITES              256
+/* I/O threads of the thread backend, requests in flight with io_uring */
+#define ASYNCIO_WORKERS                 4
+#define ASYNCIO_DEPTH                   32
+
+/* States of a request */
+#define ASYNCIO_QUEUED                  0
+#define ASYNCIO_RUNNING                 1
+#define ASYNCIO_DONE                    2
+
+/* A file read ahead, or an output file written in the background */
+typedef struct asyncio_request{
+  char *path;
+  int write;
+  /* contents and bytes transferred so far */
+  char *data;
+  size_t size;
+  size_t done;
+  int fd;
+  int state;
+  int error;
+  struct asyncio_request *next;
+}TAsyncRequest;
+
+/* I/O of a folder mode, shared by the producer and the workers */
+typedef struct asyncio{
+  /* ASYNCIO_URING or ASYNCIO_THREADS */
+  int backend;
+  /* requests in order: reads until they are taken, writes until done */
+  TAsyncRequest *head;
+  TAsyncRequest *tail;
+  /* bytes and files of the writes not done yet, and writes that failed */
+  size_t pending;
+  int writes;
+  int failed;
+  int stop;
+  pthread_t threads[ASYNCIO_WORKERS];
+  int nthreads;
+  /* io_uring state, NULL with threads */
+  struct asyncio_ring *ring;
+  pthread_mutex_t mutex;
+  /* new requests for the I/O threads, finished ones for the workers */
+  pthread_cond_t queued;
+  pthread_cond_t finished;
+}TAsyncIO;
+
+TAsyncIO *asyncio_create(int backend);
+int asyncio_free(TAsyncIO **io);
+void asyncio_read(TAsyncIO *io, const char *path);
+int asyncio_take(TAsyncIO *io, const char *path, char **data, size_t *size);
+void asyncio_write(TAsyncIO *io, const char *path, char *data, size_t size);
+float asyncio_compress_file(TAsyncIO *io, TCompressContext *context,
+                                                                char *path);
+float asyncio_decompress_file(TAsyncIO *io, TDecompressContext *context,
+                                                                char *path);
+
+#endif
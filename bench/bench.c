@@ -0,0 +1,614 @@
+/**
+* @file bench.c
+* @brief End-to-end benchmark: runs palz over synthetic corpora in single file
+* and folder modes and reports throughput, ratio, peak RSS and speedup.
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "corpus.h"
+
+#define BENCH_DEFAULT_SIZE_MB           8
+#define BENCH_DEFAULT_SEED              2015
+#define BENCH_MAX_RESULTS               256
+#define BENCH_PATH_MAX                  4096
+
+typedef struct{
+  char corpus[32];
+  char mode[16];
+  char operation[16];
+  int threads;
+  long long input_bytes;
+  long long output_bytes;
+  double seconds;
+  long peak_rss_kb;
+  double speedup;
+  int ok;
+}TResult;
+
+typedef struct{
+  const char *palz;
+  const char *data;
+  size_t size;
+  unsigned long long seed;
+  int max_threads;
+  TResult results[BENCH_MAX_RESULTS];
+  int nresults;
+}TBench;
+
+/**
+* Total size of the regular files under a path.
+* @param path file or directory
+* @param palz 1 to count only .palz files, 0 to count only the others
+* @return bytes
+*/
+static long long tree_size(const char *path, int palz){
+  char next[BENCH_PATH_MAX];
+  struct dirent *dirent = NULL;
+  struct stat st;
+  long long total = 0;
+  const char *dot = NULL;
+  DIR *dir = NULL;
+
+  if (stat(path, &st) != 0) {
+    return 0;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    dot = strrchr(path, '.');
+    if ((dot != NULL && strcmp(dot, ".palz") == 0) == palz) {
+      return st.st_size;
+    }
+    return 0;
+  }
+
+  if ((dir = opendir(path)) == NULL) {
+    return 0;
+  }
+  while ((dirent = readdir(dir)) != NULL) {
+    if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+      continue;
+    }
+    snprintf(next, sizeof(next), "%s/%s", path, dirent->d_name);
+    total += tree_size(next, palz);
+  }
+  closedir(dir);
+
+  return total;
+}
+
+/**
+* Remove a file or a whole directory tree.
+* @param path
+* @param palz -1 to remove everything, 1 to remove only .palz files and 0 to
+* remove only the other regular files (directories are kept)
+*/
+static void tree_remove(const char *path, int palz){
+  char next[BENCH_PATH_MAX];
+  struct dirent *dirent = NULL;
+  struct stat st;
+  const char *dot = NULL;
+  DIR *dir = NULL;
+
+  if (lstat(path, &st) != 0) {
+    return;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    dot = strrchr(path, '.');
+    if (palz == -1 || (dot != NULL && strcmp(dot, ".palz") == 0) == palz) {
+      unlink(path);
+    }
+    return;
+  }
+
+  if ((dir = opendir(path)) != NULL) {
+    while ((dirent = readdir(dir)) != NULL) {
+      if (strcmp(dirent->d_name, ".") == 0 ||
+                                           strcmp(dirent->d_name, "..") == 0) {
+        continue;
+      }
+      snprintf(next, sizeof(next), "%s/%s", path, dirent->d_name);
+      tree_remove(next, palz);
+    }
+    closedir(dir);
+  }
+
+  if (palz == -1) {
+    rmdir(path);
+  }
+}
+
+/**
+* Copy a file or a whole directory tree.
+* @param source
+* @param destination
+* @return 0 or -1 in case of error
+*/
+static int tree_copy(const char *source, const char *destination){
+  char next_source[BENCH_PATH_MAX], next_destination[BENCH_PATH_MAX];
+  char buffer[65536];
+  struct dirent *dirent = NULL;
+  struct stat st;
+  ssize_t n;
+  int in, out, result = 0;
+  DIR *dir = NULL;
+
+  if (stat(source, &st) != 0) {
+    return -1;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    if (mkdir(destination, 0755) != 0 && errno != EEXIST) {
+      return -1;
+    }
+    if ((dir = opendir(source)) == NULL) {
+      return -1;
+    }
+    while (result == 0 && (dirent = readdir(dir)) != NULL) {
+      if (strcmp(dirent->d_name, ".") == 0 ||
+                                           strcmp(dirent->d_name, "..") == 0) {
+        continue;
+      }
+      snprintf(next_source, sizeof(next_source), "%s/%s", source,
+                                                               dirent->d_name);
+      snprintf(next_destination, sizeof(next_destination), "%s/%s",
+                                                  destination, dirent->d_name);
+      result = tree_copy(next_source, next_destination);
+    }
+    closedir(dir);
+    return result;
+  }
+
+  if ((in = open(source, O_RDONLY)) < 0) {
+    return -1;
+  }
+  if ((out = open(destination, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    close(in);
+    return -1;
+  }
+  while ((n = read(in, buffer, sizeof(buffer))) > 0) {
+    if (write(out, buffer, n) != n) {
+      result = -1;
+      break;
+    }
+  }
+  close(in);
+  close(out);
+
+  return n < 0 ? -1 : result;
+}
+
+/**
+* Compare two files or directory trees byte by byte.
+* @param first
+* @param second
+* @return 1 if equal, 0 otherwise
+*/
+static int tree_equal(const char *first, const char *second){
+  char next_first[BENCH_PATH_MAX], next_second[BENCH_PATH_MAX];
+  struct dirent *dirent = NULL;
+  struct stat st;
+  FILE *fp1 = NULL, *fp2 = NULL;
+  int c1, c2, equal = 1;
+  DIR *dir = NULL;
+
+  if (stat(first, &st) != 0) {
+    return 0;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    if ((dir = opendir(first)) == NULL) {
+      return 0;
+    }
+    while (equal && (dirent = readdir(dir)) != NULL) {
+      if (strcmp(dirent->d_name, ".") == 0 ||
+                                           strcmp(dirent->d_name, "..") == 0) {
+        continue;
+      }
+      snprintf(next_first, sizeof(next_first), "%s/%s", first, dirent->d_name);
+      snprintf(next_second, sizeof(next_second), "%s/%s", second,
+                                                               dirent->d_name);
+      equal = tree_equal(next_first, next_second);
+    }
+    closedir(dir);
+    return equal;
+  }
+
+  if ((fp1 = fopen(first, "rb")) == NULL) {
+    return 0;
+  }
+  if ((fp2 = fopen(second, "rb")) == NULL) {
+    fclose(fp1);
+    return 0;
+  }
+  do {
+    c1 = getc(fp1);
+    c2 = getc(fp2);
+  } while (c1 == c2 && c1 != EOF);
+  fclose(fp1);
+  fclose(fp2);
+
+  return c1 == c2;
+}
+
+/**
+* Run palz and wait for it.
+* @param bench
+* @param argv arguments (argv[0] is replaced by the palz path)
+* @param seconds where to store the wall-clock time
+* @param peak_rss_kb where to store the peak resident set size
+* @return 1 if palz exited successfully, 0 otherwise
+*/
+static int run_palz(TBench *bench, char **argv, double *seconds,
+                                                            long *peak_rss_kb){
+  struct timespec tb, te;
+  struct rusage usage;
+  pid_t pid;
+  int status = 0, fd;
+
+  argv[0] = (char *)bench->palz;
+
+  clock_gettime(CLOCK_MONOTONIC, &tb);
+  if ((pid = fork()) < 0) {
+    return 0;
+  }
+
+  if (pid == 0) {
+    /* palz reports ratios and times on stderr, the benchmark does not care */
+    if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    execv(bench->palz, argv);
+    _exit(127);
+  }
+
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &te);
+
+  *seconds = (te.tv_sec - tb.tv_sec) + (te.tv_nsec - tb.tv_nsec) / 1e9;
+  *peak_rss_kb = usage.ru_maxrss;
+
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+* Store a result and print it as a CSV row.
+* @param bench
+* @param result
+*/
+static void add_result(TBench *bench, TResult *result){
+  TResult *r = NULL;
+  int i;
+
+  if (bench->nresults == BENCH_MAX_RESULTS) {
+    return;
+  }
+
+  /* Speedup against the single thread run of the same corpus and operation */
+  result->speedup = 1;
+  for (i = 0; i < bench->nresults; i++) {
+    r = &bench->results[i];
+    if (r->threads == 1 && strcmp(r->corpus, result->corpus) == 0 &&
+        strcmp(r->mode, result->mode) == 0 &&
+        strcmp(r->operation, result->operation) == 0 && result->seconds > 0) {
+      result->speedup = r->seconds / result->seconds;
+    }
+  }
+
+  bench->results[bench->nresults++] = *result;
+
+  printf("%s,%s,%s,%d,%lld,%lld,%.4f,%.2f,%.3f,%ld,%.2f,%d\n",
+         result->corpus, result->mode, result->operation, result->threads,
+         result->input_bytes, result->output_bytes, result->seconds,
+         result->seconds > 0 ? result->input_bytes / 1e6 / result->seconds : 0,
+         result->output_bytes > 0 ?
+                (double)result->input_bytes / result->output_bytes : 0,
+         result->peak_rss_kb, result->speedup, result->ok);
+  fflush(stdout);
+}
+
+/**
+* Compress and decompress one file.
+* @param bench
+* @param kind corpus kind
+*/
+static void bench_file(TBench *bench, int kind){
+  char source[BENCH_PATH_MAX], work[BENCH_PATH_MAX];
+  char palz[BENCH_PATH_MAX+8];
+  char *argv[4];
+  TResult result;
+
+  snprintf(source, sizeof(source), "%s/%s.txt", bench->data, corpus_name(kind));
+  snprintf(work, sizeof(work), "%s/work/%s.txt", bench->data,
+                                                           corpus_name(kind));
+  snprintf(palz, sizeof(palz), "%s.palz", work);
+
+  memset(&result, 0, sizeof(result));
+  strcpy(result.corpus, corpus_name(kind));
+  strcpy(result.mode, "file");
+  result.threads = 1;
+  result.input_bytes = tree_size(source, 0);
+
+  tree_copy(source, work);
+
+  strcpy(result.operation, "compress");
+  argv[1] = "--compress";
+  argv[2] = work;
+  argv[3] = NULL;
+  result.ok = run_palz(bench, argv, &result.seconds, &result.peak_rss_kb);
+  result.output_bytes = tree_size(palz, 1);
+  add_result(bench, &result);
+
+  unlink(work);
+
+  strcpy(result.operation, "decompress");
+  argv[1] = "--decompress";
+  argv[2] = palz;
+  result.ok = run_palz(bench, argv, &result.seconds, &result.peak_rss_kb) &&
+                                                     tree_equal(source, work);
+  add_result(bench, &result);
+
+  unlink(work);
+  unlink(palz);
+}
+
+/**
+* Compress and decompress a folder with the parallel folder modes.
+* @param bench
+* @param name corpus name
+* @param source corpus directory
+* @param threads number of threads
+*/
+static void bench_folder(TBench *bench, const char *name, const char *source,
+                                                                  int threads){
+  char work[BENCH_PATH_MAX], nthreads[16];
+  char *argv[6];
+  TResult result;
+
+  snprintf(work, sizeof(work), "%s/work/%s/", bench->data, name);
+  snprintf(nthreads, sizeof(nthreads), "%d", threads);
+
+  memset(&result, 0, sizeof(result));
+  strncpy(result.corpus, name, sizeof(result.corpus)-1);
+  strcpy(result.mode, "folder");
+  result.threads = threads;
+  result.input_bytes = tree_size(source, 0);
+
+  tree_copy(source, work);
+
+  strcpy(result.operation, "compress");
+  argv[1] = "--parallel-folder-compress";
+  argv[2] = work;
+  argv[3] = "--compress-max-threads";
+  argv[4] = nthreads;
+  argv[5] = NULL;
+  result.ok = run_palz(bench, argv, &result.seconds, &result.peak_rss_kb);
+  result.output_bytes = tree_size(work, 1);
+  add_result(bench, &result);
+
+  tree_remove(work, 0);
+
+  strcpy(result.operation, "decompress");
+  argv[1] = "--parallel-folder-decompress";
+  argv[3] = "--decompress-max-threads";
+  result.ok = run_palz(bench, argv, &result.seconds, &result.peak_rss_kb) &&
+                                                     tree_equal(source, work);
+  add_result(bench, &result);
+
+  tree_remove(work, -1);
+}
+
+/**
+* Generate the corpora that are not on disk yet.
+* @param bench
+* @return 0 or -1 in case of error
+*/
+static int prepare_corpora(TBench *bench){
+  char path[BENCH_PATH_MAX], mixed[BENCH_PATH_MAX];
+  struct stat st;
+  int kind;
+
+  if (mkdir(bench->data, 0755) != 0 && errno != EEXIST) {
+    return -1;
+  }
+
+  snprintf(mixed, sizeof(mixed), "%s/mixed", bench->data);
+  if (mkdir(mixed, 0755) != 0 && errno != EEXIST) {
+    return -1;
+  }
+
+  for (kind = 0; kind < CORPUS_TOTAL; kind++) {
+    if (kind == CORPUS_SMALL_FILES) {
+      snprintf(path, sizeof(path), "%s/%s", bench->data, corpus_name(kind));
+    } else {
+      snprintf(path, sizeof(path), "%s/%s.txt", bench->data, corpus_name(kind));
+    }
+
+    if (stat(path, &st) == 0) {
+      continue;
+    }
+
+    fprintf(stderr, "Generating %s\n", path);
+    if (corpus_generate(kind, path, bench->size, bench->seed) != 0) {
+      return -1;
+    }
+
+    /* The mixed folder holds a copy of every single file corpus */
+    if (kind != CORPUS_SMALL_FILES) {
+      snprintf(path, sizeof(path), "%s/mixed/%s.txt", bench->data,
+                                                           corpus_name(kind));
+      if (corpus_generate(kind, path, bench->size, bench->seed) != 0) {
+        return -1;
+      }
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s/work", bench->data);
+  tree_remove(path, -1);
+  if (mkdir(path, 0755) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+* Write all results as JSON.
+* @param bench
+* @param filename
+* @return 0 or -1 in case of error
+*/
+static int write_json(TBench *bench, const char *filename){
+  TResult *r = NULL;
+  FILE *fp = NULL;
+  int i;
+
+  if ((fp = fopen(filename, "w")) == NULL) {
+    return -1;
+  }
+
+  fprintf(fp, "{\n  \"size_mb\": %zu,\n  \"seed\": %llu,\n"
+              "  \"max_threads\": %d,\n  \"results\": [\n",
+          bench->size >> 20, bench->seed, bench->max_threads);
+
+  for (i = 0; i < bench->nresults; i++) {
+    r = &bench->results[i];
+    fprintf(fp, "    {\"corpus\": \"%s\", \"mode\": \"%s\", "
+                "\"operation\": \"%s\", \"threads\": %d, "
+                "\"input_bytes\": %lld, \"output_bytes\": %lld, "
+                "\"seconds\": %.4f, \"mb_per_s\": %.2f, \"ratio\": %.3f, "
+                "\"peak_rss_kb\": %ld, \"speedup\": %.2f, \"ok\": %s}%s\n",
+            r->corpus, r->mode, r->operation, r->threads, r->input_bytes,
+            r->output_bytes, r->seconds,
+            r->seconds > 0 ? r->input_bytes / 1e6 / r->seconds : 0,
+            r->output_bytes > 0 ? (double)r->input_bytes / r->output_bytes : 0,
+            r->peak_rss_kb, r->speedup, r->ok ? "true" : "false",
+            i == bench->nresults-1 ? "" : ",");
+  }
+  fprintf(fp, "  ]\n}\n");
+
+  fclose(fp);
+  return 0;
+}
+
+/**
+* Show usage.
+* @param program
+*/
+static void usage(const char *program){
+  fprintf(stderr, "Usage: %s [-p palz] [-d data_dir] [-s size_mb] "
+                  "[-t max_threads] [-r seed] [-j output.json]\n", program);
+}
+
+/**
+* Main function. CSV rows are written to stdout as soon as each run ends.
+* @param argc number of parameters
+* @param argv array with all parameters
+*/
+int main(int argc, char *argv[]){
+  char path[BENCH_PATH_MAX];
+  const char *json = "bench_output.json";
+  TBench *bench = calloc(1, sizeof(TBench));
+  int opt, kind, threads, ok = 1, i;
+
+  bench->palz = "./palz";
+  bench->data = "bench_data";
+  bench->size = (size_t)BENCH_DEFAULT_SIZE_MB << 20;
+  bench->seed = BENCH_DEFAULT_SEED;
+  bench->max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  while ((opt = getopt(argc, argv, "p:d:s:t:r:j:h")) != -1) {
+    switch (opt) {
+      case 'p':
+      bench->palz = optarg;
+      break;
+
+      case 'd':
+      bench->data = optarg;
+      break;
+
+      case 's':
+      bench->size = (size_t)atol(optarg) << 20;
+      break;
+
+      case 't':
+      bench->max_threads = atoi(optarg);
+      break;
+
+      case 'r':
+      bench->seed = strtoull(optarg, NULL, 10);
+      break;
+
+      case 'j':
+      json = optarg;
+      break;
+
+      default:
+      usage(argv[0]);
+      free(bench);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (bench->max_threads < 1) {
+    bench->max_threads = 1;
+  }
+
+  if (prepare_corpora(bench) != 0) {
+    fprintf(stderr, "Failed to generate corpora in %s: %s\n", bench->data,
+                                                              strerror(errno));
+    free(bench);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("corpus,mode,operation,threads,input_bytes,output_bytes,seconds,"
+         "mb_per_s,ratio,peak_rss_kb,speedup,ok\n");
+
+  /* Single file mode */
+  for (kind = 0; kind < CORPUS_SMALL_FILES; kind++) {
+    bench_file(bench, kind);
+  }
+
+  /* Folder modes, 1..N threads */
+  for (threads = 1; threads <= bench->max_threads; threads++) {
+    snprintf(path, sizeof(path), "%s/%s", bench->data,
+                                              corpus_name(CORPUS_SMALL_FILES));
+    bench_folder(bench, corpus_name(CORPUS_SMALL_FILES), path, threads);
+
+    snprintf(path, sizeof(path), "%s/mixed", bench->data);
+    bench_folder(bench, "mixed", path, threads);
+  }
+
+  if (write_json(bench, json) != 0) {
+    fprintf(stderr, "Failed to write %s\n", json);
+  }
+
+  for (i = 0; i < bench->nresults; i++) {
+    ok = ok && bench->results[i].ok;
+  }
+  if (!ok) {
+    fprintf(stderr, "Some runs failed (ok=0 rows)\n");
+  }
+
+  free(bench);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,451 @@
+/**
+* @file corpus.c
+* @brief Reproducible synthetic corpora used by the benchmarks.
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "corpus.h"
+
+#define VOCABULARY_SIZE                 20000
+#define IDENTIFIERS_SIZE                600
+#define SMALL_FILE_MIN                  512
+#define SMALL_FILE_MAX                  8192
+#define SMALL_FILES_PER_DIR             50
+
+static const char *syllables[] = {
+  "ka", "lo", "me", "ri", "sa", "tu", "ne", "po", "da", "vi", "re", "the",
+  "an", "in", "on", "er", "st", "ing", "ex", "com", "pro", "ly", "tion", "al"
+};
+
+static const char *log_levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN",
+                                                                     "ERROR" };
+static const char *log_methods[] = { "GET", "GET", "POST", "PUT", "DELETE" };
+static const int log_status[] = { 200, 200, 200, 201, 204, 301, 404, 500 };
+
+static const char *c_types[] = { "int", "char *", "float", "size_t",
+                                                         "void *", "FILE *" };
+
+typedef struct{
+  char **words;
+  double *cumulative;
+  int total;
+}TVocabulary;
+
+/**
+* Seed the generator. Seed 0 is replaced because xorshift needs a non-zero
+* state.
+* @param random generator
+* @param seed
+*/
+void random_seed(TRandom *random, unsigned long long seed){
+  random->state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+* Next pseudo-random number (xorshift64*).
+* @param random generator
+* @return 64 bits number
+*/
+unsigned long long random_next(TRandom *random){
+  random->state ^= random->state >> 12;
+  random->state ^= random->state << 25;
+  random->state ^= random->state >> 27;
+  return random->state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+* Pseudo-random number in [0, 1).
+* @param random generator
+* @return number
+*/
+double random_double(TRandom *random){
+  return (random_next(random) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+* Pseudo-random integer in [0, max).
+* @param random generator
+* @param max upper bound
+* @return number
+*/
+static int random_int(TRandom *random, int max){
+  return (int)(random_next(random) % (unsigned long long)max);
+}
+
+/**
+* Build a vocabulary of syllable based words with Zipfian frequencies
+* (exponent 1).
+* @param vocabulary vocabulary to fill
+* @param total number of words
+* @param random generator
+*/
+static void vocabulary_create(TVocabulary *vocabulary, int total,
+                                                             TRandom *random){
+  int nsyllables = sizeof(syllables)/sizeof(syllables[0]);
+  char buffer[64];
+  double sum = 0;
+  int i, j, n;
+
+  vocabulary->words = malloc(sizeof(char*)*total);
+  vocabulary->cumulative = malloc(sizeof(double)*total);
+  vocabulary->total = total;
+
+  for (i = 0; i < total; i++) {
+    buffer[0] = '\0';
+    /* frequent words are short, like in natural languages */
+    n = 1 + random_int(random, i < 100 ? 2 : 4);
+    for (j = 0; j < n; j++) {
+      strcat(buffer, syllables[random_int(random, nsyllables)]);
+    }
+    vocabulary->words[i] = strdup(buffer);
+
+    sum += 1.0 / (i + 1);
+    vocabulary->cumulative[i] = sum;
+  }
+  for (i = 0; i < total; i++) {
+    vocabulary->cumulative[i] /= sum;
+  }
+}
+
+/**
+* Free a vocabulary.
+* @param vocabulary
+*/
+static void vocabulary_free(TVocabulary *vocabulary){
+  int i;
+
+  for (i = 0; i < vocabulary->total; i++) {
+    free(vocabulary->words[i]);
+  }
+  free(vocabulary->words);
+  free(vocabulary->cumulative);
+}
+
+/**
+* Pick a word following the vocabulary distribution.
+* @param vocabulary
+* @param random generator
+* @return word
+*/
+static const char *vocabulary_pick(TVocabulary *vocabulary, TRandom *random){
+  double u = random_double(random);
+  int low = 0, high = vocabulary->total - 1, middle;
+
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (vocabulary->cumulative[middle] < u) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return vocabulary->words[low];
+}
+
+/**
+* English-like text: sentences of Zipfian words, wrapped lines and
+* paragraphs.
+* @param fp destination
+* @param size bytes to write (approximately)
+* @param random generator
+*/
+static void generate_text(FILE *fp, size_t size, TRandom *random){
+  TVocabulary vocabulary;
+  const char *word;
+  size_t written = 0;
+  int column = 0, sentence = 0, len, first = 1;
+
+  vocabulary_create(&vocabulary, VOCABULARY_SIZE, random);
+
+  while (written < size) {
+    word = vocabulary_pick(&vocabulary, random);
+    len = strlen(word);
+
+    if (column + len + 1 > 72) {
+      fputc('\n', fp);
+      written++;
+      column = 0;
+    } else if (column > 0) {
+      fputc(' ', fp);
+      written++;
+      column++;
+    }
+
+    if (first) {
+      fputc(toupper((unsigned char)word[0]), fp);
+      fputs(word + 1, fp);
+      first = 0;
+    } else {
+      fputs(word, fp);
+    }
+    written += len;
+    column += len;
+    sentence++;
+
+    if (sentence > 4 && random_int(random, 10) == 0) {
+      fputc(random_int(random, 8) < 6 ? '.' : "?!"[random_int(random, 2)], fp);
+      written++;
+      column++;
+      sentence = 0;
+      first = 1;
+
+      /* new paragraph */
+      if (random_int(random, 8) == 0) {
+        fputs("\n\n", fp);
+        written += 2;
+        column = 0;
+      }
+    } else if (random_int(random, 12) == 0) {
+      fputc(random_int(random, 4) ? ',' : ';', fp);
+      written++;
+      column++;
+    }
+  }
+  fputc('\n', fp);
+
+  vocabulary_free(&vocabulary);
+}
+
+/**
+* Structured access logs with timestamps, levels and key=value fields.
+* @param fp destination
+* @param size bytes to write (approximately)
+* @param random generator
+*/
+static void generate_logs(FILE *fp, size_t size, TRandom *random){
+  TVocabulary vocabulary;
+  const char *level, *method, *resource, *action;
+  long seconds = 0;
+  int n, milliseconds, worker, object, status, latency;
+  int nlevels = sizeof(log_levels)/sizeof(log_levels[0]);
+  int nmethods = sizeof(log_methods)/sizeof(log_methods[0]);
+  int nstatus = sizeof(log_status)/sizeof(log_status[0]);
+  unsigned long long request;
+  size_t written = 0;
+
+  vocabulary_create(&vocabulary, 300, random);
+
+  /* values are drawn in a fixed order so the output never depends on the
+     argument evaluation order of the compiler */
+  while (written < size) {
+    seconds += random_int(random, 3);
+    milliseconds = random_int(random, 1000);
+    level = log_levels[random_int(random, nlevels)];
+    worker = random_int(random, 16);
+    method = log_methods[random_int(random, nmethods)];
+    resource = vocabulary_pick(&vocabulary, random);
+    action = vocabulary_pick(&vocabulary, random);
+    object = random_int(random, 5000);
+    status = log_status[random_int(random, nstatus)];
+    latency = random_int(random, 2000);
+    request = random_next(random);
+
+    n = fprintf(fp, "2015-01-%02ld %02ld:%02ld:%02ld.%03d %s [worker-%d] "
+                    "%s /api/v1/%s/%s/%d status=%d latency_ms=%d "
+                    "req_id=%016llx\n",
+                1 + (seconds / 86400) % 28, (seconds / 3600) % 24,
+                (seconds / 60) % 60, seconds % 60, milliseconds, level, worker,
+                method, resource, action, object, status, latency, request);
+    written += n;
+  }
+
+  vocabulary_free(&vocabulary);
+}
+
+/**
+* Pick several identifiers, in order.
+* @param identifiers vocabulary
+* @param words where to store the identifiers
+* @param n number of identifiers
+* @param random generator
+*/
+static void pick_identifiers(TVocabulary *identifiers, const char **words,
+                                                       int n, TRandom *random){
+  int i;
+
+  for (i = 0; i < n; i++) {
+    words[i] = vocabulary_pick(identifiers, random);
+  }
+}
+
+/**
+* C-like source code: functions, declarations, loops and comments.
+* @param fp destination
+* @param size bytes to write (approximately)
+* @param random generator
+*/
+static void generate_source(FILE *fp, size_t size, TRandom *random){
+  TVocabulary identifiers;
+  const char *w[5];
+  const char *type, *parameter_type;
+  int ntypes = sizeof(c_types)/sizeof(c_types[0]);
+  int statements, i, value;
+  long position = 0;
+
+  vocabulary_create(&identifiers, IDENTIFIERS_SIZE, random);
+
+  while ((size_t)position < size) {
+    pick_identifiers(&identifiers, w, 5, random);
+    fprintf(fp, "/**\n* %s the %s of a given %s.\n* @param %s\n* @return %s\n"
+                "*/\n", w[0], w[1], w[2], w[3], w[4]);
+
+    type = c_types[random_int(random, ntypes)];
+    parameter_type = c_types[random_int(random, ntypes)];
+    pick_identifiers(&identifiers, w, 3, random);
+    fprintf(fp, "%s %s_%s(%s %s){\n", type, w[0], w[1], parameter_type, w[2]);
+
+    statements = 2 + random_int(random, 10);
+    for (i = 0; i < statements; i++) {
+      switch (random_int(random, 4)) {
+        case 0:
+        type = c_types[random_int(random, ntypes)];
+        pick_identifiers(&identifiers, w, 1, random);
+        value = random_int(random, 100);
+        fprintf(fp, "  %s %s = %d;\n", type, w[0], value);
+        break;
+
+        case 1:
+        pick_identifiers(&identifiers, w, 3, random);
+        fprintf(fp, "  for (i = 0; i < %s; i++) {\n    %s[i] += %s;\n  }\n",
+                                                             w[0], w[1], w[2]);
+        break;
+
+        case 2:
+        pick_identifiers(&identifiers, w, 1, random);
+        fprintf(fp, "  if (%s == NULL) {\n    return -1;\n  }\n", w[0]);
+        break;
+
+        default:
+        pick_identifiers(&identifiers, w, 3, random);
+        fprintf(fp, "  %s(%s, %s);\n", w[0], w[1], w[2]);
+      }
+    }
+    fprintf(fp, "  return 0;\n}\n\n");
+    position = ftell(fp);
+  }
+
+  vocabulary_free(&identifiers);
+}
+
+/**
+* Write one corpus file.
+* @param kind CORPUS_TEXT, CORPUS_LOGS or CORPUS_SOURCE
+* @param filename destination
+* @param size bytes to write (approximately)
+* @param random generator
+* @return 0 or -1 in case of error
+*/
+static int generate_file(int kind, const char *filename, size_t size,
+                                                             TRandom *random){
+  FILE *fp = NULL;
+
+  if ((fp = fopen(filename, "w")) == NULL) {
+    return -1;
+  }
+
+  switch (kind) {
+    case CORPUS_TEXT:
+    generate_text(fp, size, random);
+    break;
+
+    case CORPUS_LOGS:
+    generate_logs(fp, size, random);
+    break;
+
+    default:
+    generate_source(fp, size, random);
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+/**
+* Many small files of every kind spread over a directory tree.
+* @param path root directory
+* @param size total bytes to write (approximately)
+* @param random generator
+* @return 0 or -1 in case of error
+*/
+static int generate_small_files(const char *path, size_t size,
+                                                             TRandom *random){
+  char filename[4096];
+  size_t written = 0, file_size;
+  int n = 0;
+
+  while (written < size) {
+    if (n % SMALL_FILES_PER_DIR == 0) {
+      snprintf(filename, sizeof(filename), "%s/d%04d", path,
+                                                     n / SMALL_FILES_PER_DIR);
+      if (mkdir(filename, 0755) != 0 && errno != EEXIST) {
+        return -1;
+      }
+    }
+
+    file_size = SMALL_FILE_MIN + random_int(random,
+                                             SMALL_FILE_MAX - SMALL_FILE_MIN);
+    snprintf(filename, sizeof(filename), "%s/d%04d/f%06d.txt", path,
+                                                 n / SMALL_FILES_PER_DIR, n);
+    if (generate_file(n % 3, filename, file_size, random) != 0) {
+      return -1;
+    }
+
+    written += file_size;
+    n++;
+  }
+  return 0;
+}
+
+/**
+* Name of a corpus kind.
+* @param kind
+* @return name
+*/
+const char *corpus_name(int kind){
+  switch (kind) {
+    case CORPUS_TEXT:
+    return "text";
+
+    case CORPUS_LOGS:
+    return "logs";
+
+    case CORPUS_SOURCE:
+    return "source";
+
+    default:
+    return "small-files";
+  }
+}
+
+/**
+* Generate a corpus. The same kind, size and seed always produce the same
+* bytes.
+* @param kind corpus kind
+* @param path file to create (or directory for CORPUS_SMALL_FILES)
+* @param size bytes to write (approximately)
+* @param seed
+* @return 0 or -1 in case of error
+*/
+int corpus_generate(int kind, const char *path, size_t size,
+                                                      unsigned long long seed){
+  TRandom random;
+
+  random_seed(&random, seed + kind);
+
+  if (kind == CORPUS_SMALL_FILES) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+      return -1;
+    }
+    return generate_small_files(path, size, &random);
+  }
+  return generate_file(kind, path, size, &random);
+}
@@ -0,0 +1,32 @@
+/**
+* @file corpus.h
+* @brief The header file for corpus.c
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#ifndef __CORPUS_H__
+#define __CORPUS_H__
+
+#include <stddef.h>
+
+#define CORPUS_TEXT                     0
+#define CORPUS_LOGS                     1
+#define CORPUS_SOURCE                   2
+#define CORPUS_SMALL_FILES              3
+#define CORPUS_TOTAL                    4
+
+/* Deterministic pseudo-random generator (xorshift64*) */
+typedef struct{
+  unsigned long long state;
+}TRandom;
+
+void random_seed(TRandom *random, unsigned long long seed);
+unsigned long long random_next(TRandom *random);
+double random_double(TRandom *random);
+
+const char *corpus_name(int kind);
+int corpus_generate(int kind, const char *path, size_t size,
+                                                      unsigned long long seed);
+
+#endif
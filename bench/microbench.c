@@ -0,0 +1,372 @@
+/**
+* @file microbench.c
+* @brief Microbenchmarks for the codec kernels, linked against the real
+* object files: hashtable lookups, the write_binary() tokenizer, the
+* dictionary sort and the per-token decode of decompress_file().
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include "../common.h"
+#include "../compress.h"
+#include "../decompress.h"
+#include "corpus.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC                      1
+#endif
+
+#define MICROBENCH_DEFAULT_SIZE_MB      4
+#define MICROBENCH_MIN_SECONDS          0.2
+#define MICROBENCH_LOOKUPS              1000000
+
+typedef struct{
+  struct timespec time;
+  unsigned long long cycles;
+}TTimer;
+
+typedef struct{
+  char *data;
+  size_t size;
+  char **words;
+  int nwords;
+}TCorpus;
+
+/**
+* Start a measurement.
+* @param timer
+*/
+static void timer_start(TTimer *timer){
+  clock_gettime(CLOCK_MONOTONIC, &timer->time);
+#ifdef HAVE_RDTSC
+  timer->cycles = __rdtsc();
+#else
+  timer->cycles = 0;
+#endif
+}
+
+/**
+* End a measurement.
+* @param timer started timer
+* @param cycles where to store the elapsed cycles (0 if not available)
+* @return elapsed nanoseconds
+*/
+static double timer_stop(TTimer *timer, double *cycles){
+  struct timespec now;
+
+#ifdef HAVE_RDTSC
+  *cycles = (double)(__rdtsc() - timer->cycles);
+#else
+  *cycles = 0;
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - timer->time.tv_sec) * 1e9 +
+                                        (now.tv_nsec - timer->time.tv_nsec);
+}
+
+/**
+* Print one result row.
+* @param kernel kernel name
+* @param param kernel parameter
+* @param ops operations measured
+* @param bytes bytes processed by those operations
+* @param ns elapsed nanoseconds
+* @param cycles elapsed cycles
+*/
+static void report(const char *kernel, const char *param, double ops,
+                                       double bytes, double ns, double cycles){
+  printf("%s,%s,%.0f,%.2f,%.3f\n", kernel, param, ops, ns / ops,
+                                           bytes > 0 ? cycles / bytes : 0);
+  fflush(stdout);
+}
+
+/**
+* Silence the ratio lines the codec prints on stderr.
+* @param saved stderr descriptor saved by a previous call, or -1 to silence
+* @return descriptor to pass back to restore stderr
+*/
+static int quiet(int saved){
+  int fd;
+
+  fflush(stderr);
+  if (saved < 0) {
+    saved = dup(STDERR_FILENO);
+    if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    return saved;
+  }
+  dup2(saved, STDERR_FILENO);
+  close(saved);
+  return -1;
+}
+
+/**
+* Read a generated corpus into memory and split it into distinct words, the
+* same way compress_file() does.
+* @param corpus corpus to fill
+* @param filename
+* @return 0 or -1 in case of error
+*/
+static int corpus_load(TCorpus *corpus, const char *filename){
+  HASHTABLE_T *table = tabela_criar(101, NULL);
+  char *copy = NULL, *word = NULL, *last_word = NULL;
+  FILE *fp = NULL;
+
+  if ((fp = fopen(filename, "r")) == NULL) {
+    return -1;
+  }
+  fseek(fp, 0, SEEK_END);
+  corpus->size = ftell(fp);
+  rewind(fp);
+  corpus->data = MALLOC(corpus->size + 1);
+  corpus->size = fread(corpus->data, 1, corpus->size, fp);
+  corpus->data[corpus->size] = '\0';
+  fclose(fp);
+
+  corpus->words = NULL;
+  corpus->nwords = 0;
+
+  copy = strdup(corpus->data);
+  word = strtok_r(copy, PALZ_SEPARATORS, &last_word);
+  while (word) {
+    if (tabela_consultar(table, word) == NULL) {
+      tabela_inserir(table, word, NULL);
+      corpus->words = realloc(corpus->words,
+                                        sizeof(char*)*(corpus->nwords + 1));
+      corpus->words[corpus->nwords++] = strdup(word);
+    }
+    word = strtok_r(NULL, PALZ_SEPARATORS, &last_word);
+  }
+  free(copy);
+  tabela_destruir(&table);
+
+  return 0;
+}
+
+/**
+* Hashtable lookups (hashing_string() plus probing) at several load factors.
+* Half of the lookups hit and half miss.
+* @param corpus
+*/
+static void bench_lookup(TCorpus *corpus){
+  static const double load_factors[] = { 0.1, 0.25, 0.4, 0.49 };
+  HASHTABLE_T *table = NULL;
+  char miss[256], param[32];
+  double ns, cycles, bytes = 0;
+  int n = corpus->nwords, i, j, k;
+  TTimer timer;
+  void *volatile sink;
+
+  for (k = 0; k < (int)(sizeof(load_factors)/sizeof(load_factors[0])); k++) {
+    /* tabela_inserir() rehashes at 0.5, so size the table up front */
+    table = tabela_criar((int)(n / load_factors[k]) + 1, NULL);
+    for (i = 0; i < n; i++) {
+      tabela_inserir(table, corpus->words[i], corpus->words[i]);
+    }
+
+    bytes = 0;
+    timer_start(&timer);
+    for (j = 0; j < MICROBENCH_LOOKUPS; j++) {
+      i = (int)(((long long)j * 7919) % n);
+      if (j & 1) {
+        sink = tabela_consultar(table, corpus->words[i]);
+        bytes += strlen(corpus->words[i]);
+      } else {
+        /* separators never appear inside words, so this always misses */
+        snprintf(miss, sizeof(miss), "%s-", corpus->words[i]);
+        sink = tabela_consultar(table, miss);
+        bytes += strlen(miss);
+      }
+    }
+    ns = timer_stop(&timer, &cycles);
+    (void)sink;
+
+    snprintf(param, sizeof(param), "load=%.2f", load_factors[k]);
+    report("tabela_consultar", param, MICROBENCH_LOOKUPS, bytes, ns, cycles);
+
+    tabela_destruir(&table);
+  }
+}
+
+/**
+* Separator tokenizer and encoder of write_binary(), from memory to
+* /dev/null.
+* @param corpus
+*/
+static void bench_tokenizer(TCorpus *corpus){
+  TCompressContext *context = compress_context_create();
+  FILE *fpSource = NULL, *fpFinal = NULL;
+  double ns = 0, cycles = 0, total_cycles = 0, runs = 0;
+  int *value = NULL, i;
+  TTimer timer;
+
+  for (i = 0; i < corpus->nwords; i++) {
+    value = arena_alloc(context->arena, sizeof(int));
+    *value = i + context->separators.count + 1;
+    tabela_inserir(context->table, corpus->words[i], value);
+  }
+
+  fpFinal = fopen("/dev/null", "w");
+  while (ns < MICROBENCH_MIN_SECONDS * 1e9) {
+    fpSource = fmemopen(corpus->data, corpus->size, "r");
+    timer_start(&timer);
+    write_binary(context, &fpSource, &fpFinal,
+                                         bytes_for_int(corpus->nwords + 14));
+    ns += timer_stop(&timer, &cycles);
+    total_cycles += cycles;
+    fclose(fpSource);
+    runs++;
+  }
+  fclose(fpFinal);
+
+  report("write_binary", "per byte", runs * corpus->size,
+                                       runs * corpus->size, ns, total_cycles);
+
+  compress_context_free(&context);
+}
+
+/**
+* Dictionary sort (qsort() with cmpstringp()) of the distinct words.
+* @param corpus
+*/
+static void bench_sort(TCorpus *corpus){
+  char **array = MALLOC(sizeof(char*)*corpus->nwords);
+  double ns = 0, cycles = 0, total_cycles = 0, runs = 0, bytes = 0;
+  char param[32];
+  TTimer timer;
+  int i;
+
+  for (i = 0; i < corpus->nwords; i++) {
+    bytes += strlen(corpus->words[i]);
+  }
+
+  while (ns < MICROBENCH_MIN_SECONDS * 1e9) {
+    /* words are in first appearance order, like in compress_file() */
+    memcpy(array, corpus->words, sizeof(char*)*corpus->nwords);
+    timer_start(&timer);
+    qsort(array, corpus->nwords, sizeof(char *), cmpstringp);
+    ns += timer_stop(&timer, &cycles);
+    total_cycles += cycles;
+    runs++;
+  }
+
+  snprintf(param, sizeof(param), "n=%d", corpus->nwords);
+  report("qsort(cmpstringp)", param, runs * corpus->nwords, runs * bytes, ns,
+                                                                 total_cycles);
+  FREE(array);
+}
+
+/**
+* Per-token decode of decompress_file().
+* @param corpus text to compress and then decode repeatedly
+* @param corpus_file file the corpus was loaded from
+*/
+static void bench_decode(TCorpus *corpus, const char *corpus_file){
+  TCompressContext *compress_context = compress_context_create();
+  TDecompressContext *context = decompress_context_create();
+  char name[4128], palz[4136], target[4136], *line = NULL;
+  double ns = 0, cycles = 0, total_cycles = 0, runs = 0, tokens;
+  long header = 0, palz_size;
+  size_t len = 0;
+  int words, bytes, i, saved = quiet(-1);
+  TTimer timer;
+  FILE *fp = NULL;
+
+  snprintf(name, sizeof(name), "%s.decode", corpus_file);
+  snprintf(palz, sizeof(palz), "%s.palz", name);
+  fp = fopen(name, "w");
+  fwrite(corpus->data, 1, corpus->size, fp);
+  fclose(fp);
+  compress_file(compress_context, name);
+  unlink(name);
+
+  /* Count the tokens of the binary code */
+  fp = fopen(palz, "r");
+  getline(&line, &len, fp);
+  getline(&line, &len, fp);
+  words = atoi(line);
+  for (i = 0; i < words; i++) {
+    getline(&line, &len, fp);
+  }
+  header = ftell(fp);
+  fseek(fp, 0, SEEK_END);
+  palz_size = ftell(fp);
+  fclose(fp);
+  FREE(line);
+
+  bytes = bytes_for_int(words + 14);
+  tokens = (double)(palz_size - header) / bytes;
+
+  while (ns < MICROBENCH_MIN_SECONDS * 1e9) {
+    /* decompress_file() strips .palz from the name it is given */
+    strcpy(target, palz);
+    timer_start(&timer);
+    decompress_file(context, target);
+    ns += timer_stop(&timer, &cycles);
+    total_cycles += cycles;
+    runs++;
+  }
+  quiet(saved);
+
+  report("decompress_file", "per token", runs * tokens,
+                                  runs * get_size(name), ns, total_cycles);
+
+  unlink(name);
+  unlink(palz);
+  compress_context_free(&compress_context);
+  decompress_context_free(&context);
+}
+
+/**
+* Main function. Results are written as CSV: kernel, parameter, number of
+* operations, ns/op and cycles/byte.
+* @param argc number of parameters
+* @param argv array with all parameters
+*/
+int main(int argc, char *argv[]){
+  char filename[4096];
+  size_t size = (size_t)MICROBENCH_DEFAULT_SIZE_MB << 20;
+  const char *directory = "bench_data";
+  TCorpus corpus;
+  int i;
+
+  if (argc > 1) {
+    directory = argv[1];
+  }
+  if (argc > 2) {
+    size = (size_t)atol(argv[2]) << 20;
+  }
+
+  if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "mkdir(%s) failed\n", directory);
+    exit(EXIT_FAILURE);
+  }
+  snprintf(filename, sizeof(filename), "%s/micro-text.txt", directory);
+  if (corpus_generate(CORPUS_TEXT, filename, size, 2015) != 0 ||
+                                          corpus_load(&corpus, filename) != 0) {
+    fprintf(stderr, "Failed to generate %s\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+#ifndef HAVE_RDTSC
+  fprintf(stderr, "cycles/byte not available on this architecture\n");
+#endif
+
+  printf("kernel,param,ops,ns_per_op,cycles_per_byte\n");
+  bench_lookup(&corpus);
+  bench_tokenizer(&corpus);
+  bench_sort(&corpus);
+  bench_decode(&corpus, filename);
+
+  for (i = 0; i < corpus.nwords; i++) {
+    free(corpus.words[i]);
+  }
+  free(corpus.words);
+  FREE(corpus.data);
+
+  return 0;
+}
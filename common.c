@@ -5,83 +5,82 @@
 * @author Fabio Santos <ffsantos92@gmail.com>
 * @author Eurico Sousa <2110133@my.ipleiria.pt>
 */
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
 #include "common.h"
 #include "compress.h"
+#include "crc32c.h"
+#include "grep.h"
+#include "manifest.h"
+#include "archive.h"
+#include "asyncio.h"
+#include "progress.h"
+#include "journal.h"
 
 /* Global vars */
 int got_signal = 0;
 
+/* External variables */
+extern TGrepQuery grep_query;
+
 /**
-* Free resources used on decompress functions.
-* @param dictionary
+* Build a separator set. Separators get token IDs 1 to count in the given
+* order. The newline must be one of them (the .palz header has one word per
+* line) and the NUL character can't be.
+* @param set set to fill
+* @param chars separator characters
+* @param count number of characters
+* @return 0 or -1 if chars is not a valid set
 */
-void decompress_resources_free(TDictionary **dictionary){
-  TDictionary *aux = NULL;
-  aux = *dictionary;
+int separators_init(TSeparators *set, const char *chars, int count){
+  unsigned char c;
+  int i;
+
+  memset(set->ids, 0, sizeof(set->ids));
+  set->count = 0;
+
+  if (count > 255) {
+    return -1;
+  }
 
-  dictionary_free(&aux);
+  for (i = 0; i < count; i++) {
+    c = chars[i];
+    if (c == '\0' || set->ids[c] != 0) {
+      return -1;
+    }
+    set->chars[i] = c;
+    set->ids[c] = i + 1;
+  }
+  set->count = count;
+
+  return set->ids['\n'] != 0 ? 0 : -1;
 }
 
 /**
-* Initialize decompress resources.
-* @param dictionary
+* Check if a separator set is PALZ_SEPARATORS, in the same order.
+* @param set
+* @return 1 if true, 0 if false
 */
-void decompress_resources_init(TDictionary **dictionary){
-  dictionary_init(dictionary);
+int separators_is_default(const TSeparators *set){
+  return set->count == (int)strlen(PALZ_SEPARATORS) &&
+                memcmp(set->chars, PALZ_SEPARATORS, set->count) == 0;
 }
 
 /**
-* Initialize dictionary with 14 elements (separators).
+* Initialize an empty dictionary.
 * @param dictionary
 */
 void dictionary_init(TDictionary **dictionary){
   TDictionary *aux = MALLOC(sizeof(TDictionary));
 
-  aux->element = MALLOC(sizeof(TElement) * 14);
-
-  aux->element[0].nElement = 1;
-  aux->element[0].element = "\n";
-
-  aux->element[1].nElement = 2;
-  aux->element[1].element = "\t";
-
-  aux->element[2].nElement = 3;
-  aux->element[2].element = "\r";
-
-  aux->element[3].nElement = 4;
-  aux->element[3].element = " ";
-
-  aux->element[4].nElement = 5;
-  aux->element[4].element = "?";
-
-  aux->element[5].nElement = 6;
-  aux->element[5].element = "!";
-
-  aux->element[6].nElement = 7;
-  aux->element[6].element = ".";
-
-  aux->element[7].nElement = 8;
-  aux->element[7].element = ";";
-
-  aux->element[8].nElement = 9;
-  aux->element[8].element = ",";
-
-  aux->element[9].nElement = 10;
-  aux->element[9].element = ":";
-
-  aux->element[10].nElement = 11;
-  aux->element[10].element = "+";
-
-  aux->element[11].nElement = 12;
-  aux->element[11].element = "-";
-
-  aux->element[12].nElement = 13;
-  aux->element[12].element = "*";
-
-  aux->element[13].nElement = 14;
-  aux->element[13].element = "/";
-
-  aux->nElements = 14;
+  aux->nElements = 0;
+  aux->nAllocated = 0;
+  aux->text = NULL;
+  aux->text_used = 0;
+  aux->text_size = 0;
+  aux->offset = MALLOC(sizeof(size_t));
+  aux->offset[0] = 0;
   *dictionary = aux;
 }
 
@@ -89,22 +88,30 @@ void dictionary_init(TDictionary **dictionary){
 * Add a new element to dictionary.
 * @param dictionary
 * @param element
-* @param size
+* @param size length of element plus one
 */
 void dictionary_add_element(TDictionary **dictionary, char **element, int size){
   TDictionary *aux = NULL;
   char *auxElement = NULL;
+  size_t length = size-1;
 
   aux = *dictionary;
   auxElement = *element;
-  if(aux->nElements == 0)
-    aux->element = MALLOC(sizeof(TElement));
-  else
-	aux->element = realloc(aux->element, sizeof(TElement) * (aux->nElements + 1));
+  if(aux->nElements == aux->nAllocated){
+    aux->nAllocated = aux->nAllocated ? aux->nAllocated*2 : 64;
+    aux->offset = realloc(aux->offset, sizeof(size_t) * (aux->nAllocated+1));
+  }
+  if(aux->text_used + length > aux->text_size){
+    aux->text_size = aux->text_size ? aux->text_size*2 : 4096;
+    if(aux->text_size < aux->text_used + length){
+      aux->text_size = aux->text_used + length;
+    }
+    aux->text = realloc(aux->text, aux->text_size);
+  }
+  memcpy(aux->text + aux->text_used, auxElement, length);
+  aux->text_used += length;
   aux->nElements += 1;
-  aux->element[aux->nElements-1].nElement = aux->nElements;
-  aux->element[aux->nElements-1].element = MALLOC(sizeof(char)*size);
-  strcpy(aux->element[aux->nElements-1].element, auxElement);
+  aux->offset[aux->nElements] = aux->text_used;
 }
 
 /**
@@ -116,18 +123,16 @@ int dictionary_free(TDictionary **dictionary){
   TDictionary *aux = NULL;
   aux = *dictionary;
 
-  if (aux->nElements > 14){
-    dictionary_restart(&aux);
-  }
-
-  FREE(aux->element);
-  FREE(aux);
+  FREE(aux->text);
+  FREE(aux->offset);
+  FREE(*dictionary);
 
   return 0;
 }
 
 /**
-* Remove extra dictionary elements (all non-separators).
+* Remove all dictionary elements. The allocated capacity is kept for the next
+* file.
 * @param dictionary
 * @return 0
 */
@@ -135,22 +140,166 @@ int dictionary_restart(TDictionary **dictionary){
   TDictionary *aux = NULL;
   aux = *dictionary;
 
-  int i = 0;
+  aux->nElements = 0;
+  aux->text_used = 0;
+
+  return 0;
+}
+
+/**
+* Store an integer as count little-endian bytes.
+* @param bytes where to store it
+* @param value
+* @param count number of bytes (up to 8)
+*/
+void le_store(unsigned char *bytes, unsigned long long value, int count){
+  int i;
+
+  for (i = 0; i < count; i++) {
+    bytes[i] = value >> (8*i);
+  }
+}
+
+/**
+* Load an integer stored as count little-endian bytes.
+* @param bytes
+* @param count number of bytes (up to 8)
+* @return value
+*/
+unsigned long long le_load(const unsigned char *bytes, int count){
+  unsigned long long value = 0;
+  int i;
 
-  for (i=aux->nElements; i>14; i--) {
-    FREE(aux->element[i-1].element);
+  for (i = count - 1; i >= 0; i--) {
+    value = value << 8 | bytes[i];
   }
 
-  aux->element = realloc(aux->element, sizeof(TElement)*14);
-  aux->nElements = 14;
+  return value;
+}
+
+/**
+* Write a checksummed block: type, payload length, payload and the CRC-32C of
+* the three.
+* @param fp file to write to
+* @param type block type (PALZ_BLOCK_*)
+* @param payload
+* @param length payload length, up to PALZ_BLOCK_SIZE
+* @return 0 or -1 if the write failed
+*/
+int block_write(FILE *fp, int type, const void *payload, size_t length){
+  unsigned char header[PALZ_BLOCK_HEADER], check[4];
+  unsigned int crc;
+
+  header[0] = type;
+  le_store(header + 1, length, 4);
+  crc = crc32c(0, header, PALZ_BLOCK_HEADER);
+  le_store(check, crc32c(crc, payload, length), 4);
+
+  if (fwrite(header, 1, PALZ_BLOCK_HEADER, fp) != PALZ_BLOCK_HEADER ||
+                                 fwrite(payload, 1, length, fp) != length ||
+                                 fwrite(check, 1, 4, fp) != 4) {
+    return -1;
+  }
 
   return 0;
 }
 
+/**
+* Read and verify a checksummed block.
+* @param fp file positioned at the block
+* @param type where to store the block type
+* @param payload where to store the payload
+* @param size room in payload
+* @param length where to store the payload length
+* @return 0 or ERR_PALZCORRUPTED if the block is cut short, too long or does
+* not match its checksum
+*/
+int block_read(FILE *fp, int *type, unsigned char *payload, size_t size,
+                                                               size_t *length){
+  unsigned char header[PALZ_BLOCK_HEADER], check[4];
+  unsigned int crc;
+
+  if (fread(header, 1, PALZ_BLOCK_HEADER, fp) != PALZ_BLOCK_HEADER) {
+    return ERR_PALZCORRUPTED;
+  }
+  *type = header[0];
+  *length = le_load(header + 1, 4);
+  if (*length > size || fread(payload, 1, *length, fp) != *length ||
+                                               fread(check, 1, 4, fp) != 4) {
+    return ERR_PALZCORRUPTED;
+  }
+
+  crc = crc32c(0, header, PALZ_BLOCK_HEADER);
+  if (crc32c(crc, payload, *length) != le_load(check, 4)) {
+    return ERR_PALZCORRUPTED;
+  }
+
+  return 0;
+}
+
+/**
+* Copy bytes of a file to the current position of another without bringing
+* them to user space: copy_file_range() (a raw system call, as glibc may not
+* declare it), sendfile() where it can't be used (older kernels, across file
+* systems), and pread() and write() as the last resort.
+* @param in source file descriptor
+* @param offset where to start in the source, moved past the bytes copied
+* @param out destination file descriptor
+* @param length bytes to copy
+* @return bytes copied (less than length at the end of the source) or -1
+*/
+long long file_copy(int in, off_t *offset, int out, unsigned long long length){
+  unsigned long long done = 0;
+  char buffer[65536];
+  size_t chunk;
+  ssize_t n = 0, w, written;
+  int method = 0;
+
+#ifndef __NR_copy_file_range
+  method = 1;
+#endif
+  while (done < length) {
+    chunk = length - done < (1 << 30) ? length - done : (1 << 30);
+#ifdef __NR_copy_file_range
+    if (method == 0 && (n = syscall(__NR_copy_file_range, in, offset, out,
+                                                   NULL, chunk, 0)) < 0 &&
+        (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                               errno == EOPNOTSUPP || errno == EBADF)) {
+      method = 1;
+    }
+#endif
+    if (method == 1 && (n = sendfile(out, in, offset, chunk)) < 0 &&
+                                      (errno == EINVAL || errno == ENOSYS)) {
+      method = 2;
+    }
+    if (method == 2 && (n = pread(in, buffer, chunk < sizeof(buffer) ? chunk :
+                                         sizeof(buffer), *offset)) > 0) {
+      for (written = 0; written < n; written += w) {
+        if ((w = write(out, buffer + written, n - written)) < 0) {
+          return -1;
+        }
+      }
+      *offset += n;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+
+  return done;
+}
+
 /**
 * Check how many bytes are necessary to represent a given number.
 * @param max_value integer number
-* @return number of bytes or -1 if max_value must be represented with 4 bytes
+* @return number of bytes (1 to 4). Format 1 files can't use 4.
 */
 int bytes_for_int(unsigned int max_value){
   /* 1 byte - 255 values */
@@ -168,8 +317,8 @@ int bytes_for_int(unsigned int max_value){
     return 3;
   }
 
-  /* Dictionary is too big */
-  return -1;
+  /* 4 bytes - format 2 only */
+  return 4;
 }
 
 /**
@@ -191,6 +340,15 @@ void get_error_msg(int id, char *filename){
     fprintf(stderr, "Failed: %s dictionary is too big\n", filename);
     break;
 
+    case ERR_PALZUNSUPPORTED:
+    fprintf(stderr, "Failed: %s uses an unsupported .palz feature\n",
+                                                                    filename);
+    break;
+
+    case ERR_ARCHIVEMEMBER:
+    fprintf(stderr, "Failed: %s is not in the archive\n", filename);
+    break;
+
     case ERR_FOPEN:
     fprintf(stderr, "opendir() failed\n");
     break;
@@ -221,6 +379,33 @@ int is_dot_palz(const char *filename){
   return 0;
 }
 
+/**
+* Name an output file is written under until it is complete: the same
+* directory and PALZ_PARTIAL_PREFIX before the file name.
+* @param filename final file
+* @return partial file name, to be freed
+*/
+char *partial_filename(const char *filename){
+  const char *name = strrchr(filename, '/');
+  char *partial = MALLOC(strlen(filename) + strlen(PALZ_PARTIAL_PREFIX) + 1);
+  size_t directory = name != NULL ? (size_t)(name - filename + 1) : 0;
+
+  memcpy(partial, filename, directory);
+  strcpy(partial + directory, PALZ_PARTIAL_PREFIX);
+  strcat(partial, filename + directory);
+
+  return partial;
+}
+
+/**
+* Check if a file name is the one of an output file being written.
+* @param name file name, without directory
+* @return 1 if true, 0 if false
+*/
+int is_partial(const char *name){
+  return strncmp(name, PALZ_PARTIAL_PREFIX, strlen(PALZ_PARTIAL_PREFIX)) == 0;
+}
+
 /**
 * Search for palz or text files in a given folder and sub-folders. For every
 * palz or text file found, save its path in an array.
@@ -267,7 +452,13 @@ int get_files_from_dir(char *source, char ***paths, int *amount, int mode){
       /* DT_REG = regular file */
     } else if (dirent->d_type == DT_REG) {
 
-      if (is_dot_palz(dirent->d_name) == mode) {
+      /* The manifest of --incremental, the journal of --journal and
+      outputs being written are never compressed */
+      if (is_dot_palz(dirent->d_name) == mode &&
+                          strcmp(dirent->d_name, MANIFEST_NAME) != 0 &&
+                          strcmp(dirent->d_name, MANIFEST_NAME ".tmp") != 0 &&
+                          strcmp(dirent->d_name, JOURNAL_NAME) != 0 &&
+                          !is_partial(dirent->d_name)) {
 
         auxPaths = realloc(auxPaths, sizeof(char*)*((*amount)+1));
         auxPaths[*amount] = nextDirent;
@@ -324,7 +515,23 @@ void *consumer(void *args) {
   PARAM_T *p = args;
 
   char *path = NULL;
+  char *data = NULL;
+  size_t size = 0;
   float output = 0;
+  int error;
+  int slot = -1;
+  TCompressContext *compress_context = NULL;
+  TDecompressContext *decompress_context = NULL;
+
+  /* Each thread keeps its own context for all the files it handles */
+  if ((p->mode) == COMPRESS_MODE || (p->mode) == ARCHIVE_MODE) {
+    compress_context = compress_context_create();
+  } else {
+    decompress_context = decompress_context_create();
+  }
+  if (p->progress != NULL) {
+    slot = progress_slot(p->progress);
+  }
 
   while (!got_signal){
 
@@ -373,20 +580,129 @@ void *consumer(void *args) {
       got_signal = 1;
     }
 
+    /* Search the given file, counting the lines found */
+    if ((p->mode) == GREP_MODE) {
+      if ((output = grep_file(decompress_context, &grep_query, path)) < 0) {
+        get_error_msg(output, path);
+      }
+      pthread_mutex_lock(&(p->mutex));
+      if (output < 0) {
+        p->failed++;
+      } else {
+        p->matched += output;
+      }
+      pthread_mutex_unlock(&(p->mutex));
+      continue;
+    }
+
+    /* Check the given file, counting the ones that fail */
+    if ((p->mode) == TEST_MODE) {
+      if ((output = test_file(decompress_context, path)) < 0) {
+        get_error_msg(output, path);
+        pthread_mutex_lock(&(p->mutex));
+        p->failed++;
+        pthread_mutex_unlock(&(p->mutex));
+      } else {
+        fprintf(stderr, "%s: OK\n", path);
+      }
+      continue;
+    }
+
+    /* Add the given file to the archive, counting the ones that fail */
+    if ((p->mode) == ARCHIVE_MODE) {
+      if ((error = archive_add(p->archive, compress_context, path)) < 0) {
+        get_error_msg(error, path);
+        pthread_mutex_lock(&(p->mutex));
+        p->failed++;
+        pthread_mutex_unlock(&(p->mutex));
+      }
+      continue;
+    }
+
+    /* The progress shows the file instead of its ratio */
+    if (slot >= 0) {
+      progress_start(p->progress, slot, path);
+    }
+
+    /* Leave out a file whose samples show it would hardly shrink, and the
+    copy read ahead for it */
+    if ((p->mode) == COMPRESS_MODE && compress_poor(compress_context, path)) {
+      if (p->io != NULL && asyncio_take(p->io, path, &data, &size) == 0) {
+        free(data);
+      }
+      if (slot >= 0) {
+        progress_done(p->progress, slot, 0);
+      }
+      continue;
+    }
+
+    /* Compress the given file unless the manifest has it unchanged */
+    if ((p->mode) == COMPRESS_MODE && p->manifest != NULL) {
+      if ((error = manifest_compress(p->manifest, compress_context, path,
+                                                              &output)) < 0) {
+        get_error_msg(error, path);
+        if (slot >= 0) {
+          progress_done(p->progress, slot, 0);
+        }
+        continue;
+      }
+      if (p->journal != NULL) {
+        journal_record(p->journal, path);
+      }
+      if (slot >= 0) {
+        progress_done(p->progress, slot, error == 1 ? 0 :
+                                        compress_context->stats.bytes_written);
+      } else if (error == 1) {
+        fprintf(stderr, "%s: unchanged\n", path);
+      } else {
+        fprintf(stderr,"%.2f %%\n", output);
+      }
+      continue;
+    }
+
     /* Ok, now it's time to compress the given file */
-    if ((p->mode) == COMPRESS_MODE) {
-      output = compress_file(path);
+    if ((p->mode) == COMPRESS_MODE && p->io != NULL) {
+      output = asyncio_compress_file(p->io, compress_context, path);
+    } else if ((p->mode) == COMPRESS_MODE) {
+      output = compress_file(compress_context, path);
+    } else if (p->io != NULL) {
+      output = asyncio_decompress_file(p->io, decompress_context, path);
     } else {
-      output = decompress_file(p->dictionary, path);
+      output = decompress_file(decompress_context, path);
+    }
+
+    if (output >= 0 && p->journal != NULL) {
+      journal_record(p->journal, path);
     }
 
     /* Print compression ratio */
-    fprintf(stderr,"%.2f %%\n", output);
+    if (slot >= 0) {
+      if (output < 0) {
+        get_error_msg(output, path);
+      }
+      progress_done(p->progress, slot,
+                      output < 0 ? 0 : compress_context->stats.bytes_written);
+    } else {
+      fprintf(stderr,"%.2f %%\n", output);
+    }
 
     //For test purposes
     //sleep(4);
   }
 
+  /* Wake the producer if it waits for room in the buffer of an interrupted
+  job */
+  pthread_mutex_lock(&(p->mutex));
+  pthread_cond_broadcast(&(p->cond));
+  pthread_mutex_unlock(&(p->mutex));
+
+  if (compress_context != NULL) {
+    compress_context_free(&compress_context);
+  }
+  if (decompress_context != NULL) {
+    decompress_context_free(&decompress_context);
+  }
+
   FREE(path);
   return 0;
 }
@@ -414,12 +730,15 @@ void write_on_buffer(char *path, void *args){
     }
   }
 
-  /* Write data on buffer */
-  p->buffer[p->index_writing] = realloc(p->buffer[p->index_writing],
+  /* Write data on buffer, unless the job was interrupted (the consumers
+  are gone and the buffer may be full) */
+  if (!got_signal) {
+    p->buffer[p->index_writing] = realloc(p->buffer[p->index_writing],
                                                    strlen(path)*sizeof(char)+1);
-  strcpy(p->buffer[p->index_writing], path);
-  p->index_writing = (p->index_writing + 1) % p->max;
-  p->total++;
+    strcpy(p->buffer[p->index_writing], path);
+    p->index_writing = (p->index_writing + 1) % p->max;
+    p->total++;
+  }
 
   /* Notifies waiting threads */
   if (p->total == 1) {
@@ -32,14 +32,50 @@
 
 #include "debug.h"
 #include "memory.h"
+#include "stats.h"
 #include "cmdline.h"
 
 #define MAGIC_PALZ                      "PALZ\n"
+#define MAGIC_PALZ2                     "PALZ2\n"
+/**
+* Stored file: the magic line, "size=N" (and " crc32c=X" when written with
+* checksums) on the second line, then the N bytes of the text as they are.
+* Written instead of a .palz image that would be bigger than the text.
+*/
+#define MAGIC_PALZ_STORED               "PALZS\n"
+#define PALZ_STORED                     3
+/* Separators of format 1 files and default set (IDs 1 to 14) */
+#define PALZ_SEPARATORS                 "\n\t\r ?!.;,:+-*/"
+#define PALZ_MAX_WINDOW                 1048576
+/* Output files are written under this prefix, in the same directory, and
+renamed once complete */
+#define PALZ_PARTIAL_PREFIX             ".palz-partial."
+/**
+* Checksummed format 2 code: blocks of a type byte, a 32-bit payload length,
+* the payload and the CRC-32C of all three. Data blocks hold up to
+* PALZ_BLOCK_SIZE bytes of binary code and the end block the trailer (size
+* and CRC-32C of the original text). Files with a seek index have index
+* blocks before the end block, and their trailer adds the offset of the
+* first index block and the number of lines. Files extended by --append have
+* word blocks (the 32-bit ID of their first word, then one word per line)
+* before the data blocks that use them.
+*/
+#define PALZ_BLOCK_SIZE                 65536
+#define PALZ_BLOCK_HEADER               5
+#define PALZ_BLOCK_DATA                 'D'
+#define PALZ_BLOCK_INDEX                'I'
+#define PALZ_BLOCK_END                  'E'
+#define PALZ_BLOCK_WORDS                'W'
+#define PALZ_TRAILER_SIZE               12
+#define PALZ_INDEX_TRAILER_SIZE         28
+#define PALZ_INDEX_ENTRY_SIZE           24
 #define ERR_PALZEXTENSION               -1
 #define ERR_PALZCORRUPTED               -2
 #define ERR_PALZBIGDICTIONARY           -3
 #define ERR_FOPEN                       -4
 #define ERR_FSTATUS                     -5
+#define ERR_PALZUNSUPPORTED             -6
+#define ERR_ARCHIVEMEMBER               -7
 
 #define C_ERRO_PTHREAD_CREATE           1
 #define C_ERRO_PTHREAD_JOIN             2
@@ -50,6 +86,9 @@
 
 #define DECOMPRESS_MODE                 1
 #define COMPRESS_MODE                   0
+#define TEST_MODE                       2
+#define GREP_MODE                       3
+#define ARCHIVE_MODE                    4
 
 typedef struct resources{
   /* flags */
@@ -64,14 +103,60 @@ typedef struct resources{
 
 typedef struct dictionary_element{
   int nElement;
+  int length;
   char *element;
 }TElement;
 
+/* Elements stored one after the other: element i spans offset[i] to
+offset[i+1] of text, with no per-element allocation */
 typedef struct dictionary_data{
   int nElements;
-  TElement *element;
+  int nAllocated;
+  char *text;
+  size_t text_used;
+  size_t text_size;
+  size_t *offset;
 }TDictionary;
 
+/* Separator set: chars[i] has token ID i+1, ids[] maps a byte to its ID */
+typedef struct separator_set{
+  int count;
+  char chars[256];
+  unsigned char ids[256];
+}TSeparators;
+
+/* Seek index entry: a restart point of the binary code */
+typedef struct index_entry{
+  /* file offset of the data block the restart point starts */
+  unsigned long long block_offset;
+  /* position in the original text and number of lines before it */
+  unsigned long long text_offset;
+  unsigned long long line;
+}TIndexEntry;
+
+/* Compression settings chosen on the command line */
+typedef struct compress_options{
+  /* .palz format version written (1 or 2) */
+  int format;
+  /* learn word+separator composites */
+  int composites;
+  /* LZ77 match search effort, 0 (off) to COMPRESS_MAX_LEVEL */
+  int level;
+  /* write token IDs as varints (format 2) */
+  int varint_ids;
+  /* separators added to PALZ_SEPARATORS */
+  const char *separators;
+  /* write the binary code in checksummed blocks (format 2) */
+  int checksums;
+  /* write a seek index (needs checksums) */
+  int index;
+  /* skip files unchanged since the last folder run (MANIFEST_CHECK_*) */
+  int incremental;
+  /* leave out files of folder runs estimated to compress less (%), -1 to
+  compress them all */
+  int min_ratio;
+}TCompressOptions;
+
 typedef struct{
   char **buffer;
   int index_reading;
@@ -80,24 +165,48 @@ typedef struct{
   int stop;
   int max;
   int mode;
-  TDictionary **dictionary;
+  /* files that failed (TEST_MODE, GREP_MODE, ARCHIVE_MODE) and lines found
+  (GREP_MODE) */
+  int failed;
+  int matched;
+  /* files compressed by earlier runs (COMPRESS_MODE --incremental) or NULL */
+  struct manifest *manifest;
+  /* archive the files are added to (ARCHIVE_MODE) */
+  struct archive *archive;
+  /* files read ahead and written in the background (--io) or NULL */
+  struct asyncio *io;
+  /* counters shown by --progress or NULL */
+  struct progress *progress;
+  /* files finished, for a restarted run to skip (--journal) or NULL */
+  struct journal *journal;
   pthread_mutex_t mutex;
   pthread_cond_t cond;
 }PARAM_T;
 
-void decompress_resources_free(TDictionary **dictionary);
-void decompress_resources_init(TDictionary **dictionary);
 void resource_add_file(FILE *file, char *type);
 void resource_remove_flag(char *type);
 
+int separators_init(TSeparators *set, const char *chars, int count);
+int separators_is_default(const TSeparators *set);
+
 void dictionary_init(TDictionary **dictionary);
 void dictionary_add_element(TDictionary **dictionary, char **element, int size);
 int dictionary_free(TDictionary **dictionary);
 int dictionary_restart(TDictionary **dictionary);
 
+void le_store(unsigned char *bytes, unsigned long long value, int count);
+unsigned long long le_load(const unsigned char *bytes, int count);
+int block_write(FILE *fp, int type, const void *payload, size_t length);
+int block_read(FILE *fp, int *type, unsigned char *payload, size_t size,
+                                                               size_t *length);
+
+long long file_copy(int in, off_t *offset, int out, unsigned long long length);
+
 int bytes_for_int(unsigned int max_value);
 void get_error_msg(int id, char *filename);
 int is_dot_palz(const char *source_filename);
+char *partial_filename(const char *filename);
+int is_partial(const char *name);
 int get_files_from_dir(char *source, char ***paths, int *amount, int isDotPalz);
 
 float compress_ratio(float source_size, float final_size);
@@ -6,126 +6,711 @@
 * @author Eurico Sousa <2110133@my.ipleiria.pt>
 */
 #include "compress.h"
+#include "manifest.h"
+#include "asyncio.h"
+#include "progress.h"
+#include "journal.h"
+#include "estimate.h"
 
 /* Global vars */
-const char *separators = "\n\t\r ?!.;,:+-*/";
+TCompressOptions compress_options = { 1, 0, 0, 0, "", 0, 0, 0, -1 };
+
+/* Match search effort of each compression level */
+static const TCompressLevel compress_levels[COMPRESS_MAX_LEVEL+1] = {
+	{ 0, 0 }, { 1, 8 }, { 2, 16 }, { 4, 16 }, { 8, 32 },
+	{ 16, 32 }, { 32, 64 }, { 64, 128 }, { 128, 256 }, { 256, 1024 }
+};
+
+/* External variables */
+extern int got_signal;
+extern int stats_enabled;
+extern int progress_enabled;
+extern int journal_enabled;
+extern int asyncio_backend;
 
 /**
-* Compress a given text file using an algorithm similar to the LZ77/LZ78.
+* Build the separator set of the compressor: PALZ_SEPARATORS followed by the
+* extra separators given, skipping repeated ones.
+* @param set set to fill
+* @param extra separators to add (NUL terminated)
+* @return 0 or -1 if the set is not valid
+*/
+int compress_separators(TSeparators *set, const char *extra){
+	char chars[256];
+	int count = strlen(PALZ_SEPARATORS);
+
+	memcpy(chars, PALZ_SEPARATORS, count);
+	for(; *extra != '\0'; extra++){
+		if(memchr(chars, *extra, count) == NULL){
+			if(count == 255){
+				return -1;
+			}
+			chars[count++] = *extra;
+		}
+	}
+
+	return separators_init(set, chars, count);
+}
+
+/**
+* Create a compression context. A context is owned by one thread and can be
+* used to compress any number of files, one at a time.
+* Settings are copied from compress_options.
+* @return new context
+* @see compress_context_reset()
+*/
+TCompressContext *compress_context_create(void){
+	TCompressContext *context = MALLOC(sizeof(TCompressContext));
+
+	context->arena = arena_create();
+	context->table = tabela_criar(COMPRESS_TABLE_SIZE, NULL);
+	tabela_usar_arena(context->table, context->arena);
+	context->words = NULL;
+	context->words_size = 0;
+	context->line = NULL;
+	context->line_len = 0;
+	context->word = NULL;
+	context->word_size = 0;
+	context->source_buffer = MALLOC(COMPRESS_IO_BUFFER);
+	context->final_buffer = MALLOC(COMPRESS_IO_BUFFER);
+	context->options = compress_options;
+	context->format = compress_options.format;
+	compress_separators(&context->separators, compress_options.separators);
+	context->tokens = MALLOC(sizeof(unsigned int)*(COMPRESS_WINDOW +
+																				COMPRESS_TOKEN_BLOCK));
+	context->tokens_start = 0;
+	context->tokens_end = 0;
+	context->tokens_base = 0;
+	context->tokens_floor = 0;
+	context->tokens_stop = 0;
+	context->head = NULL;
+	context->chain = NULL;
+	if(context->options.level > 0){
+		context->head = MALLOC(sizeof(long long)*COMPRESS_HASH_SIZE);
+		context->chain = MALLOC(sizeof(long long)*COMPRESS_WINDOW);
+	}
+	context->code = MALLOC(COMPRESS_IO_BUFFER);
+	context->code_used = 0;
+	context->fpFinal = NULL;
+	context->id_bytes = 1;
+	context->blocks = 0;
+	context->source_size = 0;
+	context->source_crc = 0;
+	context->index = NULL;
+	context->index_used = 0;
+	context->index_size = 0;
+	context->index_done = 0;
+	context->composites = tabela_criar(COMPRESS_TABLE_SIZE, NULL);
+	tabela_usar_arena(context->composites, context->arena);
+	context->candidates = NULL;
+	context->candidates_used = 0;
+	context->candidates_size = 0;
+
+	return context;
+}
+
+/**
+* Prepare a context for the next file. Every buffer keeps its allocated size
+* and so do the hashtables up to COMPRESS_TABLE_KEEP entries, since clearing
+* one walks all of them; the objects of the last file go all at once with
+* its arena.
+* @param context
+*/
+void compress_context_reset(TCompressContext *context){
+	if(context->table->tamanho > COMPRESS_TABLE_KEEP)
+		tabela_encolher(context->table, COMPRESS_TABLE_SIZE);
+	else
+		tabela_remover_todos(context->table);
+	if(context->composites->tamanho > COMPRESS_TABLE_KEEP)
+		tabela_encolher(context->composites, COMPRESS_TABLE_SIZE);
+	else
+		tabela_remover_todos(context->composites);
+	context->candidates_used = 0;
+	arena_reset(context->arena);
+	context->source_size = 0;
+	context->source_crc = 0;
+	stats_reset(&context->stats);
+#ifdef HASHTABLE_STATS
+	tabela_limpar_estatisticas(context->table);
+#endif
+}
+
+/**
+* Free a compression context.
+* @param context
+*/
+void compress_context_free(TCompressContext **context){
+	TCompressContext *aux = *context;
+
+	tabela_destruir(&aux->table);
+	FREE(aux->words);
+	FREE(aux->line);
+	FREE(aux->word);
+	FREE(aux->source_buffer);
+	FREE(aux->final_buffer);
+	FREE(aux->tokens);
+	FREE(aux->head);
+	FREE(aux->chain);
+	FREE(aux->code);
+	FREE(aux->index);
+	tabela_destruir(&aux->composites);
+	FREE(aux->candidates);
+	arena_free(&aux->arena);
+	FREE(*context);
+}
+
+/**
+* Read a line from the source file. Reading time is accounted as I/O when
+* statistics are enabled.
+* @param context compression context
+* @param fpSource source file
+* @return getline() result
+*/
+static ssize_t read_line(TCompressContext *context, FILE *fpSource){
+	double start;
+	ssize_t nread;
+
+	if(!stats_enabled){
+		return getline(&context->line, &context->line_len, fpSource);
+	}
+
+	start = stats_now();
+	nread = getline(&context->line, &context->line_len, fpSource);
+	context->stats.time_io += stats_now() - start;
+
+	return nread;
+}
+
+/**
+* Count one occurrence of a word followed by a separator. The separator is
+* still in the line right after the word, which ends at length.
+* @param context compression context
+* @param word word read
+* @param length length of word
+* @param next separator that follows the word
+*/
+static void count_composite(TCompressContext *context, char *word,
+																			size_t length, char next){
+	TWordCount *candidate = NULL;
+	int *occurrences = NULL;
+	char saved = word[length+1];
+
+	word[length] = next;
+	word[length+1] = '\0';
+
+	if((occurrences = tabela_consultar(context->composites, word)) != NULL){
+		(*occurrences)++;
+	} else {
+		if(context->candidates_used == context->candidates_size){
+			context->candidates_size = context->candidates_size ?
+										context->candidates_size*2 : COMPRESS_TABLE_SIZE;
+			context->candidates = realloc(context->candidates,
+										context->candidates_size*sizeof(TWordCount));
+		}
+		occurrences = arena_alloc(context->arena, sizeof(int));
+		*occurrences = 1;
+		tabela_inserir(context->composites, word, occurrences);
+
+		candidate = &context->candidates[context->candidates_used++];
+		candidate->text = arena_strdup(context->arena, word);
+		candidate->occurrences = occurrences;
+	}
+
+	word[length] = '\0';
+	word[length+1] = saved;
+}
+
+/**
+* Compare two words by number of occurrences, most used first, and then
+* alphabetically so the order does not depend on qsort().
+* @param p1 first word
+* @param p2 second word
+* @return negative if p1 comes first
+*/
+static int cmpoccurrences(const void *p1, const void *p2){
+	const TWordCount *c1 = p1, *c2 = p2;
+
+	if(*c1->occurrences != *c2->occurrences){
+		return *c1->occurrences > *c2->occurrences ? -1 : 1;
+	}
+	return strcmp(c1->text, c2->text);
+}
+
+/**
+* Sort the distinct words by number of occurrences, most used first, so the
+* most used words get the shortest varint IDs.
+* @param context compression context
+* @param count number of distinct words
+*/
+static void sort_by_occurrences(TCompressContext *context, int count){
+	TWordCount *order = NULL;
+	int i;
+
+	if(count == 0){
+		return;
+	}
+	if(count > context->candidates_size){
+		context->candidates_size = count;
+		context->candidates = realloc(context->candidates,
+																count*sizeof(TWordCount));
+	}
+	order = context->candidates;
+
+	for(i=0; i<count; i++){
+		order[i].text = context->words[i];
+		order[i].occurrences = tabela_consultar(context->table, order[i].text);
+	}
+	qsort(order, count, sizeof(TWordCount), cmpoccurrences);
+	for(i=0; i<count; i++){
+		context->words[i] = order[i].text;
+	}
+}
+
+/**
+* Add to the distinct words the composites (word plus separator) that save
+* more binary code than their header line costs. The most used come first and
+* none is added once the token ID would need another byte.
+* @param context compression context
+* @param count number of distinct words
+* @return number of distinct words, composites included
+*/
+static int add_composites(TCompressContext *context, int count){
+	TWordCount *candidate = NULL;
+	int nseparators = context->separators.count;
+	int bytes = bytes_for_int(count + nseparators);
+	int *value = NULL;
+	int i;
+
+	/* With varint IDs a composite saves about one separator byte per use */
+	if(context->options.varint_ids){
+		bytes = 1;
+	}
+
+	if(context->candidates_used > 0){
+		qsort(context->candidates, context->candidates_used, sizeof(TWordCount),
+																										cmpoccurrences);
+	}
+
+	for(i=0; i<context->candidates_used; i++){
+		candidate = &context->candidates[i];
+
+		if(count == COMPRESS_MAX_WORDS || (!context->options.varint_ids &&
+								bytes_for_int(count+1 + nseparators) != bytes) ||
+				(long long)*candidate->occurrences*bytes <=
+															(long long)strlen(candidate->text)+1){
+			continue;
+		}
+
+		if(count == context->words_size){
+			context->words_size = context->words_size ? context->words_size*2
+																								: COMPRESS_TABLE_SIZE;
+			context->words = realloc(context->words,
+																	context->words_size*sizeof(char*));
+		}
+		context->words[count++] = candidate->text;
+		value = arena_alloc(context->arena, sizeof(int));
+		*value = *candidate->occurrences;
+		tabela_inserir(context->table, candidate->text, value);
+		context->stats.composites++;
+	}
+
+	context->candidates_used = 0;
+	tabela_remover_todos(context->composites);
+
+	return count;
+}
+
+/**
+* Write the header of a stored file: size, CRC-32C (checksums) and the
+* separators when they are not the default ones, for --grep.
+* @param context compression context (context->source_crc)
+* @param header buffer of COMPRESS_STORED_HEADER bytes
+* @param size bytes of the text
+* @param checksums write the CRC-32C
+* @return length of the header
+*/
+static int stored_header(TCompressContext *context, char *header,
+															unsigned long long size, int checksums){
+	int length, i;
+
+	length = sprintf(header, "%ssize=%llu", MAGIC_PALZ_STORED, size);
+	if(checksums){
+		length += sprintf(header + length, " crc32c=%08x", context->source_crc);
+	}
+	if(!separators_is_default(&context->separators)){
+		length += sprintf(header + length, " separators=");
+		for(i=0; i<context->separators.count; i++){
+			length += sprintf(header + length, "%02x",
+														(unsigned char)context->separators.chars[i]);
+		}
+	}
+	header[length++] = '\n';
+	header[length] = '\0';
+
+	return length;
+}
+
+/**
+* Write a stored file in place of a .palz image that does not make the text
+* smaller: the stored header and the source as it is. From a file to a file
+* the bytes are copied in the kernel, and the file is cut after them (a
+* .palz image may have been written there first); a stream given must end
+* where it is left (open_memstream()).
+* @param context compression context
+* @param fpSource source, copied from its start
+* @param fpFinal where the image starts
+* @param size bytes of the source
+* @param checksums write the CRC-32C of the text (context->source_crc)
+* @return 0 or ERR_FOPEN
+*/
+static int write_stored(TCompressContext *context, FILE *fpSource,
+									FILE *fpFinal, unsigned long long size, int checksums){
+	char header[COMPRESS_STORED_HEADER];
+	off_t offset = 0, end;
+	size_t nread;
+	int length = stored_header(context, header, size, checksums);
+
+	if(fwrite(header, 1, length, fpFinal) != (size_t)length ||
+																		fflush(fpFinal) != 0){
+		return ERR_FOPEN;
+	}
+
+	if(fileno(fpSource) >= 0 && fileno(fpFinal) >= 0){
+		if(file_copy(fileno(fpSource), &offset, fileno(fpFinal), size) !=
+											(long long)size ||
+							(end = lseek(fileno(fpFinal), 0, SEEK_CUR)) < 0 ||
+							ftruncate(fileno(fpFinal), end) != 0){
+			return ERR_FOPEN;
+		}
+		return 0;
+	}
+
+	rewind(fpSource);
+	for(; size > 0; size -= nread){
+		nread = fread(context->code, 1, size < COMPRESS_IO_BUFFER ? size :
+																					COMPRESS_IO_BUFFER, fpSource);
+		if(nread == 0 || fwrite(context->code, 1, nread, fpFinal) != nread){
+			return ERR_FOPEN;
+		}
+	}
+	return 0;
+}
+
+/**
+* Compress a text file using an algorithm similar to the LZ77/LZ78, to its
+* .palz file or to an open stream (the members of an archive). A text the
+* dictionary and token IDs would not make smaller is written as a stored
+* file: once its dictionary is read when that and the smallest header alone
+* take as many bytes as the stored file (or the text has a NUL, where the
+* tokens would end), or else when the encoded image turns out bigger.
+* @param context compression context
 * @param source_filename file to compress
-* @return compress_ratio()
+* @param fpInput stream with the text of source_filename (read ahead), or
+* NULL to open it
+* @param fpOutput stream for the .palz image, written from its current
+* position, or NULL to write source_filename.palz
+* @return 0 or an error code
 * @see write_binary()
 */
-int compress_file(char *source_filename){
-	size_t len = 0;
-	HASHTABLE_T *table;
-	FILE *fpSource = NULL;
+int compress_stream(TCompressContext *context, char *source_filename,
+																							FILE *fpInput, FILE *fpOutput){
+	HASHTABLE_T *table = context->table;
+	TStats *stats = &context->stats;
+	unsigned char *separator_ids = context->separators.ids;
+	int nseparators = context->separators.count;
+	FILE *fpSource = fpInput;
 	FILE *fpFinal = NULL;
-	char *final_filename = MALLOC(sizeof(char)*(strlen(source_filename)+6));
-	char *line = NULL;
+	char *final_filename = NULL;
+	char *output_filename = NULL;
 	char *word = NULL;
-	char *last_word = NULL;
-	char **array = NULL;
+	char **array = context->words;
 	int *value;
 	int bytes;
 	int count = 0;
-	float source_file_size = 0;
-	float final_file_size = 0;
-
-	/* Create hastable */
-	table = tabela_criar(101, free);
+	size_t length;
+	ssize_t nread;
+	char next;
+	int nul = 0;
+	int stored;
+	int error = 0;
+	char header[COMPRESS_STORED_HEADER];
+	unsigned long long text = 0, dictionary = 0;
+	off_t image = 0;
+	double start, phase, io;
+
+	compress_context_reset(context);
+	start = stats_now();
+
+	if (fpInput == NULL) {
+		if ((fpSource = fopen(source_filename, "r")) == NULL) {
+			return ERR_FOPEN;
+		}
+		setvbuf(fpSource, context->source_buffer, _IOFBF, COMPRESS_IO_BUFFER);
+	}
 
-	fpSource = fopen(source_filename, "r");
+	phase = stats_now();
+	stats->time_io += phase - start;
+	io = stats->time_io;
 
 	/* Read and save distinct words */
-	while(getline(&line, &len, fpSource) > 0) {
-		last_word = NULL;
-		word = strtok_r(line, separators, &last_word);
+	while((nread = read_line(context, fpSource)) > 0) {
+		word = context->line;
+		text += nread;
+
+		/* The tokens end at a NUL: such a text is stored */
+		if(!nul){
+			nul = strnlen(word, nread) < (size_t)nread;
+		}
+		if(context->options.checksums){
+			context->source_crc = crc32c(context->source_crc, word, nread);
+			context->source_size += nread;
+		}
+
+		while(separator_ids[(unsigned char)*word]){
+			word++;
+		}
 
-		while(word){
+		while(*word){
+			for(length = 0; word[length] != '\0' &&
+									!separator_ids[(unsigned char)word[length]]; length++);
+			next = word[length];
+			word[length] = '\0';
 
 			/* Check for a dictionary out of bounds */
-			if(count == 16777216){
+			if(count == COMPRESS_MAX_WORDS){
 				/* Free resources and return error */
-				fclose(fpSource);
-				FREE(final_filename);
-				tabela_destruir(&table);
+				if (fpInput == NULL) {
+					fclose(fpSource);
+				}
+				context->words = array;
 				return ERR_PALZBIGDICTIONARY;
 			}
 
-			/* Check if word already exist on table */
-			if(tabela_consultar(table, word) == NULL){
+			/* Check if word already exist on table, and count it */
+			if((value = tabela_consultar(table, word)) == NULL){
 
-				tabela_inserir(table, word, malloc(sizeof(int)));
+				value = arena_alloc(context->arena, sizeof(int));
+				*value = 0;
+				tabela_inserir(table, word, value);
 
-				array = (char **) realloc(array, (count+1)*sizeof(char*));
-				array[count] = malloc(strlen(word)+1);
-				strcpy(array[count], word);
+				if(count == context->words_size){
+					context->words_size = context->words_size ? context->words_size*2
+																										: COMPRESS_TABLE_SIZE;
+					array = realloc(array, context->words_size*sizeof(char*));
+				}
+				array[count] = arena_strdup(context->arena, word);
+				dictionary += length + 1;
 
 				count++;
 			}
-			word = strtok_r(NULL, separators, &last_word);
+			(*value)++;
+
+			/* Count the word followed by its separator (never a newline) */
+			if(context->options.composites && next != '\n' && next != '\0'){
+				count_composite(context, word, length, next);
+			}
+
+			word[length] = next;
+			word += length;
+			while(separator_ids[(unsigned char)*word]){
+				word++;
+			}
 		}
 	}
-	FREE(line);
-
-	/* Get the number of bytes */
-	int tmp = count+14;
+	context->words = array;
+	count = add_composites(context, count);
+	array = context->words;
+	stats->time_dictionary = stats_now() - phase - (stats->time_io - io);
+	int tmp = count + nseparators;
+
+	/* Format 1 token IDs have at most 3 bytes */
+	context->format = context->options.format;
 	bytes = bytes_for_int(tmp);
-
-	/* Check for a dictionary out of bounds */
-	if(bytes == -1){
-		/* Free resources and return error */
-		fclose(fpSource);
-		FREE(final_filename);
-		tabela_destruir(&table);
-		return ERR_PALZBIGDICTIONARY;
+	if(context->options.varint_ids){
+		bytes = 0;
+	} else if(bytes == 4){
+		context->format = 2;
 	}
+	context->blocks = context->format == 2 && context->options.checksums;
 
 	/* Sort an array of distinct words */
-	qsort(&array[0], count, sizeof(char *), cmpstringp);
+	phase = stats_now();
+	if(bytes == 0){
+		sort_by_occurrences(context, count);
+	} else if(count > 0){
+		qsort(&array[0], count, sizeof(char *), cmpstringp);
+	}
+	stats->time_sort = stats_now() - phase;
+
+	/* Write to the stream given or to the .palz file, under its partial name
+	until it is complete */
+	if(fpOutput != NULL){
+		fpFinal = fpOutput;
+	} else {
+		final_filename = MALLOC(sizeof(char)*(strlen(source_filename)+6));
+		strcpy(final_filename, source_filename);
+		strcat(final_filename, ".palz");
+		output_filename = partial_filename(final_filename);
+
+		if ((fpFinal = fopen(output_filename, "wb")) == NULL) {
+			if (fpInput == NULL) {
+				fclose(fpSource);
+			}
+			FREE(final_filename);
+			FREE(output_filename);
+			return ERR_FOPEN;
+		}
+		setvbuf(fpFinal, context->final_buffer, _IOFBF, COMPRESS_IO_BUFFER);
+	}
 
-	/* Add .palz extension */
-	strcpy(final_filename, source_filename);
-	strcat(final_filename, ".palz");
+	stats->time_io += stats_now() - phase - stats->time_sort;
+	phase = stats_now();
+
+	/* A dictionary as big as the stored file can only make it bigger (the
+	format 1 header is the smallest) */
+	stored = nul || dictionary + snprintf(header, sizeof(header), "%s%d\n",
+											MAGIC_PALZ, count) >= text +
+					stored_header(context, header, text, context->options.checksums);
+	if((image = ftello(fpFinal)) < 0){
+		image = 0;
+	}
+
+	if(!stored){
+		/* Write header (PALZ and dictionary size) */
+		if(context->format == 2){
+			fprintf(fpFinal,MAGIC_PALZ2);
+			fprintf(fpFinal,"words=%d width=%d window=%d",
+										tabela_numero_elementos(table), bytes, COMPRESS_WINDOW);
+			if(context->blocks){
+				fprintf(fpFinal," check=crc32c");
+			}
+			if(context->blocks && context->options.index){
+				fprintf(fpFinal," index=%d", COMPRESS_INDEX_INTERVAL);
+			}
+			if(!separators_is_default(&context->separators)){
+				fprintf(fpFinal," separators=");
+				for(tmp=0; tmp<nseparators; tmp++){
+					fprintf(fpFinal,"%02x",
+											(unsigned char)context->separators.chars[tmp]);
+				}
+			}
+			fprintf(fpFinal,"\n");
+		} else {
+			fprintf(fpFinal,MAGIC_PALZ);
+			fprintf(fpFinal,"%d\n", tabela_numero_elementos(table));
+		}
+
+		/* Write header (list of distinct words) and turn counts into IDs */
+		for(tmp=0; tmp<count; tmp++){
+			fprintf(fpFinal,"%s\n", array[tmp]);
+
+			value = tabela_consultar(table, array[tmp]);
+			*value = tmp + nseparators + 1;
+		}
 
-	fpFinal = fopen(final_filename, "wb");
+		stats->time_header = stats_now() - phase;
+		phase = stats_now();
 
-	/* Write header (PALZ and dictionary size) */
-	fprintf(fpFinal,MAGIC_PALZ);
-	fprintf(fpFinal,"%d\n", tabela_numero_elementos(table));
+		/* Write binary */
+		write_binary(context, &fpSource, &fpFinal, bytes);
 
-	/* Write header (list of distinct words) and update word values */
-	for(tmp=0; tmp<tabela_numero_elementos(table); tmp++){
-		fprintf(fpFinal,"%s\n", array[tmp]);
+		/* Encoded, the text grew: store it instead */
+		stored = ftello(fpFinal) - image > (off_t)text +
+					stored_header(context, header, text, context->options.checksums);
+		if(stored && fseeko(fpFinal, image, SEEK_SET) != 0){
+			stored = 0;
+		}
+	}
+
+	/* The source as it is, from its start */
+	if(stored){
+		bytes = 0;
+		error = write_stored(context, fpSource, fpFinal, text,
+																				context->options.checksums);
+	}
 
-		value = MALLOC(sizeof(int));
-		*value = tmp + 15;
-		tabela_inserir(table, array[tmp], value);
+	stats->time_encode = stats_now() - phase;
+	phase = stats_now();
 
-		free(array[tmp]);
+	if(fpInput == NULL){
+		fclose(fpSource);
+	}
+	if(fpOutput == NULL){
+		if(fclose(fpFinal) != 0 || error != 0 ||
+										rename(output_filename, final_filename) != 0){
+			unlink(output_filename);
+			FREE(output_filename);
+			FREE(final_filename);
+			return ERR_FOPEN;
+		}
+		FREE(output_filename);
+		FREE(final_filename);
+	}
+	if(error != 0){
+		return error;
 	}
-	free(array);
 
-	/* Add separators to table */
-	add_separators(&table);
+	stats->time_io += stats_now() - phase;
+	stats->time_total = stats_now() - start;
+	stats->distinct_words = count - stats->composites;
+	stats->id_width = bytes;
 
-	/* Write binary */
-	write_binary(&table, &fpSource, &fpFinal, bytes);
+	return 0;
+}
 
-	fclose(fpSource);
-	fclose(fpFinal);
-	tabela_destruir(&table);
+/**
+* Compress a given text file using an algorithm similar to the LZ77/LZ78.
+* @param context compression context
+* @param source_filename file to compress
+* @return compress_ratio()
+* @see compress_stream()
+*/
+int compress_file(TCompressContext *context, char *source_filename){
+	TStats *stats = &context->stats;
+	char *final_filename = NULL;
+	float source_file_size = 0;
+	float final_file_size = 0;
+	double phase;
+	int error;
+
+	if ((error = compress_stream(context, source_filename, NULL, NULL)) != 0) {
+		return error;
+	}
+	phase = stats_now();
+
+	/* Add .palz extension */
+	final_filename = MALLOC(sizeof(char)*(strlen(source_filename)+6));
+	strcpy(final_filename, source_filename);
+	strcat(final_filename, ".palz");
 
 	if ((source_file_size = get_size(source_filename)) == -1) {
+		FREE(final_filename);
 		return ERR_FSTATUS;
 	}
 
 	if ((final_file_size = get_size(final_filename)) == -1) {
+		FREE(final_filename);
 		return ERR_FSTATUS;
 	}
 
-	fprintf(stderr,"Compression ratio: %s ", source_filename);
+	stats->time_io += stats_now() - phase;
+	stats->time_total += stats_now() - phase;
+	stats->bytes_read = source_file_size;
+	stats->bytes_written = final_file_size;
+#ifdef HASHTABLE_STATS
+	stats->table = context->table->stats;
+	stats->table_capacity = context->table->tamanho;
+	stats->table_active = context->table->total_activos;
+	stats->table_tombstones = context->table->total_inactivos;
+#endif
+
+	if(stats_enabled){
+		stats_print(stats, "compress", source_filename);
+	}
+
+	if(!progress_enabled){
+		fprintf(stderr,"Compression ratio: %s ", source_filename);
+	}
 
 	FREE(final_filename);
 
@@ -133,217 +718,923 @@ int compress_file(char *source_filename){
 }
 
 /**
-* Write binary code in the .palz file.
-* @param table hashtable with distinct words and separators
-* @param fpSource source file
-* @param fpFinal final file
-* @param bytes number of bytes
-* @return 0 if write binary was successful
+* Write the binary code buffered in the context to the final file, as one
+* data block when checksums are on.
+* @param context compression context
 */
-int write_binary(HASHTABLE_T **table, FILE **fpSource, FILE **fpFinal,
-																																		 int bytes){
-	int *result = NULL;
-	FILE *srcFile = NULL;
-	FILE *finalFile = NULL;
-	srcFile = *fpSource;
-	finalFile = *fpFinal;
-	char *separator = MALLOC(sizeof(char)*2); /* separator plus \0 */
-	char *word = NULL;
-	int noc = 0; /* number of characters */
-	int nor = 0; /* number of repetitions */
-	int nor_temp = 0; /* temporary number of repetitions */
-	int last_separator = -1; /* -1 because fgetc() returns an unsigned integer */
-	int read;
-	int repetition_mark = 0;
+static void code_flush(TCompressContext *context){
+	if(context->code_used == 0){
+		return;
+	}
+	if(context->blocks){
+		block_write(context->fpFinal, PALZ_BLOCK_DATA, context->code,
+																								context->code_used);
+	} else {
+		fwrite(context->code, 1, context->code_used, context->fpFinal);
+	}
+	context->code_used = 0;
+}
 
-	rewind(srcFile);
+/**
+* Append an unsigned LEB128 varint to the binary code (format 2 counts,
+* distances and lengths).
+* @param context compression context
+* @param value
+*/
+static void code_varint(TCompressContext *context, unsigned int value){
+	if(context->code_used + 5 > COMPRESS_IO_BUFFER){
+		code_flush(context);
+	}
+	while(value >= 0x80){
+		context->code[context->code_used++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	context->code[context->code_used++] = value;
+}
 
-	while((read = fgetc(srcFile))){
-		/* (noc+1) because at the beginning noc=0 */
-		word = realloc(word, sizeof(char)*(noc+1));
+/**
+* Number of bytes of a varint.
+* @param value
+* @return bytes written by code_varint()
+*/
+static int varint_size(unsigned int value){
+	int size = 1;
 
-		/* Detect a separator or the end of file (EOF) */
-		if(strchr(separators, read) || (read == EOF)) {
+	while(value >= 0x80){
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
 
-			/* Check for a separator's repetition */
-			if((read == last_separator) && (read != EOF)) {
+/**
+* Number of bytes of token IDs written with code_id().
+* @param context compression context
+* @param i position of the first token in the token buffer
+* @param length number of tokens
+* @return bytes
+*/
+static int tokens_size(TCompressContext *context, int i, int length){
+	int size = 0;
 
-				/* Write the separator */
-				if(nor == 0){
-					fwrite(&repetition_mark, bytes, 1, finalFile);
-				}
+	if(context->id_bytes != 0){
+		return length*context->id_bytes;
+	}
+	while(length-- > 0){
+		size += varint_size(context->tokens[i++]);
+	}
+	return size;
+}
+
+/**
+* Append a little-endian token ID to the binary code.
+* @param context compression context
+* @param id token ID
+*/
+static void code_id(TCompressContext *context, unsigned int id){
+	unsigned char *code = NULL;
+
+	if(context->id_bytes == 0){
+		code_varint(context, id);
+		context->stats.tokens++;
+		return;
+	}
+	if(context->code_used + 4 > COMPRESS_IO_BUFFER){
+		code_flush(context);
+	}
+	code = context->code + context->code_used;
+	code[0] = id;
+	if(context->id_bytes > 1){
+		code[1] = id >> 8;
+	}
+	if(context->id_bytes > 2){
+		code[2] = id >> 16;
+	}
+	if(context->id_bytes > 3){
+		code[3] = id >> 24;
+	}
+	context->code_used += context->id_bytes;
+	context->stats.tokens++;
+}
+
+/**
+* Format 1 encoder: every token is written as is, and a separator followed by
+* copies of itself is written once plus the repetition mark (ID 0) and the
+* number of copies. Counts that do not fit in one token are split.
+* @param context compression context
+* @param limit first token not to start encoding at
+* @return first token not encoded
+*/
+static int encode_format1(TCompressContext *context, int limit){
+	unsigned int *tokens = context->tokens;
+	unsigned int max = (1u << (8*context->id_bytes - 1) << 1) - 1;
+	unsigned int nor; /* number of repetitions */
+	int i = context->tokens_start;
+
+	while(i < limit){
+		code_id(context, tokens[i]);
+
+		if(tokens[i] <= (unsigned int)context->separators.count){
+			nor = 0;
+			while(i+1+(int)nor < context->tokens_end &&
+															tokens[i+1+nor] == tokens[i]){
 				nor++;
+			}
 
-			} else {
-
-				/* Write the number of repetitions for a certain separator */
-				if(nor != 0){
-
-					/* Write with 1 byte */
-					if(bytes == 1){
-						while(nor > 0){
-							if(nor > 255){
-								nor_temp = 255;
-								fwrite(&nor_temp, 1, bytes, finalFile);
-								fwrite(&repetition_mark, 1, bytes, finalFile);
-								nor -= 255;
-							} else {
-								fwrite(&nor, 1, bytes, finalFile);
-								nor = 0;
-							}
-						}
-					}
+			if(nor != 0){
+				code_id(context, 0);
+				context->stats.repetitions++;
+				i += nor;
+				while(nor > max){
+					code_id(context, max);
+					code_id(context, 0);
+					nor -= max;
+				}
+				code_id(context, nor);
+			}
+		}
+		i++;
+	}
+	return i;
+}
 
-					/* Write with 2 bytes */
-					if(bytes == 2){
-						while(nor > 0){
-							if(nor > 65535){
-								nor_temp = 65535;
-								fwrite(&nor_temp, 1, bytes, finalFile);
-								fwrite(&repetition_mark, 1, bytes, finalFile);
-								nor -= 65535;
-							} else {
-								fwrite(&nor, 1, bytes, finalFile);
-								nor = 0;
-							}
-						}
-					}
+/**
+* Hash of the COMPRESS_MIN_MATCH token IDs starting at tokens.
+* @param tokens
+* @return index in the hash chain heads
+*/
+static unsigned int hash_tokens(const unsigned int *tokens){
+	return ((tokens[0] * 2654435761u) ^ (tokens[1] * 2246822519u) ^
+							(tokens[2] * 3266489917u)) >> (32 - COMPRESS_HASH_BITS);
+}
 
-					/* Write with 3 bytes */
-					if(bytes == 3){
-						while(nor > 0){
-							if(nor > 16777215){
-								nor_temp = 16777215;
-								fwrite(&nor_temp, 1, bytes, finalFile);
-								fwrite(&repetition_mark, 1, bytes, finalFile);
-								nor -= 16777215;
-							} else {
-								fwrite(&nor, 1, bytes, finalFile);
-								nor = 0;
-							}
-						}
-					}
-					last_separator = -1; /* Reset last separator */
+/**
+* Insert a token position in the hash chains.
+* @param context compression context
+* @param i position in the token buffer
+*/
+static void chain_insert(TCompressContext *context, int i){
+	long long position = context->tokens_base + i;
+	unsigned int hash = hash_tokens(context->tokens + i);
+
+	context->chain[position & (COMPRESS_WINDOW - 1)] = context->head[hash];
+	context->head[hash] = position;
+}
+
+/**
+* Find the longest earlier occurrence, within COMPRESS_WINDOW tokens, of the
+* tokens starting at a position. The number of candidates tried and the
+* length that ends the search early depend on the compression level.
+* @param context compression context
+* @param i position in the token buffer
+* @param distance where to store how far back the match starts
+* @return match length (0 if none)
+*/
+static int chain_find(TCompressContext *context, int i, int *distance){
+	const TCompressLevel *level = &compress_levels[context->options.level];
+	unsigned int *tokens = context->tokens;
+	long long position = context->tokens_base + i;
+	long long candidate = context->head[hash_tokens(tokens + i)];
+	long long floor = context->tokens_base + context->tokens_floor;
+	int end = context->tokens_stop;
+	int depth = level->chain;
+	int best = 0, length, j;
+
+	while(candidate >= floor &&
+						position - candidate <= COMPRESS_WINDOW && depth-- > 0){
+		j = candidate - context->tokens_base;
+
+		/* A longer match must also differ from the best one at its end */
+		if(tokens[j+best] == tokens[i+best]){
+			length = 0;
+			while(i+length < end && tokens[j+length] == tokens[i+length]){
+				length++;
+			}
+			if(length > best){
+				best = length;
+				*distance = position - candidate;
+				if(best >= level->nice || i+best == end){
+					break;
+				}
+			}
+		}
+		candidate = context->chain[candidate & (COMPRESS_WINDOW - 1)];
+	}
+
+	return best;
+}
+
+/**
+* Format 2 encoder: any token repeated is written once followed by ID 0 and a
+* varint count, and tokens that already appeared are written as ID 0, a zero
+* count and the varint pair (distance, length) of the copy. Sequences of up to
+* COMPRESS_MAX_PERIOD tokens repeated right after themselves are always found,
+* longer distances are searched in hash chains when the level is above 0. The
+* copy that saves the most bytes is used, if it saves any.
+* @param context compression context
+* @param limit first token not to start encoding at
+* @return first token not encoded
+*/
+static int encode_format2(TCompressContext *context, int limit){
+	unsigned int *tokens = context->tokens;
+	int escape = context->id_bytes ? context->id_bytes : 1;
+	int i = context->tokens_start;
+	int end = context->tokens_stop;
+	int level = context->options.level;
+	int best_length, best_distance, best_gain, distance, length, gain;
+
+	while(i < limit){
+		best_length = 0;
+		best_distance = 0;
+		best_gain = 0;
+
+		for(distance = 1; distance <= COMPRESS_MAX_PERIOD &&
+												distance <= i - context->tokens_floor; distance++){
+			if(tokens[i] != tokens[i-distance]){
+				continue;
+			}
+			length = 1;
+			while(i+length < end && tokens[i+length] == tokens[i+length-distance]){
+				length++;
+			}
+			gain = tokens_size(context, i, length) - escape - varint_size(length)
+										- (distance == 1 ? 0 : 1 + varint_size(distance));
+			if(gain > best_gain){
+				best_gain = gain;
+				best_length = length;
+				best_distance = distance;
+			}
+		}
+
+		if(level > 0 && i + COMPRESS_MIN_MATCH <= end){
+			if((length = chain_find(context, i, &distance)) >= COMPRESS_MIN_MATCH){
+				gain = tokens_size(context, i, length) - escape - 1 -
+												varint_size(distance) - varint_size(length);
+				if(gain > best_gain){
+					best_gain = gain;
+					best_length = length;
+					best_distance = distance;
 				}
+			}
+			chain_insert(context, i);
+		}
+
+		if(best_gain <= 0){
+			code_id(context, tokens[i]);
+			i++;
+			continue;
+		}
+
+		code_id(context, 0);
+		if(best_distance == 1){
+			/* Repeat the last token */
+			code_varint(context, best_length);
+		} else {
+			/* Copy earlier tokens */
+			code_varint(context, 0);
+			code_varint(context, best_distance);
+			code_varint(context, best_length);
+		}
+		context->stats.repetitions++;
+
+		/* Tokens inside the copy can start later matches too */
+		if(level > 0){
+			for(length = 1; length < best_length &&
+													i + length + COMPRESS_MIN_MATCH <= end; length++){
+				chain_insert(context, i + length);
+			}
+		}
+		i += best_length;
+	}
+	return i;
+}
+
+/**
+* Format 2 encoder for files with a seek index. Every COMPRESS_INDEX_INTERVAL
+* tokens the code starts a new block and copies can't reach back past that
+* restart point, so decoding can start at any of them.
+* @param context compression context
+* @param limit first token not to start encoding at
+* @return first token not encoded
+*/
+static int encode_segments(TCompressContext *context, int limit){
+	long long position, restart, next;
+	int i = context->tokens_start;
+
+	while(i < limit){
+		position = context->tokens_base + i;
+		restart = position - position % COMPRESS_INDEX_INTERVAL;
+		next = restart + COMPRESS_INDEX_INTERVAL;
+
+		if(position == restart && context->index_done < context->index_used){
+			code_flush(context);
+			context->index[context->index_done++].block_offset =
+																							ftell(context->fpFinal);
+		}
+
+		context->tokens_floor = restart > context->tokens_base ?
+																			restart - context->tokens_base : 0;
+		context->tokens_stop = next - context->tokens_base < context->tokens_end ?
+														next - context->tokens_base : context->tokens_end;
+		context->tokens_start = i;
+		i = encode_format2(context, limit < context->tokens_stop ? limit :
+																								context->tokens_stop);
+	}
+	return i;
+}
+
+/**
+* Encode the buffered token IDs. Unless this is the last block, the final
+* COMPRESS_LOOKAHEAD tokens are kept so a run can still be seen whole, and
+* only the last COMPRESS_WINDOW encoded tokens are kept as history.
+* @param context compression context
+* @param final 1 if there are no more tokens
+*/
+static void encode_tokens(TCompressContext *context, int final){
+	int limit = context->tokens_end;
+	int shift;
+
+	if(!final){
+		limit -= COMPRESS_LOOKAHEAD;
+	}
+	context->tokens_floor = 0;
+	context->tokens_stop = context->tokens_end;
+	if(context->format == 2 && context->blocks && context->options.index){
+		context->tokens_start = encode_segments(context, limit);
+	} else if(context->format == 2){
+		context->tokens_start = encode_format2(context, limit);
+	} else {
+		context->tokens_start = encode_format1(context, limit);
+	}
+
+	shift = context->tokens_start - COMPRESS_WINDOW;
+	if(shift > 0){
+		memmove(context->tokens, context->tokens + shift,
+							(context->tokens_end - shift)*sizeof(unsigned int));
+		context->tokens_start -= shift;
+		context->tokens_end -= shift;
+		context->tokens_base += shift;
+	}
+}
+
+/**
+* Add a token ID to the ones waiting to be encoded. With a seek index, every
+* COMPRESS_INDEX_INTERVAL tokens the position in the text is recorded.
+* @param context compression context
+* @param id token ID
+* @param length length of the token text
+*/
+static void token_push(TCompressContext *context, unsigned int id,
+																									size_t length){
+	TIndexEntry *entry = NULL;
 
-				/*
-				* At this time we have found the first separator after a word. So, now
-				* we must write the word read before.
-				*/
-				if (noc != 0){
-					word[noc] = '\0';
-					result = tabela_consultar(*table, word);
-					if(result){
-						fwrite(result, bytes, 1, finalFile);
+	if(context->tokens_end == COMPRESS_WINDOW + COMPRESS_TOKEN_BLOCK){
+		encode_tokens(context, 0);
+	}
+
+	if(context->blocks && context->options.index &&
+			(context->tokens_base + context->tokens_end) % COMPRESS_INDEX_INTERVAL
+																																	== 0){
+		if(context->index_used == context->index_size){
+			context->index_size = context->index_size ? context->index_size*2 : 64;
+			context->index = realloc(context->index,
+																context->index_size*sizeof(TIndexEntry));
+		}
+		entry = &context->index[context->index_used++];
+		entry->block_offset = 0;
+		entry->text_offset = context->text_offset;
+		entry->line = context->text_lines;
+	}
+	context->text_offset += length;
+	context->text_newline = id == context->separators.ids['\n'];
+	context->text_lines += context->text_newline;
+
+	context->tokens[context->tokens_end++] = id;
+}
+
+/**
+* Write the seek index blocks.
+* @param context compression context
+* @return offset of the first index block
+*/
+static long index_write(TCompressContext *context){
+	long offset = ftell(context->fpFinal);
+	int per_block = PALZ_BLOCK_SIZE / PALZ_INDEX_ENTRY_SIZE;
+	TIndexEntry *entry = NULL;
+	int i;
+
+	for(i=0; i<context->index_used; i++){
+		entry = &context->index[i];
+		le_store(context->code + context->code_used, entry->block_offset, 8);
+		le_store(context->code + context->code_used + 8, entry->text_offset, 8);
+		le_store(context->code + context->code_used + 16, entry->line, 8);
+		context->code_used += PALZ_INDEX_ENTRY_SIZE;
+
+		if(i % per_block == per_block - 1 || i == context->index_used - 1){
+			block_write(context->fpFinal, PALZ_BLOCK_INDEX, context->code,
+																								context->code_used);
+			context->code_used = 0;
+		}
+	}
+
+	return offset;
+}
+
+/**
+* Split the source, from its current position, into token IDs encoded in
+* blocks by encode_tokens(), and end the file. The context is ready for a new
+* token stream (write_binary(), append_file()).
+* @param context compression context (hashtable with distinct words and
+* separator set)
+* @param srcFile source file
+*/
+static void encode_source(TCompressContext *context, FILE *srcFile){
+	int *result = NULL;
+	unsigned char *separator_ids = context->separators.ids;
+	char *word = context->word;
+	int noc = 0; /* number of characters */
+	int read;
+	size_t length;
+
+	while((read = fgetc(srcFile))){
+		/* (noc+2) for a separator and \0 after the word */
+		if(noc+2 > context->word_size){
+			context->word_size = context->word_size ? context->word_size*2 : 64;
+			word = realloc(word, sizeof(char)*context->word_size);
+			context->word = word;
+		}
+
+		/* Detect a separator or the end of file (EOF) */
+		if((read == EOF) || separator_ids[read]) {
+
+			/*
+			* At this time we have found the first separator after a word. So, now
+			* we must write the word read before.
+			*/
+			if (noc != 0){
+
+				/* Prefer the word followed by this separator, if it is a composite */
+				if(context->options.composites && read != '\n' && read != EOF){
+					word[noc] = read;
+					word[noc+1] = '\0';
+					if((result = tabela_consultar(context->table, word)) != NULL){
+						token_push(context, *result, noc+1);
+						noc = 0;
+						continue;
 					}
-					noc = 0;
 				}
 
-				/* Now it's time to write the separator */
-				if(read != EOF){
-					separator[0] = read;
-					separator[1] = '\0';
-					result = tabela_consultar(*table, separator);
-					fwrite(result, bytes, 1, finalFile);
-					last_separator = read;
-
-				} else { /* Read EOF */
-					FREE(word);
-					FREE(separator);
-					return 0;
+				word[noc] = '\0';
+				result = tabela_consultar(context->table, word);
+				if(result){
+					token_push(context, *result, noc);
 				}
+				noc = 0;
+			}
+
+			/* Now it's time to write the separator */
+			if(read == EOF){
+				break;
 			}
+			token_push(context, separator_ids[read], 1);
 
 			/* Fill word with char read */
 		} else {
-			last_separator = -1;
 			word[noc] = read;
 			noc++;
 		}
 	}
-	FREE(word);
-	FREE(separator);
+
+	encode_tokens(context, 1);
+	code_flush(context);
+
+	/* End block: size and checksum of the whole text, and the seek index */
+	if(context->blocks){
+		length = PALZ_TRAILER_SIZE;
+		if(context->options.index){
+			le_store(context->code + 12, index_write(context), 8);
+			le_store(context->code + 20, context->text_lines +
+								(context->text_offset > 0 && !context->text_newline), 8);
+			length = PALZ_INDEX_TRAILER_SIZE;
+		}
+		le_store(context->code, context->source_size, 8);
+		le_store(context->code + 8, context->source_crc, 4);
+		block_write(context->fpFinal, PALZ_BLOCK_END, context->code, length);
+	}
+}
+
+/**
+* Write binary code in the .palz file. The source is split into token IDs,
+* which are encoded in blocks by encode_tokens().
+* @param context compression context (hashtable with distinct words and
+* separator set)
+* @param fpSource source file
+* @param fpFinal final file
+* @param bytes number of bytes
+* @return 0 if write binary was successful
+*/
+int write_binary(TCompressContext *context, FILE **fpSource, FILE **fpFinal,
+																																		 int bytes){
+	context->fpFinal = *fpFinal;
+	context->id_bytes = bytes;
+	context->tokens_start = 0;
+	context->tokens_end = 0;
+	context->tokens_base = 0;
+	context->code_used = 0;
+	context->text_offset = 0;
+	context->text_lines = 0;
+	context->text_newline = 0;
+	context->index_used = 0;
+	context->index_done = 0;
+	if(context->options.level > 0){
+		memset(context->head, 0xff, sizeof(long long)*COMPRESS_HASH_SIZE);
+	}
+
+	rewind(*fpSource);
+	encode_source(context, *fpSource);
+
 	return 0;
 }
 
 /**
-* Compare two words. This function was copied from qsort's man page.
-* @param p1 first word to compare
-* @param p2 second word to compare
-* @return the result of strcmp()
+* Check that a .palz file can be extended with the text added to its source:
+* it has checksums and its end block gives the size and CRC-32C of a text
+* that is still the start of the source. The dictionary (words of the header
+* and of word blocks) and the seek index are left in palz, and the source is
+* positioned right after that text.
+* @param context compression context, whose size and CRC-32C of the text are
+* set to those of the .palz file
+* @param palz decompression context to read the .palz file
+* @param final_filename .palz file
+* @param fpSource source file
+* @param header where to store the .palz header
+* @return 1 if the file can be extended, 0 if not
 */
-int cmpstringp(const void *p1, const void *p2){
-	/* The actual arguments to this function are "pointers to
-	pointers to char", but strcmp(3) arguments are "pointers
-	to char", hence the following cast plus dereference */
-	return strcmp(* (char * const *) p1, * (char * const *) p2);
+static int append_check(TCompressContext *context, TDecompressContext *palz,
+										const char *final_filename, FILE *fpSource, TPalzHeader *header){
+	FILE *fpFinal = NULL;
+	unsigned long long left;
+	unsigned int crc = 0;
+	size_t nread;
+	int ok;
+
+	if(decompress_open(palz, final_filename, header, &fpFinal) != 0){
+		return 0;
+	}
+	ok = header->version == 2 && header->checksums &&
+						header->window >= COMPRESS_WINDOW &&
+						decompress_blocks(palz, fpFinal, ULLONG_MAX) == 0 &&
+						palz->code_end != 0 &&
+						(header->index == 0 || index_read(palz, fpFinal) == 0);
+	fclose(fpFinal);
+	if(!ok){
+		return 0;
+	}
+
+	/* The text already compressed must not have changed */
+	context->text_newline = 1;
+	for(left = palz->trailer_size; left > 0; left -= nread){
+		nread = fread(context->code, 1, left < COMPRESS_IO_BUFFER ? left :
+																						COMPRESS_IO_BUFFER, fpSource);
+		if(nread == 0 || memchr(context->code, '\0', nread) != NULL){
+			return 0;
+		}
+		crc = crc32c(crc, context->code, nread);
+		context->text_newline = context->code[nread-1] == '\n';
+	}
+	if(crc != palz->trailer_crc){
+		return 0;
+	}
+
+	context->source_size = palz->trailer_size;
+	context->source_crc = crc;
+	context->text_offset = palz->trailer_size;
+	/* The end block counts a last line without newline */
+	context->text_lines = palz->trailer_lines - (header->index != 0 &&
+											palz->trailer_size > 0 && !context->text_newline);
+
+	return 1;
 }
 
 /**
-* Insert separators in the hashtable.
-* @param table hashtable to fill
+* Find the words of the added text that are not in the dictionary yet and
+* give them the next token IDs. The dictionary of the .palz file is loaded in
+* the hashtable first.
+* @param context compression context
+* @param palz decompression context with the dictionary
+* @param header .palz header
+* @param fpSource source file positioned at the added text
+* @return number of new words (in context->words), or -1 if their IDs do not
+* fit in the token width of the file, a word does not fit in a word block or
+* the text has a NUL (where the tokens would end)
 */
-void add_separators(HASHTABLE_T **table){
-	HASHTABLE_T *aux = NULL;
-	aux = *table;
+static int append_words(TCompressContext *context, TDecompressContext *palz,
+															TPalzHeader *header, FILE *fpSource){
+	TDictionary *dictionary = palz->words;
+	unsigned char *separator_ids = context->separators.ids;
+	unsigned int next = context->separators.count + 1;
+	unsigned int max = header->width == 4 || header->width == 0 ?
+														COMPRESS_MAX_WORDS : (1u << (8*header->width)) - 1;
+	char **array = context->words;
+	char *word = NULL;
+	int *value;
+	int count = 0, i;
+	size_t length;
+	ssize_t nread;
+	char next_char;
+
+	for(i=0; i<dictionary->nElements; i++, next++){
+		length = dictionary->offset[i+1] - dictionary->offset[i];
+		if(length + 1 > (size_t)context->word_size){
+			context->word_size = length + 1;
+			context->word = realloc(context->word, context->word_size);
+		}
+		memcpy(context->word, dictionary->text + dictionary->offset[i], length);
+		context->word[length] = '\0';
 
-	int *number = NULL;
+		/* Composites of the dictionary are used for the new text too */
+		if(length > 1 && separator_ids[(unsigned char)context->word[length-1]]){
+			context->options.composites = 1;
+		}
+		value = arena_alloc(context->arena, sizeof(int));
+		*value = next;
+		tabela_inserir(context->table, context->word, value);
+	}
 
-	number = MALLOC(sizeof(int));
-	*number = 1;
-	tabela_inserir(aux, "\n", number);
+	while((nread = read_line(context, fpSource)) > 0){
+		word = context->line;
+
+		/* A text with a NUL is stored instead, as compress_stream() does */
+		if(strnlen(word, nread) < (size_t)nread){
+			context->words = array;
+			return -1;
+		}
+		context->source_crc = crc32c(context->source_crc, word, nread);
+		context->source_size += nread;
+
+		while(separator_ids[(unsigned char)*word]){
+			word++;
+		}
+		while(*word){
+			for(length = 0; word[length] != '\0' &&
+									!separator_ids[(unsigned char)word[length]]; length++);
+			next_char = word[length];
+			word[length] = '\0';
+
+			if(tabela_consultar(context->table, word) == NULL){
+				if(next > max || length + 5 > PALZ_BLOCK_SIZE){
+					context->words = array;
+					return -1;
+				}
+				value = arena_alloc(context->arena, sizeof(int));
+				*value = next++;
+				tabela_inserir(context->table, word, value);
+
+				if(count == context->words_size){
+					context->words_size = context->words_size ? context->words_size*2
+																										: COMPRESS_TABLE_SIZE;
+					array = realloc(array, context->words_size*sizeof(char*));
+				}
+				array[count++] = arena_strdup(context->arena, word);
+			}
 
-	number = MALLOC(sizeof(int));
-	*number = 2;
-	tabela_inserir(aux, "\t", number);
+			word[length] = next_char;
+			word += length;
+			while(separator_ids[(unsigned char)*word]){
+				word++;
+			}
+		}
+	}
+	context->words = array;
 
-	number = MALLOC(sizeof(int));
-	*number = 3;
-	tabela_inserir(aux, "\r", number);
+	return count;
+}
 
-	number = MALLOC(sizeof(int));
-	*number = 4;
-	tabela_inserir(aux, " ", number);
+/**
+* Write the new words in word blocks, as many words as fit in each.
+* @param context compression context
+* @param count number of new words (in context->words)
+* @param first token ID of the first new word
+*/
+static void append_write_words(TCompressContext *context, int count,
+																								unsigned int first){
+	size_t used = 4, length;
+	int i, start = 0;
+
+	for(i=0; i<=count; i++){
+		length = i < count ? strlen(context->words[i]) + 1 : 0;
+		if(i == count || used + length > PALZ_BLOCK_SIZE){
+			if(i > start){
+				le_store(context->code, first + start, 4);
+				block_write(context->fpFinal, PALZ_BLOCK_WORDS, context->code, used);
+			}
+			start = i;
+			used = 4;
+		}
+		if(i < count){
+			memcpy(context->code + used, context->words[i], length - 1);
+			context->code[used + length - 1] = '\n';
+			used += length;
+		}
+	}
+}
 
-	number = MALLOC(sizeof(int));
-	*number = 5;
-	tabela_inserir(aux, "?", number);
+/**
+* Append the text added to a file since it was compressed (a growing log) to
+* its .palz file. Only the new text is encoded: its new words go to word
+* blocks and its code to data blocks after the ones already there, and the
+* seek index and end block are written again. The text already compressed is
+* only read to check its CRC-32C. Files that can't be extended this way (no
+* checksums, text changed, token IDs too narrow for the new words, a NUL in
+* the new text) are compressed again with compress_file().
+* @param context compression context
+* @param source_filename text file
+* @return compress_ratio() or an error code
+*/
+int append_file(TCompressContext *context, char *source_filename){
+	TStats *stats = &context->stats;
+	TSeparators separators = context->separators;
+	TCompressOptions options = context->options;
+	TDecompressContext *palz = NULL;
+	TPalzHeader header;
+	FILE *fpSource = NULL;
+	FILE *fpFinal = NULL;
+	char *final_filename = NULL;
+	char *output_filename = NULL;
+	float source_file_size = 0;
+	float final_file_size = 0;
+	unsigned int first = 0;
+	off_t offset = 0;
+	int count = -1;
+	int fd = -1;
+	double start;
 
-	number = MALLOC(sizeof(int));
-	*number = 6;
-	tabela_inserir(aux, "!", number);
+	compress_context_reset(context);
+	start = stats_now();
 
-	number = MALLOC(sizeof(int));
-	*number = 7;
-	tabela_inserir(aux, ".", number);
+	if ((fpSource = fopen(source_filename, "r")) == NULL) {
+		return ERR_FOPEN;
+	}
+	setvbuf(fpSource, context->source_buffer, _IOFBF, COMPRESS_IO_BUFFER);
 
-	number = MALLOC(sizeof(int));
-	*number = 8;
-	tabela_inserir(aux, ";", number);
+	final_filename = MALLOC(sizeof(char)*(strlen(source_filename)+6));
+	strcpy(final_filename, source_filename);
+	strcat(final_filename, ".palz");
 
-	number = MALLOC(sizeof(int));
-	*number = 9;
-	tabela_inserir(aux, ",", number);
+	/* The words of the new text take the IDs after the dictionary */
+	palz = decompress_context_create();
+	if(append_check(context, palz, final_filename, fpSource, &header)){
+		context->separators = palz->separators;
+		first = palz->separators.count + palz->words->nElements + 1;
+		count = append_words(context, palz, &header, fpSource);
+	}
 
-	number = MALLOC(sizeof(int));
-	*number = 10;
-	tabela_inserir(aux, ":", number);
+	if(count < 0){
+		decompress_context_free(&palz);
+		fclose(fpSource);
+		FREE(final_filename);
+		context->separators = separators;
+		context->options = options;
+		return compress_file(context, source_filename);
+	}
 
-	number = MALLOC(sizeof(int));
-	*number = 11;
-	tabela_inserir(aux, "+", number);
+	/* Text added: the file is written again under its partial name, from a
+	copy of its code up to where the index (or end) block was, and renamed
+	once complete, so a failed run leaves the old file as it was */
+	if(context->source_size > palz->trailer_size){
+		output_filename = partial_filename(final_filename);
+		if((fd = open(final_filename, O_RDONLY)) < 0 ||
+						(fpFinal = fopen(output_filename, "wb")) == NULL ||
+						file_copy(fd, &offset, fileno(fpFinal), palz->code_end) !=
+											(long long)palz->code_end ||
+						fseeko(fpFinal, 0, SEEK_END) != 0){
+			if(fd >= 0){
+				close(fd);
+			}
+			if(fpFinal != NULL){
+				fclose(fpFinal);
+				unlink(output_filename);
+			}
+			fclose(fpSource);
+			decompress_context_free(&palz);
+			FREE(output_filename);
+			FREE(final_filename);
+			context->separators = separators;
+			context->options = options;
+			return ERR_FOPEN;
+		}
+		close(fd);
+		setvbuf(fpFinal, context->final_buffer, _IOFBF, COMPRESS_IO_BUFFER);
+		context->fpFinal = fpFinal;
+		append_write_words(context, count, first);
+
+		/* The new text starts a new token stream, and a restart point */
+		context->format = 2;
+		context->blocks = 1;
+		context->options.index = header.index != 0;
+		context->id_bytes = header.width;
+		context->tokens_start = 0;
+		context->tokens_end = 0;
+		context->tokens_base = 0;
+		context->code_used = 0;
+		if(palz->index_used > context->index_size){
+			context->index_size = palz->index_used;
+			context->index = realloc(context->index,
+															context->index_size*sizeof(TIndexEntry));
+		}
+		if(palz->index_used > 0){
+			memcpy(context->index, palz->index,
+														palz->index_used*sizeof(TIndexEntry));
+		}
+		context->index_used = palz->index_used;
+		context->index_done = palz->index_used;
+		if(context->options.level > 0){
+			memset(context->head, 0xff, sizeof(long long)*COMPRESS_HASH_SIZE);
+		}
 
-	number = MALLOC(sizeof(int));
-	*number = 12;
-	tabela_inserir(aux, "-", number);
+		fseek(fpSource, palz->trailer_size, SEEK_SET);
+		encode_source(context, fpSource);
+
+		if(fclose(fpFinal) != 0 || rename(output_filename, final_filename) != 0){
+			unlink(output_filename);
+			FREE(output_filename);
+			fclose(fpSource);
+			decompress_context_free(&palz);
+			FREE(final_filename);
+			context->separators = separators;
+			context->options = options;
+			return ERR_FOPEN;
+		}
+		FREE(output_filename);
+	}
+	/* Otherwise nothing was added since the last run */
+	stats->time_encode = stats_now() - start;
 
-	number = MALLOC(sizeof(int));
-	*number = 13;
-	tabela_inserir(aux, "*", number);
+	fclose(fpSource);
+	decompress_context_free(&palz);
+	context->separators = separators;
+	context->options = options;
 
-	number = MALLOC(sizeof(int));
-	*number = 14;
-	tabela_inserir(aux, "/", number);
+	if ((source_file_size = get_size(source_filename)) == -1 ||
+						(final_file_size = get_size(final_filename)) == -1) {
+		FREE(final_filename);
+		return ERR_FSTATUS;
+	}
+
+	stats->time_total = stats_now() - start;
+	stats->distinct_words = count;
+	stats->id_width = header.width;
+	stats->bytes_read = source_file_size;
+	stats->bytes_written = final_file_size;
+	if(stats_enabled){
+		stats_print(stats, "append", source_filename);
+	}
+
+	fprintf(stderr,"Compression ratio: %s ", source_filename);
+
+	FREE(final_filename);
+
+	return compress_ratio(final_file_size, source_file_size);
+}
+
+/**
+* Compare two words. This function was copied from qsort's man page.
+* @param p1 first word to compare
+* @param p2 second word to compare
+* @return the result of strcmp()
+*/
+int cmpstringp(const void *p1, const void *p2){
+	/* The actual arguments to this function are "pointers to
+	pointers to char", but strcmp(3) arguments are "pointers
+	to char", hence the following cast plus dereference */
+	return strcmp(* (char * const *) p1, * (char * const *) p2);
+}
+
+/**
+* Check if a file of a folder run is not worth compressing: its estimated
+* ratio is below --min-ratio, or it is not a text file. Called by the worker
+* that got the file, right before it would compress it.
+* @param context compression context of the worker (separators, min_ratio)
+* @param path
+* @return 1 to leave the file out, 0 to compress it
+* @see estimate_file()
+*/
+int compress_poor(TCompressContext *context, const char *path){
+	TEstimate estimate;
+
+	if (context->options.min_ratio < 0 ||
+				estimate_file(path, &context->separators, &estimate) != 0 ||
+				(!estimate.binary && estimate.ratio >= context->options.min_ratio)) {
+		return 0;
+	}
+	if (estimate.binary) {
+		fprintf(stderr, "%s: skipped, not a text file\n", path);
+	} else {
+		fprintf(stderr, "%s: skipped, estimated ratio %.2f %%\n", path,
+																												estimate.ratio);
+	}
+
+	return 1;
 }
 
 /**
@@ -352,7 +1643,7 @@ void add_separators(HASHTABLE_T **table){
 * must be compressed by one thread only.
 * @param directory main directory where to start
 * @param max_threads maximum number of threads
-* @return 0 at end
+* @return number of outputs written in the background that failed
 * @see compress_file()
 */
 int parallel_folder_compress(char *directory, int max_threads){
@@ -382,7 +1673,29 @@ int parallel_folder_compress(char *directory, int max_threads){
 	param.stop = 0;
 	param.max = max_threads;
 	param.mode = COMPRESS_MODE;
-	param.dictionary = NULL;
+	param.failed = 0;
+	param.manifest = NULL;
+	param.archive = NULL;
+	param.io = NULL;
+	param.progress = NULL;
+	param.journal = NULL;
+	if (progress_enabled) {
+		param.progress = progress_create(max_threads);
+	}
+
+	/* --journal: files finished by an interrupted run are skipped. A file is
+	journaled once its output is renamed in place, so the outputs are not
+	written behind by --io */
+	if (journal_enabled) {
+		param.journal = journal_open(directory, "compress");
+	}
+
+	/* --incremental: files of the last run are skipped when unchanged */
+	if (compress_options.incremental) {
+		param.manifest = manifest_load(directory, compress_options.incremental);
+	} else if (param.journal == NULL) {
+		param.io = asyncio_create(asyncio_backend);
+	}
 
 	int i;
 
@@ -403,8 +1716,31 @@ int parallel_folder_compress(char *directory, int max_threads){
 		get_error_msg(output, NULL);
 	}
 
+	/* Leave out the files whose size, modification time and inode did not
+	change, and count the others in the progress before they are queued (the
+	workers leave out the ones not worth compressing, --min-ratio) */
+	for(i = 0; i<amount; i++){
+		if (param.manifest != NULL &&
+								manifest_current(param.manifest, files_to_compress[i])) {
+			fprintf(stderr, "%s: unchanged\n", files_to_compress[i]);
+			FREE(files_to_compress[i]);
+		} else if (param.journal != NULL &&
+								journal_finished(param.journal, files_to_compress[i])) {
+			FREE(files_to_compress[i]);
+		} else if (param.progress != NULL) {
+			progress_add(param.progress, files_to_compress[i]);
+		}
+	}
+
 	/* Give all files to compress to write on buffer */
 	for(i = 0; i<amount; i++){
+		if (files_to_compress[i] == NULL) {
+			continue;
+		}
+		/* Read the file ahead while it waits for a thread */
+		if (param.io != NULL) {
+			asyncio_read(param.io, files_to_compress[i]);
+		}
 		write_on_buffer(files_to_compress[i], &param);
 		FREE(files_to_compress[i]);
 	}
@@ -448,11 +1784,40 @@ int parallel_folder_compress(char *directory, int max_threads){
 		ERROR(C_ERRO_CONDITION_DESTROY, "pthread_cond_destroy() failed!");
 	}
 
+	/* Wait for the files still being written, counting the ones that fail */
+	if (param.io != NULL) {
+		param.failed += asyncio_free(&param.io);
+	}
+
+	/* Summary of the whole job */
+	if (param.progress != NULL) {
+		progress_free(&param.progress);
+	}
+
+	/* The journal of an interrupted job is kept for the next run */
+	if (param.journal != NULL) {
+		if (param.journal->resumed > 0) {
+			fprintf(stderr, "%d files done by an earlier run\n",
+																							param.journal->resumed);
+		}
+		journal_close(&param.journal, !got_signal);
+	}
+
+	/* Keep the files found by this run for the next one */
+	if (param.manifest != NULL) {
+		if ((output = manifest_save(param.manifest)) < 0) {
+			get_error_msg(output, MANIFEST_NAME);
+		}
+		fprintf(stderr, "%d unchanged, %d compressed\n",
+							param.manifest->unchanged, param.manifest->compressed);
+		manifest_free(&param.manifest);
+	}
+
 	/* Free buffer */
 	for (i=0; i<param.max; i++){
 		FREE(param.buffer[i]);
 	}
 	FREE(param.buffer);
 
-	return 0;
+	return param.failed;
 }
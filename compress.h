@@ -12,13 +12,121 @@
 #include "decompress.h"
 #include "listas.h"
 #include "hashtables.h"
+#include "crc32c.h"
+
+#define COMPRESS_TABLE_SIZE             101
+/* A reused table past this size shrinks back on reset: clearing walks it */
+#define COMPRESS_TABLE_KEEP             (1 << 16)
+/* The hashtable size is an int and doubles when half full */
+#define COMPRESS_MAX_WORDS              (1 << 29)
+#define COMPRESS_IO_BUFFER              65536
+
+/* Token IDs encoded per block and already encoded IDs kept as history */
+#define COMPRESS_TOKEN_BLOCK            65536
+#define COMPRESS_WINDOW                 65536
+/* Tokens left unencoded at the end of a block so runs are not cut short */
+#define COMPRESS_LOOKAHEAD              256
+/* Longest repeated token sequence encoded as a run (format 2) */
+#define COMPRESS_MAX_PERIOD             8
+/* LZ77 match finder: hash chains over COMPRESS_MIN_MATCH token IDs */
+#define COMPRESS_MIN_MATCH              3
+#define COMPRESS_HASH_BITS              16
+#define COMPRESS_HASH_SIZE              (1 << COMPRESS_HASH_BITS)
+#define COMPRESS_MAX_LEVEL              9
+/* Tokens between two restart points of the seek index */
+#define COMPRESS_INDEX_INTERVAL         65536
+/* Longest stored file header: magic, size, CRC-32C and 255 separators */
+#define COMPRESS_STORED_HEADER          640
+
+/* Match search effort: candidates tried and length good enough to stop */
+typedef struct compress_level{
+	int chain;
+	int nice;
+}TCompressLevel;
+
+/* Word (or word plus separator) and its number of occurrences */
+typedef struct word_count{
+	char *text;
+	int *occurrences;
+}TWordCount;
+
+/* Per-thread compression state, kept between files */
+typedef struct compress_context{
+	/* hashtable entries, word counts and IDs, words and composites of the
+	current file (arena_reset() by compress_context_reset()) */
+	TArena *arena;
+	HASHTABLE_T *table;
+	/* distinct words */
+	char **words;
+	int words_size;
+	/* getline() buffer */
+	char *line;
+	size_t line_len;
+	/* word being read by write_binary() */
+	char *word;
+	int word_size;
+	/* stdio buffers */
+	char *source_buffer;
+	char *final_buffer;
+	/* compression settings */
+	TCompressOptions options;
+	TSeparators separators;
+	/* format of the current file (options.format or 2 for 4-byte IDs) */
+	int format;
+	/* token IDs: history, then IDs waiting to be encoded */
+	unsigned int *tokens;
+	int tokens_start;
+	int tokens_end;
+	/* tokens the encoder may refer to and match up to (restart points) */
+	int tokens_floor;
+	int tokens_stop;
+	/* position in the file of tokens[0] */
+	long long tokens_base;
+	/* hash chains: last position of each hash, previous one of each position */
+	long long *head;
+	long long *chain;
+	/* binary code waiting to be written to fpFinal */
+	unsigned char *code;
+	size_t code_used;
+	FILE *fpFinal;
+	int id_bytes;
+	/* binary code written in checksummed blocks, and the size and CRC-32C
+	of the text they encode */
+	int blocks;
+	unsigned long long source_size;
+	unsigned int source_crc;
+	/* seek index: text and lines tokenized so far, and restart points (the
+	first index_done have their block offset) */
+	unsigned long long text_offset;
+	unsigned long long text_lines;
+	int text_newline;
+	TIndexEntry *index;
+	int index_used;
+	int index_size;
+	int index_done;
+	/* composites counted for the current file */
+	HASHTABLE_T *composites;
+	TWordCount *candidates;
+	int candidates_used;
+	int candidates_size;
+	/* statistics of the last file */
+	TStats stats;
+}TCompressContext;
+
+int compress_separators(TSeparators *set, const char *extra);
+TCompressContext *compress_context_create(void);
+void compress_context_reset(TCompressContext *context);
+void compress_context_free(TCompressContext **context);
 
 /* Compress file */
-int compress_file(char *source_filename);
-int write_binary(HASHTABLE_T** tabela, FILE **fpSource, FILE **fpFinal, int bytes);
+int compress_file(TCompressContext *context, char *source_filename);
+int compress_stream(TCompressContext *context, char *source_filename,
+                                              FILE *fpInput, FILE *fpOutput);
+int write_binary(TCompressContext *context, FILE **fpSource, FILE **fpFinal, int bytes);
+int append_file(TCompressContext *context, char *source_filename);
 
 int cmpstringp(const void *p1, const void *p2);
-void add_separators(HASHTABLE_T **table);
+int compress_poor(TCompressContext *context, const char *path);
 
 int parallel_folder_compress(char *directory, int max_threads);
 #endif
@@ -0,0 +1,214 @@
+/**
+* @file crc32c.c
+* @brief CRC-32C (Castagnoli) checksums of .palz blocks. The SSE4.2 crc32
+* instruction is used when the CPU has it, a slicing-by-8 table otherwise.
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42               1
+#endif
+
+/* Reflected Castagnoli polynomial */
+#define CRC32C_POLY                     0x82f63b78u
+
+static uint32_t crc32c_table[8][256];
+static int crc32c_hardware = 0;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+* Build the lookup tables and check for the SSE4.2 instruction. Called once.
+*/
+static void crc32c_init(void){
+  uint32_t crc;
+  int i, j;
+
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (j = 0; j < 8; j++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc32c_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    crc = crc32c_table[0][i];
+    for (j = 1; j < 8; j++) {
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[j][i] = crc;
+    }
+  }
+
+#ifdef HAVE_CRC32C_SSE42
+  __builtin_cpu_init();
+  crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/**
+* Table driven CRC, eight bytes per step.
+* @param crc running CRC (already inverted)
+* @param data
+* @param length
+* @return running CRC
+*/
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *data,
+                                                                size_t length){
+  uint64_t word;
+
+  while (length >= 8) {
+    memcpy(&word, data, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    word ^= crc;
+    crc = crc32c_table[7][word & 0xff] ^
+          crc32c_table[6][(word >> 8) & 0xff] ^
+          crc32c_table[5][(word >> 16) & 0xff] ^
+          crc32c_table[4][(word >> 24) & 0xff] ^
+          crc32c_table[3][(word >> 32) & 0xff] ^
+          crc32c_table[2][(word >> 40) & 0xff] ^
+          crc32c_table[1][(word >> 48) & 0xff] ^
+          crc32c_table[0][word >> 56];
+    data += 8;
+    length -= 8;
+  }
+  while (length-- > 0) {
+    crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  }
+
+  return crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+/**
+* CRC with the SSE4.2 crc32 instruction, eight bytes per instruction.
+* @param crc running CRC (already inverted)
+* @param data
+* @param length
+* @return running CRC
+*/
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data,
+                                                                size_t length){
+  uint64_t crc64 = crc, word;
+
+  while (length >= 8) {
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    length -= 8;
+  }
+  crc = crc64;
+  while (length-- > 0) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+
+  return crc;
+}
+#endif
+
+/**
+* Update a CRC-32C with more data. Start with a crc of 0; the result of one
+* call can be passed to the next to checksum data given in pieces.
+* @param crc CRC of the data before (0 for none)
+* @param data
+* @param length number of bytes
+* @return CRC of all the data
+*/
+unsigned int crc32c(unsigned int crc, const void *data, size_t length){
+  pthread_once(&crc32c_once, crc32c_init);
+
+#ifdef HAVE_CRC32C_SSE42
+  if (crc32c_hardware) {
+    return ~crc32c_sse42(~crc, data, length);
+  }
+#endif
+
+  return ~crc32c_software(~crc, data, length);
+}
+
+/**
+* Multiply a vector by a 32x32 matrix over GF(2).
+* @param matrix one column per bit of the vector
+* @param vector
+* @return product
+*/
+static uint32_t gf2_times(const uint32_t *matrix, uint32_t vector){
+  uint32_t sum = 0;
+
+  for (; vector != 0; vector >>= 1, matrix++) {
+    if (vector & 1) {
+      sum ^= *matrix;
+    }
+  }
+
+  return sum;
+}
+
+/**
+* Square a 32x32 matrix over GF(2).
+* @param square where to store the result
+* @param matrix
+*/
+static void gf2_square(uint32_t *square, const uint32_t *matrix){
+  int n;
+
+  for (n = 0; n < 32; n++) {
+    square[n] = gf2_times(matrix, matrix[n]);
+  }
+}
+
+/**
+* Compute the CRC-32C of two pieces of data from the CRC of each, by applying
+* length2 zero bytes to the first one with the operator squared for every bit
+* of length2.
+* @param crc1 CRC of the first piece
+* @param crc2 CRC of the second piece
+* @param length2 length of the second piece
+* @return CRC of both pieces
+*/
+unsigned int crc32c_combine(unsigned int crc1, unsigned int crc2,
+                                               unsigned long long length2){
+  uint32_t even[32], odd[32], row = 1;
+  int n;
+
+  if (length2 == 0) {
+    return crc1;
+  }
+
+  /* Operator for one zero bit, then two and four */
+  odd[0] = CRC32C_POLY;
+  for (n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  gf2_square(even, odd);
+  gf2_square(odd, even);
+
+  /* One zero byte first, squared for each bit of length2 */
+  do {
+    gf2_square(even, odd);
+    if (length2 & 1) {
+      crc1 = gf2_times(even, crc1);
+    }
+    length2 >>= 1;
+    if (length2 == 0) {
+      break;
+    }
+    gf2_square(odd, even);
+    if (length2 & 1) {
+      crc1 = gf2_times(odd, crc1);
+    }
+    length2 >>= 1;
+  } while (length2 != 0);
+
+  return crc1 ^ crc2;
+}
@@ -0,0 +1,17 @@
+/**
+* @file crc32c.h
+* @brief The header file for crc32c.c
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stddef.h>
+
+unsigned int crc32c(unsigned int crc, const void *data, size_t length);
+unsigned int crc32c_combine(unsigned int crc1, unsigned int crc2,
+                                              unsigned long long length2);
+
+#endif
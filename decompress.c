@@ -6,195 +6,2215 @@
 * @author Eurico Sousa <2110133@my.ipleiria.pt>
 */
 #include "decompress.h"
+#include "asyncio.h"
+#include "journal.h"
 #include "common.h"
 
 /* External variables */
 extern int got_signal;
+extern int stats_enabled;
+extern int asyncio_backend;
+extern int journal_enabled;
+
+/* Global vars */
+int decompress_threads = 1;
+
+/**
+* Create a decompression context. A context is owned by one thread and can be
+* used to decompress any number of files, one at a time.
+* @return new context
+* @see decompress_context_reset()
+*/
+TDecompressContext *decompress_context_create(void){
+  TDecompressContext *context = MALLOC(sizeof(TDecompressContext));
+
+  context->separators.count = 0;
+  dictionary_init(&context->words);
+
+  context->line = NULL;
+  context->line_len = 0;
+  context->source_buffer = MALLOC(DECOMPRESS_IO_BUFFER);
+  /* Room for a whole block after the bytes of a token cut by it */
+  context->input = MALLOC(PALZ_BLOCK_SIZE + 8);
+  context->input_pos = 0;
+  context->input_end = 0;
+  context->input_left = ULLONG_MAX;
+  context->input_total = 0;
+  context->blocks = 0;
+  context->input_done = 0;
+  context->input_error = 0;
+  context->index = NULL;
+  context->index_used = 0;
+  context->index_size = 0;
+  context->output = MALLOC(DECOMPRESS_OUTPUT_BUFFER);
+  context->output_used = 0;
+  context->fpFinal = NULL;
+  context->output_size = 0;
+  context->output_crc = 0;
+  context->range = 0;
+  context->sink = NULL;
+  context->sink_data = NULL;
+  context->split = NULL;
+  context->segment = NULL;
+  context->history = NULL;
+  context->history_size = 0;
+  context->history_count = 0;
+  context->sequence = NULL;
+  context->sequence_size = 0;
+  context->stored_words = NULL;
+  context->arena = arena_create();
+
+  return context;
+}
+
+/**
+* Prepare a context for the next file. Words from the previous header are
+* released but the dictionary keeps its allocated capacity; the word table
+* of a stored file goes with the arena.
+* @param context
+*/
+void decompress_context_reset(TDecompressContext *context){
+  stats_reset(&context->stats);
+  context->input_pos = 0;
+  context->input_end = 0;
+  context->input_left = ULLONG_MAX;
+  context->input_total = 0;
+  context->blocks = 0;
+  context->input_done = 0;
+  context->input_error = 0;
+  context->trailer_index = 0;
+  context->trailer_lines = 0;
+  context->index_used = 0;
+  context->output_used = 0;
+  context->output_size = 0;
+  context->output_crc = 0;
+  context->range = 0;
+  context->range_done = 0;
+  context->sink = NULL;
+  context->split = NULL;
+  context->segment = NULL;
+  context->history_count = 0;
+  if (context->stored_words != NULL) {
+    tabela_destruir(&context->stored_words);
+    context->stored_words = NULL;
+  }
+  arena_reset(context->arena);
+
+  dictionary_restart(&context->words);
+}
+
+/**
+* Free a decompression context.
+* @param context
+*/
+void decompress_context_free(TDecompressContext **context){
+  TDecompressContext *aux = *context;
+
+  decompress_context_reset(aux);
+  dictionary_free(&aux->words);
+  FREE(aux->line);
+  FREE(aux->source_buffer);
+  FREE(aux->input);
+  FREE(aux->index);
+  FREE(aux->output);
+  FREE(aux->history);
+  FREE(aux->sequence);
+  arena_free(&aux->arena);
+  FREE(*context);
+}
+
+/**
+* Read the payload of an end block: size and CRC-32C of the text and, for
+* files with a seek index, where the index starts and the number of lines.
+* @param context decompression context
+* @param payload
+* @param length
+* @return 0 or ERR_PALZCORRUPTED
+*/
+static int trailer_read(TDecompressContext *context,
+                                 const unsigned char *payload, size_t length){
+  if (length != PALZ_TRAILER_SIZE && length != PALZ_INDEX_TRAILER_SIZE) {
+    return ERR_PALZCORRUPTED;
+  }
+  context->trailer_size = le_load(payload, 8);
+  context->trailer_crc = le_load(payload + 8, 4);
+  if (length == PALZ_INDEX_TRAILER_SIZE) {
+    context->trailer_index = le_load(payload + 12, 8);
+    context->trailer_lines = le_load(payload + 20, 8);
+  }
+
+  return 0;
+}
+
+/**
+* Add the words of a word block to the dictionary. A block read before (by
+* decompress_blocks()) is skipped when the decoder reaches it.
+* @param context decompression context
+* @param payload ID of the first word and the words, each ending in a newline
+* @param length
+* @return 0 or ERR_PALZCORRUPTED
+*/
+static int words_read(TDecompressContext *context, unsigned char *payload,
+                                                               size_t length){
+  TDictionary *words = context->words;
+  unsigned int next = context->separators.count + words->nElements + 1;
+  char *word = (char *)payload + 4;
+  char *end = (char *)payload + length;
+  char *newline = NULL;
+
+  if (length < 4) {
+    return ERR_PALZCORRUPTED;
+  }
+  if (le_load(payload, 4) < next) {
+    return 0;
+  }
+  if (le_load(payload, 4) != next) {
+    return ERR_PALZCORRUPTED;
+  }
+
+  while (word < end) {
+    if ((newline = memchr(word, '\n', end - word)) == NULL) {
+      return ERR_PALZCORRUPTED;
+    }
+    dictionary_add_element(&words, &word, newline - word + 1);
+    word = newline + 1;
+  }
+
+  return 0;
+}
+
+/**
+* Read the next checksummed block of binary code into the input buffer. The
+* end block stops the input and a block that fails its checksum stops it with
+* an error, before any of its code is decoded. Word blocks add their words to
+* the dictionary. A segment of a parallel decode stops input_left bytes into
+* its code.
+* @param context decompression context
+* @param fp source file
+*/
+static void input_block(TDecompressContext *context, FILE *fp){
+  unsigned char *payload = context->input + context->input_end;
+  long offset = context->split != NULL ? ftell(fp) : 0;
+  size_t length;
+  int type;
+
+  if ((context->input_error = block_read(fp, &type, payload, PALZ_BLOCK_SIZE,
+                                                             &length)) != 0) {
+    context->input_done = 1;
+    return;
+  }
+
+  if (type == PALZ_BLOCK_DATA) {
+    if (context->split != NULL) {
+      context->split->block = offset;
+      context->split->block_code = context->input_total;
+    }
+    if (length >= context->input_left) {
+      length = context->input_left;
+      context->input_done = 1;
+    }
+    context->input_left -= length;
+    context->input_total += length;
+    context->input_end += length;
+  } else if (type == PALZ_BLOCK_WORDS) {
+    if ((context->input_error = words_read(context, payload, length)) != 0) {
+      context->input_done = 1;
+    }
+  } else if (type == PALZ_BLOCK_INDEX) {
+    /* The seek index follows the last data block */
+  } else if (type == PALZ_BLOCK_END &&
+                                   trailer_read(context, payload, length) == 0) {
+    context->input_done = 1;
+  } else {
+    context->input_error = ERR_PALZCORRUPTED;
+    context->input_done = 1;
+  }
+}
+
+/**
+* Make sure the context input buffer holds at least bytes unread bytes. The
+* binary code is read in blocks of DECOMPRESS_IO_BUFFER bytes, or one
+* checksummed block at a time.
+* @param context decompression context
+* @param bytes number of bytes needed
+* @param fp source file
+* @return 1 if the bytes are available, 0 at the end of the file
+*/
+static int input_fill(TDecompressContext *context, size_t bytes, FILE *fp){
+  size_t left, room;
+  double start = 0;
+
+  if (context->input_pos + bytes <= context->input_end) {
+    return 1;
+  }
+
+  /* A range extraction stops once the range is decoded */
+  if (context->range && context->output_size + context->output_used >=
+                                                         context->range_end) {
+    context->range_done = 1;
+    context->input_done = 1;
+    return 0;
+  }
+
+  /* Refill the input buffer, keeping the bytes not consumed yet */
+  if (stats_enabled) {
+    start = stats_now();
+  }
+  left = context->input_end - context->input_pos;
+  memmove(context->input, context->input + context->input_pos, left);
+  context->input_pos = 0;
+  context->input_end = left;
+  if (context->blocks) {
+    while (context->input_end < bytes && !context->input_done) {
+      input_block(context, fp);
+    }
+  } else {
+    /* A member of an archive ends before the end of the file */
+    room = DECOMPRESS_IO_BUFFER - left;
+    if (room > context->input_left) {
+      room = context->input_left;
+    }
+    room = fread(context->input + left, 1, room, fp);
+    context->input_left -= room;
+    context->input_total += room;
+    context->input_end += room;
+  }
+  if (stats_enabled) {
+    context->stats.time_io += stats_now() - start;
+  }
+
+  return context->input_end >= bytes;
+}
+
+/**
+* Read an unsigned LEB128 varint from the binary code.
+* @param context decompression context
+* @param value where to store the value read
+* @param fp source file
+* @return 1 if a valid varint was read, 0 otherwise
+*/
+static int read_varint(TDecompressContext *context, unsigned int *value,
+                                                                    FILE *fp){
+  unsigned int result = 0;
+  unsigned char byte;
+  int shift = 0;
+
+  do {
+    if (!input_fill(context, 1, fp) || shift > 28) {
+      return 0;
+    }
+    byte = context->input[context->input_pos++];
+    if (shift == 28 && byte > 0x0f) {
+      return 0;
+    }
+    result |= (unsigned int)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+
+  *value = result;
+
+  return 1;
+}
+
+/**
+* Read a little-endian token from the binary code.
+* @param context decompression context
+* @param token where to store the value read
+* @param bytes number of bytes per token (0 for varint tokens)
+* @param fp source file
+* @return 1 if a full token was read, 0 otherwise
+*/
+static int read_token(TDecompressContext *context, unsigned int *token,
+                                                          int bytes, FILE *fp){
+  unsigned char *input = NULL;
+
+  if (bytes == 0) {
+    if (!read_varint(context, token, fp)) {
+      return 0;
+    }
+    context->stats.tokens++;
+    return 1;
+  }
+
+  if (!input_fill(context, bytes, fp)) {
+    return 0;
+  }
+
+  input = context->input + context->input_pos;
+  switch (bytes) {
+    case 1:
+    *token = input[0];
+    break;
+
+    case 2:
+    *token = input[0] | (input[1] << 8);
+    break;
+
+    case 3:
+    *token = input[0] | (input[1] << 8) | (input[2] << 16);
+    break;
+
+    default:
+    *token = input[0] | (input[1] << 8) | (input[2] << 16) |
+                                              ((unsigned int)input[3] << 24);
+  }
+  context->input_pos += bytes;
+  context->stats.tokens++;
+
+  return 1;
+}
+
+/**
+* Write the part of decoded text that falls in the range being extracted.
+* For a line range, the bytes where it starts and ends are found here by
+* counting newlines.
+* @param context decompression context
+* @param text decoded text, starting at output_size
+* @param length
+* @return 0 or -1 if the write failed
+*/
+static int output_range(TDecompressContext *context, const char *text,
+                                                                size_t length){
+  unsigned long long position = context->output_size;
+  unsigned long long from, to;
+  const char *next = text, *newline = NULL;
+
+  context->output_size += length;
+
+  while (context->range_lines && context->range_end == ULLONG_MAX &&
+           (newline = memchr(next, '\n', text + length - next)) != NULL) {
+    next = newline + 1;
+    context->output_lines++;
+    if (context->output_lines == context->range_first) {
+      context->range_start = position + (next - text);
+    }
+    if (context->output_lines == context->range_last + 1) {
+      context->range_end = position + (next - text);
+    }
+  }
+
+  from = context->range_start > position ? context->range_start : position;
+  to = context->range_end < context->output_size ? context->range_end :
+                                                        context->output_size;
+  if (from >= to) {
+    return 0;
+  }
+
+  return fwrite(text + (from - position), 1, to - from, context->fpFinal) ==
+                                                      to - from ? 0 : -1;
+}
+
+/**
+* Write decoded text to the final file, adding it to the checksum of the
+* output when the file has one. Without a final file (--test) the text is only
+* checksummed.
+* @param context decompression context
+* @param text
+* @param length
+* @return 0 or -1 if the write failed
+*/
+static int output_write(TDecompressContext *context, const char *text,
+                                                                size_t length){
+  size_t written;
+  double start = 0;
+
+  if (context->range) {
+    return output_range(context, text, length);
+  }
+  if (context->blocks) {
+    context->output_crc = crc32c(context->output_crc, text, length);
+  }
+  context->output_size += length;
+  if (context->fpFinal == NULL) {
+    return 0;
+  }
+
+  if (stats_enabled) {
+    start = stats_now();
+  }
+  written = fwrite(text, 1, length, context->fpFinal);
+  if (stats_enabled) {
+    context->stats.time_io += stats_now() - start;
+  }
+
+  return written == length ? 0 : -1;
+}
+
+/**
+* Write the decoded output buffer to the final file.
+* @param context decompression context
+* @return 0 or -1 if the write failed
+*/
+static int output_flush(TDecompressContext *context){
+  if (context->output_used == 0) {
+    return 0;
+  }
+
+  if (output_write(context, context->output, context->output_used) != 0) {
+    return -1;
+  }
+  context->output_used = 0;
+
+  return 0;
+}
+
+/**
+* Append a dictionary element to the decoded output.
+* @param context decompression context
+* @param element element to append
+* @return 0 or -1 if the write failed
+*/
+static int output_append(TDecompressContext *context, TElement *element){
+  /* Elements wanted instead of text (--test, --grep) */
+  if (context->sink != NULL) {
+    return context->sink(context, element, 1);
+  }
+
+  if (context->output_used + element->length > DECOMPRESS_OUTPUT_BUFFER) {
+    if (output_flush(context) != 0) {
+      return -1;
+    }
+
+    /* Element bigger than the whole buffer */
+    if (element->length > DECOMPRESS_OUTPUT_BUFFER) {
+      return output_write(context, element->element, element->length);
+    }
+  }
+
+  memcpy(context->output + context->output_used, element->element,
+                                                             element->length);
+  context->output_used += element->length;
+
+  return 0;
+}
+
+/**
+* Append an element repeated count times to the decoded output. Single byte
+* elements (separators) are expanded with memset(), longer ones by copying
+* the already expanded part onto the rest, doubling it each time.
+* @param context decompression context
+* @param element element to repeat
+* @param count number of repetitions
+* @return 0 or -1 if the write failed
+*/
+static int output_repeat(TDecompressContext *context, TElement *element,
+                                                          unsigned int count){
+  size_t length = element->length, total, done, chunk;
+  unsigned int n;
+  char *destination = NULL;
+
+  if (context->sink != NULL) {
+    return context->sink(context, element, count);
+  }
+
+  while (count > 0) {
+    if (DECOMPRESS_OUTPUT_BUFFER - context->output_used < length) {
+      if (output_flush(context) != 0) {
+        return -1;
+      }
+      if (length > DECOMPRESS_OUTPUT_BUFFER) {
+        if (output_append(context, element) != 0) {
+          return -1;
+        }
+        count--;
+        continue;
+      }
+    }
+
+    /* Whole copies that fit in the buffer */
+    n = (DECOMPRESS_OUTPUT_BUFFER - context->output_used) / length;
+    if (n > count) {
+      n = count;
+    }
+    total = n * length;
+    destination = context->output + context->output_used;
+
+    if (length == 1) {
+      memset(destination, element->element[0], total);
+    } else {
+      memcpy(destination, element->element, length);
+      for (done = length; done < total; done += chunk) {
+        chunk = done < total - done ? done : total - done;
+        memcpy(destination + done, destination, chunk);
+      }
+    }
+
+    context->output_used += total;
+    count -= n;
+  }
+
+  return 0;
+}
+
+/**
+* Use the separator set of a file.
+* @param context decompression context
+* @param header file header
+* @return 0 or ERR_PALZCORRUPTED if the set is not valid
+*/
+static int use_separators(TDecompressContext *context, TPalzHeader *header){
+  TSeparators *set = &context->separators;
+  int i;
+
+  if (separators_init(set, header->separators, header->nseparators) != 0) {
+    return ERR_PALZCORRUPTED;
+  }
+  for (i = 0; i < set->count; i++) {
+    context->separator_elements[i].nElement = i + 1;
+    context->separator_elements[i].length = 1;
+    context->separator_elements[i].element = &set->chars[i];
+  }
+
+  return 0;
+}
+
+/**
+* Get the dictionary element of a token ID (separators come first). The
+* element number is the token ID.
+* @param context decompression context
+* @param id token ID, already checked against the dictionary size
+* @param element where to describe a word
+* @return separator element or element, filled with the word
+*/
+TElement *get_element(TDecompressContext *context, unsigned int id,
+                                                          TElement *element){
+  TDictionary *words = context->words;
+  unsigned int index = id - context->separators.count - 1;
+
+  if (id <= (unsigned int)context->separators.count) {
+    return &context->separator_elements[id-1];
+  }
+  element->nElement = id;
+  element->element = words->text + words->offset[index];
+  element->length = words->offset[index+1] - words->offset[index];
+
+  return element;
+}
+
+/**
+* Record count decoded copies of a token ID. Only the last history_size IDs
+* can be referenced, so longer runs write just those.
+* @param context decompression context
+* @param id token ID
+* @param count number of copies
+*/
+static void history_run(TDecompressContext *context, unsigned int id,
+                                                          unsigned int count){
+  unsigned int mask = context->history_size - 1;
+  unsigned long long position = context->history_count;
+  unsigned int n = count < context->history_size ? count :
+                                                       context->history_size;
+
+  context->history_count += count;
+  for (position = context->history_count - n;
+                      position < context->history_count; position++) {
+    context->history[position & mask] = id;
+  }
+}
+
+/**
+* Decode a format 2 copy of the length tokens starting distance tokens back.
+* Short sequences repeated several times are expanded as a whole with
+* output_repeat(), anything else (and everything for a sink) token by token.
+* @param context decompression context
+* @param distance how far back the copy starts, already validated
+* @param length number of tokens to copy
+* @return 0 or -1 if the write failed
+*/
+static int decode_copy(TDecompressContext *context, unsigned int distance,
+                                                         unsigned int length){
+  unsigned int period[DECOMPRESS_MAX_PERIOD];
+  unsigned int mask = context->history_size - 1;
+  unsigned int i, repeats;
+  size_t size = 0;
+  TElement sequence, word;
+  TElement *element = NULL;
+
+  if (context->sink == NULL && distance <= DECOMPRESS_MAX_PERIOD &&
+                                                     length >= 2*distance) {
+    for (i = 0; i < distance; i++) {
+      period[i] = context->history[(context->history_count - distance + i)
+                                                                      & mask];
+      size += get_element(context, period[i], &word)->length;
+    }
+    if (size > context->sequence_size) {
+      context->sequence_size = size;
+      context->sequence = realloc(context->sequence, size);
+    }
+    for (i = 0, size = 0; i < distance; i++) {
+      element = get_element(context, period[i], &word);
+      memcpy(context->sequence + size, element->element, element->length);
+      size += element->length;
+    }
+    sequence.element = context->sequence;
+    sequence.length = size;
+
+    repeats = length / distance;
+    if (output_repeat(context, &sequence, repeats) != 0) {
+      return -1;
+    }
+    for (i = 0; i < length % distance; i++) {
+      if (output_append(context, get_element(context, period[i], &word))
+                                                                      != 0) {
+        return -1;
+      }
+    }
+
+    /* The history continues the period */
+    i = length > context->history_size ? length - context->history_size : 0;
+    for (; i < length; i++) {
+      context->history[(context->history_count + i) & mask] =
+                                                       period[i % distance];
+    }
+    context->history_count += length;
+
+    return 0;
+  }
+
+  for (i = 0; i < length; i++) {
+    period[0] = context->history[(context->history_count - distance) & mask];
+    context->history[context->history_count++ & mask] = period[0];
+    if (output_append(context, get_element(context, period[0], &word)) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+* Add a segment to a parallel decode, starting in the data block being read.
+* @param split
+* @param code binary code offset
+* @param text text offset
+* @return segment, with no tokens to refer to
+*/
+static TDecodeSegment *split_add(TDecodeSplit *split, unsigned long long code,
+                                                     unsigned long long text){
+  TDecodeSegment *segment = NULL;
+
+  if (split->used == split->size) {
+    split->size = split->size ? split->size * 2 : 64;
+    split->segments = realloc(split->segments,
+                                      split->size * sizeof(TDecodeSegment));
+  }
+  segment = &split->segments[split->used++];
+  segment->code = code;
+  segment->text = text;
+  segment->block = split->block;
+  segment->block_code = split->block_code;
+  segment->last = 0;
+  segment->history = NULL;
+  segment->history_count = 0;
+
+  return segment;
+}
+
+/**
+* Start a segment of a parallel decode at the next token, with what a thread
+* needs to decode from there: where the token is and the tokens it can
+* refer to.
+* @param context decompression context of the first pass
+* @param last format 1: last token ID decoded, 0 for none
+*/
+static void split_mark(TDecompressContext *context, unsigned int last){
+  TDecodeSplit *split = context->split;
+  TDecodeSegment *segment = NULL;
+  unsigned long long code = context->input_total -
+                                  (context->input_end - context->input_pos);
+  unsigned int mask = context->history_size - 1;
+  unsigned int i, n;
+
+  split->next = context->output_size + split->step;
+  if (context->blocks && code < split->block_code) {
+    return;
+  }
+
+  segment = split_add(split, code, context->output_size);
+  segment->last = last;
+  if (context->history_count > 0) {
+    n = context->history_count < context->history_size ?
+                           context->history_count : context->history_size;
+    segment->history = MALLOC(sizeof(unsigned int) * n);
+    for (i = 0; i < n; i++) {
+      segment->history[i] = context->history[(context->history_count - n + i)
+                                                                      & mask];
+    }
+    segment->history_count = n;
+  }
+}
+
+/**
+* Decode format 1 binary code: token IDs where ID 0 and a count repeat the
+* last element.
+* @param context decompression context
+* @param header file header
+* @param fp source file positioned after the header
+* @return 0 or an error code
+*/
+static int decode_format1(TDecompressContext *context, TPalzHeader *header,
+                                                                    FILE *fp){
+  TElement *last_element = NULL;
+  TElement last_word;
+  unsigned int elementN = 0;
+  unsigned int max = header->words + header->nseparators;
+
+  /* A segment of a parallel decode may start with a repetition */
+  if (context->segment != NULL && context->segment->last != 0) {
+    last_element = get_element(context, context->segment->last, &last_word);
+  }
+
+  while (1) {
+    if (context->split != NULL &&
+                           context->output_size >= context->split->next) {
+      split_mark(context, last_element ? last_element->nElement : 0);
+    }
+    if (!read_token(context, &elementN, header->width, fp)) {
+      break;
+    }
+
+    /**
+    * Check if number read from binary code is greater than dictionary entries.
+    */
+    if (elementN > max) {
+      return ERR_PALZCORRUPTED;
+    }
+
+    /* Check for repetition */
+    if (elementN == 0) {
+
+      /**
+      * We can't start with a repetition. So in this case,
+      * we verify if last_element exists to validate the repetition.
+      * Check how many times the last_element must be repeated, it can't be
+      * repeated zero times.
+      */
+      if (last_element == NULL ||
+                        !read_token(context, &elementN, header->width, fp) ||
+                                                             elementN == 0) {
+        return ERR_PALZCORRUPTED;
+      }
+      context->stats.repetitions++;
+
+      /* Repeat for elementN times */
+      if (output_repeat(context, last_element, elementN) != 0) {
+        return ERR_FOPEN;
+      }
+    } else {
+      last_element = get_element(context, elementN, &last_word);
+      if (output_append(context, last_element) != 0) {
+        return ERR_FOPEN;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+* Decode format 2 binary code: token IDs where ID 0 is followed by a varint
+* count that repeats the last token, or by a zero count and the varint pair
+* (distance, length) of a copy of earlier tokens.
+* @param context decompression context
+* @param header file header
+* @param fp source file positioned after the header
+* @return 0 or an error code
+*/
+static int decode_format2(TDecompressContext *context, TPalzHeader *header,
+                                                                    FILE *fp){
+  TElement *element = NULL;
+  TElement word;
+  unsigned int elementN = 0;
+  unsigned int count, distance, length, size;
+
+  /* History sized to the next power of two of the window */
+  for (size = 1; size < (unsigned int)header->window; size *= 2);
+  if (size > context->history_size) {
+    FREE(context->history);
+    context->history = MALLOC(sizeof(unsigned int)*size);
+    context->history_size = size;
+  }
+  if (context->segment != NULL && context->segment->history_count > 0) {
+    memcpy(context->history, context->segment->history,
+                        sizeof(unsigned int) * context->segment->history_count);
+    context->history_count = context->segment->history_count;
+  }
+
+  while (1) {
+    if (context->split != NULL &&
+                           context->output_size >= context->split->next) {
+      split_mark(context, 0);
+    }
+    if (!read_token(context, &elementN, header->width, fp)) {
+      break;
+    }
+    /* Word blocks can add words along the way */
+    if (elementN > (unsigned int)(context->words->nElements +
+                                                 context->separators.count)) {
+      return ERR_PALZCORRUPTED;
+    }
+
+    if (elementN != 0) {
+      element = get_element(context, elementN, &word);
+      if (output_append(context, element) != 0) {
+        return ERR_FOPEN;
+      }
+      context->history[context->history_count++ &
+                                    (context->history_size - 1)] = elementN;
+      continue;
+    }
+
+    if (!read_varint(context, &count, fp)) {
+      return ERR_PALZCORRUPTED;
+    }
+    context->stats.repetitions++;
+
+    /* Repeat the last token */
+    if (count != 0) {
+      if (context->history_count == 0) {
+        return ERR_PALZCORRUPTED;
+      }
+      elementN = context->history[(context->history_count - 1) &
+                                                (context->history_size - 1)];
+      element = get_element(context, elementN, &word);
+      if (output_repeat(context, element, count) != 0) {
+        return ERR_FOPEN;
+      }
+      history_run(context, elementN, count);
+      continue;
+    }
+
+    /* Copy earlier tokens */
+    if (!read_varint(context, &distance, fp) ||
+                              !read_varint(context, &length, fp) ||
+                              distance == 0 || length == 0 ||
+                              distance > (unsigned int)header->window ||
+                              distance > context->history_count) {
+      return ERR_PALZCORRUPTED;
+    }
+    if (decode_copy(context, distance, length) != 0) {
+      return ERR_FOPEN;
+    }
+  }
+
+  return 0;
+}
+
+/**
+* Read a .palz header: magic line, fields or dictionary size and the
+* dictionary, which is stored in the context.
+* @param context decompression context (already reset)
+* @param fp source file at its start
+* @param header header to fill
+* @return 0 or an error code
+*/
+static int read_header(TDecompressContext *context, FILE *fp,
+                                                         TPalzHeader *header){
+  TDictionary *dictWords = context->words;
+  char *line = NULL;
+  int val = 0;
+  int nbytes = 0;
+  int error = 0;
+
+  /* Get first line */
+  if (getline(&context->line, &context->line_len, fp) == -1) {
+    return ERR_PALZCORRUPTED;
+  }
+
+  if ((header->version = is_header_PALZ(context->line)) == 0) {
+    return ERR_PALZEXTENSION;
+  }
+
+  /* Get second line */
+  if (getline(&context->line, &context->line_len, fp) == -1) {
+    return ERR_PALZCORRUPTED;
+  }
+
+  if (header->version == PALZ_STORED) {
+    if ((error = parse_stored_fields(context->line, header)) != 0) {
+      return error;
+    }
+  } else if (header->version == 1) {
+    if ((header->words = is_valid_size(context->line)) == -1) {
+      return ERR_PALZCORRUPTED;
+    }
+    header->nseparators = strlen(PALZ_SEPARATORS);
+    memcpy(header->separators, PALZ_SEPARATORS, header->nseparators);
+    header->width = bytes_for_int(header->words + header->nseparators);
+    header->window = 0;
+    header->checksums = 0;
+    header->index = 0;
+  } else if ((error = parse_header_fields(context->line, header)) != 0) {
+    return error;
+  }
+
+  if (header->version == 1 && header->width > 3) {
+    return ERR_PALZBIGDICTIONARY;
+  }
+  context->blocks = header->version == 2 && header->checksums;
+  if ((error = use_separators(context, header)) != 0) {
+    return error;
+  }
+  val = header->words;
+
+  while (val != 0) {
+    if ((nbytes = getline(&context->line, &context->line_len, fp)) <= 0) {
+      return ERR_PALZCORRUPTED;
+    }
+    line = context->line;
+    line[nbytes-1] = '\0';
+    dictionary_add_element(&dictWords, &line, nbytes);
+    val--;
+  }
+
+  return 0;
+}
+
+/**
+* Hand the text of a stored file to the context sink, split into the
+* separators and words of the file, or number the words not seen yet.
+* Without numbered words (--test) the text is handed as one element.
+* @param context decompression context
+* @param text text read, with room for one more byte
+* @param length bytes in text
+* @param last the text ends the file; otherwise a word at its end is left
+* for the next call
+* @param add number the words (decompress_stored_words()) instead
+* @return bytes left at the end of text, or -1 for a word never numbered
+*/
+static long stored_tokens(TDecompressContext *context, char *text,
+                                       size_t length, int last, int add){
+  const unsigned char *ids = context->separators.ids;
+  TElement element;
+  size_t i = 0, word, end = length;
+  char *name = NULL;
+  char saved;
+  int *id = NULL;
+
+  if (!add && context->stored_words == NULL) {
+    element.nElement = 0;
+    element.length = length;
+    element.element = text;
+    context->sink(context, &element, 1);
+    return 0;
+  }
+
+  /* A word longer than the whole buffer is cut */
+  while (!last && end > 0 && !ids[(unsigned char)text[end-1]]) {
+    end--;
+  }
+  if (end == 0) {
+    end = length;
+  }
+
+  while (i < end) {
+    if (ids[(unsigned char)text[i]]) {
+      for (word = i++; i < end && text[i] == text[word]; i++);
+      if (!add) {
+        context->sink(context, &context->separator_elements[
+                          ids[(unsigned char)text[word]] - 1], i - word);
+      }
+      continue;
+    }
+    for (word = i; i < end && !ids[(unsigned char)text[i]]; i++);
+    saved = text[i];
+    text[i] = '\0';
+    id = tabela_consultar(context->stored_words, text + word);
+    if (add && id == NULL) {
+      name = text + word;
+      dictionary_add_element(&context->words, &name, i - word + 1);
+      id = arena_alloc(context->arena, sizeof(int));
+      *id = context->separators.count + context->words->nElements;
+      tabela_inserir(context->stored_words, text + word, id);
+    } else if (!add && id == NULL) {
+      return -1;
+    } else if (!add) {
+      context->sink(context, get_element(context, *id, &element), 1);
+    }
+    text[i] = saved;
+  }
+
+  return length - end;
+}
+
+/**
+* Read the text of a stored file, checked against its size and CRC-32C, and
+* write it (or hand it to the sink).
+* @param context decompression context
+* @param header file header
+* @param fp source file positioned after the header
+* @param add number the words of the text instead (stored_tokens())
+* @return 0 or an error code
+*/
+static int decode_stored(TDecompressContext *context, TPalzHeader *header,
+                                                           FILE *fp, int add){
+  unsigned long long left = header->size;
+  unsigned int crc = 0;
+  size_t carry = 0, n;
+  long rest;
+
+  /* A member of an archive holds the whole text */
+  if (left > context->input_left) {
+    return ERR_PALZCORRUPTED;
+  }
+
+  while (left > 0) {
+    /* A range extraction stops once the range is written */
+    if (context->range && context->output_size >= context->range_end) {
+      context->range_done = 1;
+      return 0;
+    }
+    n = DECOMPRESS_OUTPUT_BUFFER - 1 - carry;
+    if (n > left) {
+      n = left;
+    }
+    if (fread(context->output + carry, 1, n, fp) != n) {
+      return ERR_PALZCORRUPTED;
+    }
+    left -= n;
+    if (header->checksums) {
+      crc = crc32c(crc, context->output + carry, n);
+    }
+
+    if (context->sink == NULL && !add) {
+      if (output_write(context, context->output, n) != 0) {
+        return ERR_FOPEN;
+      }
+      continue;
+    }
+    if ((rest = stored_tokens(context, context->output, carry + n, left == 0,
+                                                                 add)) < 0) {
+      return ERR_PALZCORRUPTED;
+    }
+    memmove(context->output, context->output + carry + n - rest, rest);
+    carry = rest;
+  }
+
+  /* A range may start after the start of the text */
+  if (header->checksums && !context->range && crc != header->crc) {
+    return ERR_PALZCORRUPTED;
+  }
+
+  return 0;
+}
+
+/**
+* Copy the text of a stored file to the final file in the kernel. Files with
+* a CRC-32C are read by decode_stored() instead, to check it.
+* @param context decompression context, with an unbuffered fpFinal
+* @param header file header
+* @param fp source file positioned after the header
+* @return 0 or an error code
+* @see file_copy()
+*/
+static int copy_stored(TDecompressContext *context, TPalzHeader *header,
+                                                                    FILE *fp){
+  off_t offset = ftello(fp);
+  long long copied;
+
+  if (offset < 0 || fflush(context->fpFinal) != 0 ||
+      (copied = file_copy(fileno(fp), &offset, fileno(context->fpFinal),
+                                                      header->size)) < 0) {
+    return ERR_FOPEN;
+  }
+  if ((unsigned long long)copied != header->size) {
+    return ERR_PALZCORRUPTED;
+  }
+  context->output_size = copied;
+
+  return 0;
+}
+
+/**
+* Number the words of a stored file opened with decompress_open(), as a
+* dictionary would, so --grep can look the query up in it. The file is left
+* where it was.
+* @param context decompression context
+* @param header file header
+* @param fp source file positioned at the text
+* @return 0 or an error code
+*/
+int decompress_stored_words(TDecompressContext *context, TPalzHeader *header,
+                                                                    FILE *fp){
+  long start = ftell(fp);
+  int error;
+
+  if (start < 0) {
+    return ERR_FOPEN;
+  }
+  context->stored_words = tabela_criar(DECOMPRESS_TABLE_SIZE, NULL);
+  tabela_usar_arena(context->stored_words, context->arena);
+  if ((error = decode_stored(context, header, fp, 1)) != 0) {
+    return error;
+  }
+
+  return fseek(fp, start, SEEK_SET) == 0 ? 0 : ERR_FOPEN;
+}
+
+/**
+* Decode the binary code after the header and flush the decoded text. Files
+* with checksums must end with a valid end block that matches the text.
+* @param context decompression context, fpFinal NULL to discard the text
+* @param header file header
+* @param fp source file positioned after the header
+* @return 0 or an error code
+*/
+static int decode_body(TDecompressContext *context, TPalzHeader *header,
+                                                                    FILE *fp){
+  int error;
+
+  if (header->version == PALZ_STORED) {
+    error = decode_stored(context, header, fp, 0);
+  } else if (header->version == 1) {
+    error = decode_format1(context, header, fp);
+  } else {
+    error = decode_format2(context, header, fp);
+  }
+
+  /* A range extraction may stop in the middle of a token */
+  if (context->range_done && error == ERR_PALZCORRUPTED &&
+                                                   !context->input_error) {
+    error = 0;
+  }
+
+  /* A bad block, or a missing end block, stops the decode early */
+  if (!error && context->blocks && (context->input_error ||
+                                                   !context->input_done)) {
+    error = ERR_PALZCORRUPTED;
+  }
+  if (!error && output_flush(context) != 0) {
+    error = ERR_FOPEN;
+  }
+  if (!error && context->blocks && !context->range && context->sink == NULL &&
+                         (context->output_size != context->trailer_size ||
+                          context->output_crc != context->trailer_crc)) {
+    error = ERR_PALZCORRUPTED;
+  }
+
+  return error;
+}
+
+/**
+* Decompress the .palz image of size bytes at the current position of a
+* stream (a member of an archive) to an open file.
+* @param context decompression context
+* @param fp source stream, positioned at the .palz image
+* @param size size of the image
+* @param fpOutput where to write the text
+* @return 0 or an error code
+*/
+int decompress_stream(TDecompressContext *context, FILE *fp,
+                                     unsigned long long size, FILE *fpOutput){
+  TPalzHeader header;
+  long start, code;
+  int error;
+
+  decompress_context_reset(context);
+
+  if ((start = ftell(fp)) < 0) {
+    return ERR_FOPEN;
+  }
+  if ((error = read_header(context, fp, &header)) != 0) {
+    return error;
+  }
+  if ((code = ftell(fp)) < start || (unsigned long long)(code-start) > size) {
+    return ERR_PALZCORRUPTED;
+  }
+  context->input_left = size - (code - start);
+
+  context->fpFinal = fpOutput;
+  error = decode_body(context, &header, fp);
+  context->fpFinal = NULL;
+
+  return error;
+}
+
+/**
+* Sink that only counts the text size, for files tested without checksums.
+* @param context decompression context
+* @param element element decoded
+* @param count number of repetitions
+* @return 0
+*/
+static int discard_sink(TDecompressContext *context, TElement *element,
+                                                          unsigned int count){
+  context->output_size += (unsigned long long)element->length * count;
+
+  return 0;
+}
+
+/* Work shared by the threads of a parallel decode */
+typedef struct split_job{
+  TDecompressContext *context;
+  TPalzHeader *header;
+  TDecodeSplit *split;
+  const char *source_filename;
+  const char *output_filename;
+  /* offset of the binary code in the source */
+  long code;
+  /* next segment to decode and first error */
+  int taken;
+  int error;
+  pthread_mutex_t mutex;
+}TSplitJob;
+
+/**
+* Decode one segment of a parallel decode and write its text in place.
+* @param context decompression context of the thread
+* @param job
+* @param i segment
+* @param fp source file
+* @param out final file
+* @return 0 or an error code
+*/
+static int split_decode(TDecompressContext *context, TSplitJob *job, int i,
+                                                        FILE *fp, FILE *out){
+  TDecodeSegment *segment = &job->split->segments[i];
+  unsigned long long end = i + 1 < job->split->used ?
+                                 job->split->segments[i+1].code : ULLONG_MAX;
+  unsigned long long skip = 0;
+  int error;
+
+  context->input_pos = 0;
+  context->input_end = 0;
+  context->input_done = 0;
+  context->input_error = 0;
+  context->output_used = 0;
+  context->output_size = 0;
+  context->output_crc = 0;
+  context->history_count = 0;
+
+  /* From the data block holding the segment, or straight from its code */
+  if (context->blocks) {
+    skip = segment->code - segment->block_code;
+    context->input_left = end == ULLONG_MAX ? end : end - segment->block_code;
+    error = fseeko(fp, segment->block, SEEK_SET);
+  } else {
+    context->input_left = end == ULLONG_MAX ? end : end - segment->code;
+    error = fseeko(fp, job->code + segment->code, SEEK_SET);
+  }
+  if (error != 0 || (skip > 0 && !input_fill(context, skip, fp))) {
+    return ERR_PALZCORRUPTED;
+  }
+  context->input_pos = skip;
+  if (fseeko(out, segment->text, SEEK_SET) != 0) {
+    return ERR_FOPEN;
+  }
+
+  context->fpFinal = out;
+  context->segment = segment;
+  if (job->header->version == 1) {
+    error = decode_format1(context, job->header, fp);
+  } else {
+    error = decode_format2(context, job->header, fp);
+  }
+  if (!error && context->input_error) {
+    error = ERR_PALZCORRUPTED;
+  }
+  if (!error && output_flush(context) != 0) {
+    error = ERR_FOPEN;
+  }
+  context->segment = NULL;
+  context->fpFinal = NULL;
+  segment->size = context->output_size;
+  segment->crc = context->output_crc;
+
+  return error;
+}
+
+/**
+* Thread of a parallel decode: decode segments until there are none left or
+* another thread failed. The thread has its own context and files, and shares
+* the dictionary of the first pass, which is only read.
+* @param arg split job
+* @return NULL
+*/
+static void *split_worker(void *arg){
+  TSplitJob *job = arg;
+  TDecompressContext *context = decompress_context_create();
+  TDictionary *words = context->words;
+  FILE *fp = fopen(job->source_filename, "r");
+  FILE *out = fopen(job->output_filename, "r+");
+  int i, error = 0;
+
+  if (fp == NULL || out == NULL) {
+    error = ERR_FOPEN;
+  } else {
+    setvbuf(fp, context->source_buffer, _IOFBF, DECOMPRESS_IO_BUFFER);
+    setvbuf(out, NULL, _IONBF, 0);
+    error = use_separators(context, job->header);
+  }
+  context->words = job->context->words;
+  context->blocks = job->context->blocks;
+
+  while (!error && !got_signal) {
+    pthread_mutex_lock(&job->mutex);
+    i = job->error ? job->split->used : job->taken++;
+    pthread_mutex_unlock(&job->mutex);
+    if (i >= job->split->used) {
+      break;
+    }
+    error = split_decode(context, job, i, fp, out);
+  }
+
+  if (out != NULL && fclose(out) != 0 && !error) {
+    error = ERR_FOPEN;
+  }
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  if (error) {
+    pthread_mutex_lock(&job->mutex);
+    if (!job->error) {
+      job->error = error;
+    }
+    pthread_mutex_unlock(&job->mutex);
+  }
+  context->words = words;
+  decompress_context_free(&context);
+
+  return NULL;
+}
+
+/**
+* Find the segments of a parallel decode in the seek index instead of a first
+* pass: restart points don't refer to earlier tokens, and the index has their
+* text offsets. The block headers give their binary code offsets. All the
+* words and the end block are read too.
+* @param context decompression context
+* @param split split with the data block of the first segment
+* @param fp source file positioned after the header
+* @return 0 or ERR_PALZCORRUPTED
+*/
+static int split_index(TDecompressContext *context, TDecodeSplit *split,
+                                                                   FILE *fp){
+  unsigned char header[PALZ_BLOCK_HEADER];
+  unsigned long long code = 0, length;
+  long offset;
+  int i = 0;
+
+  if (decompress_blocks(context, fp, ULLONG_MAX) != 0 ||
+                                              index_read(context, fp) != 0 ||
+                                  fseek(fp, split->block, SEEK_SET) != 0) {
+    return ERR_PALZCORRUPTED;
+  }
+
+  split_add(split, 0, 0);
+  split->next = split->step;
+  while ((offset = ftell(fp)) >= 0 &&
+                             (unsigned long long)offset < context->code_end) {
+    if (fread(header, 1, PALZ_BLOCK_HEADER, fp) != PALZ_BLOCK_HEADER) {
+      return ERR_PALZCORRUPTED;
+    }
+    length = le_load(header + 1, 4);
+    for (; header[0] == PALZ_BLOCK_DATA && i < context->index_used &&
+           context->index[i].block_offset == (unsigned long long)offset; i++) {
+      if (context->index[i].text_offset >= split->next) {
+        split->block = offset;
+        split->block_code = code;
+        split_add(split, code, context->index[i].text_offset);
+        split->next = context->index[i].text_offset + split->step;
+      }
+    }
+    if (header[0] == PALZ_BLOCK_DATA) {
+      code += length;
+    }
+    if (fseek(fp, length + 4, SEEK_CUR) != 0) {
+      return ERR_PALZCORRUPTED;
+    }
+  }
+
+  /* Every restart point must be the start of a data block */
+  if (offset < 0 || i != context->index_used) {
+    return ERR_PALZCORRUPTED;
+  }
+  context->output_size = context->trailer_size;
+
+  return 0;
+}
+
+/**
+* Run the threads of a parallel decode until every segment is written.
+* @param job split job without its thread state
+* @return 0 or the first error of a thread
+*/
+static int split_run(TSplitJob *job){
+  pthread_t *tids = NULL;
+  int i, nthreads;
+
+  job->taken = 0;
+  job->error = 0;
+  if ((errno = pthread_mutex_init(&job->mutex, NULL)) != 0) {
+    ERROR(C_ERRO_MUTEX_INIT, "pthread_mutex_init() failed!");
+  }
+
+  nthreads = decompress_threads < job->split->used ? decompress_threads :
+                                                          job->split->used;
+  tids = MALLOC(sizeof(pthread_t) * nthreads);
+  for (i = 0; i < nthreads; i++) {
+    if ((errno = pthread_create(&tids[i], NULL, split_worker, job)) != 0) {
+      ERROR(C_ERRO_PTHREAD_CREATE, "pthread_create() failed!");
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    if ((errno = pthread_join(tids[i], NULL)) != 0) {
+      ERROR(C_ERRO_PTHREAD_JOIN, "pthread_join() failed!");
+    }
+  }
+  FREE(tids);
+  if ((errno = pthread_mutex_destroy(&job->mutex)) != 0) {
+    ERROR(C_ERRO_MUTEX_DESTROY, "pthread_mutex_destroy() failed!");
+  }
+
+  /* An interrupted decode leaves segments out */
+  return job->error == 0 && got_signal ? ERR_FOPEN : job->error;
+}
+
+/**
+* Decode the binary code in two passes. The first one only adds up the
+* length of every token, repetition and copy, marking a segment every few
+* megabytes of text with the code offset and the tokens it can refer to, so
+* the text size and the offset of every segment in it are known (files with
+* a seek index have them in the index). The final
+* file is then given its size and decompress_threads threads decode the
+* segments, each writing its own range of the file. The text checksum is
+* combined from the checksums of the segments.
+* @param context decompression context, fpFinal open
+* @param header file header
+* @param fp source file positioned after the header
+* @param source_filename
+* @param output_filename file open as fpFinal
+* @return 0 or an error code
+*/
+static int decode_parallel(TDecompressContext *context, TPalzHeader *header,
+                           FILE *fp, const char *source_filename,
+                           const char *output_filename){
+  TDecodeSplit split;
+  TSplitJob job;
+  unsigned long long text = 0;
+  unsigned int crc = 0, size;
+  int i, error = 0;
+
+  /* Format 2 segments keep a window of token IDs, 1/16 of their text */
+  for (size = 1; size < (unsigned int)header->window; size *= 2);
+  split.segments = NULL;
+  split.used = 0;
+  split.size = 0;
+  split.step = DECOMPRESS_SEGMENT_SIZE;
+  if (header->version == 2 &&
+                        16ULL * sizeof(unsigned int) * size > split.step) {
+    split.step = 16ULL * sizeof(unsigned int) * size;
+  }
+  split.next = 0;
+  if ((job.code = ftell(fp)) < 0) {
+    return ERR_FOPEN;
+  }
+  split.block = job.code;
+  split.block_code = 0;
+
+  if (header->index != 0) {
+    error = split_index(context, &split, fp);
+  } else {
+    /* The serial first pass costs most of the decode */
+    fprintf(stderr, "%s: no seek index (--index), most of the decode is "
+                                                "serial\n", source_filename);
+    context->split = &split;
+    context->sink = discard_sink;
+    error = decode_body(context, header, fp);
+    context->split = NULL;
+    context->sink = NULL;
+  }
+  if (!error && context->blocks &&
+                              context->output_size != context->trailer_size) {
+    error = ERR_PALZCORRUPTED;
+  }
+
+  /* Room for the whole text, so the threads only write into it */
+  if (!error && context->output_size > 0 &&
+      posix_fallocate(fileno(context->fpFinal), 0, context->output_size) != 0
+      && ftruncate(fileno(context->fpFinal), context->output_size) != 0) {
+    error = ERR_FOPEN;
+  }
+
+  if (!error && split.used > 0) {
+    job.context = context;
+    job.header = header;
+    job.split = &split;
+    job.source_filename = source_filename;
+    job.output_filename = output_filename;
+    error = split_run(&job);
+  }
+
+  /* Every segment must end where the next one starts */
+  for (i = 0; !error && i < split.used; i++) {
+    text += split.segments[i].size;
+    if (text != (i + 1 < split.used ? split.segments[i+1].text :
+                                                     context->output_size)) {
+      error = ERR_PALZCORRUPTED;
+    }
+    crc = crc32c_combine(crc, split.segments[i].crc, split.segments[i].size);
+  }
+  if (!error && context->blocks && crc != context->trailer_crc) {
+    error = ERR_PALZCORRUPTED;
+  }
+
+  for (i = 0; i < split.used; i++) {
+    FREE(split.segments[i].history);
+  }
+  free(split.segments);
+
+  return error;
+}
 
 /**
-* Decompress a given palz file.
+* Decompress a given palz file. The decoded text is written straight to the
+* final file (the source name without .palz) through the context output
+* buffer.
+* @param context decompression context
 * @param source_filename
-* @param dictionary
 * @return compress ratio
 * @see compress_ratio()
 */
-float decompress_file(TDictionary **dictionary, char *source_filename){
-  TDictionary *aux = NULL;
-  aux = *dictionary;
-  size_t len = 0;
+float decompress_file(TDecompressContext *context, char *source_filename){
+  TDictionary *dictWords = context->words;
+  TStats *stats = &context->stats;
+  TPalzHeader header;
   char *final_filename = NULL;
-  char *line = NULL;
-  char *element = NULL;
-  int read;
-  int val = 0;
-  int nbytes = 0;
-  int bytesForInt = 0;
-  unsigned int last_element = 0;
+  char *output_filename = NULL;
+  int fd = -1;
+  int error = 0;
   float source_file_size = 0;
   float final_file_size = 0;
-  FILE *fpTempFile = NULL;
+  struct stat st;
   FILE *fpSourceFile = NULL;
-  FILE *fpFinalFile = NULL;
+  double start, phase;
 
-  TDictionary *dictWords = NULL;
-  dictWords = MALLOC(sizeof(TDictionary));
-  dictWords->nElements = 0;
+  decompress_context_reset(context);
+  start = stats_now();
 
   /* Open .palz file */
   if ((fpSourceFile = fopen(source_filename, "r")) == NULL) {
     return ERR_FOPEN;
   }
+  setvbuf(fpSourceFile, context->source_buffer, _IOFBF, DECOMPRESS_IO_BUFFER);
 
-  /* Get first line */
-  if (getline(&line, &len, fpSourceFile) == -1) {
-    return ERR_PALZCORRUPTED;
+  if (fstat(fileno(fpSourceFile), &st) != 0) {
+    fclose(fpSourceFile);
+    return ERR_FSTATUS;
   }
+  source_file_size = st.st_size;
 
-  if (!is_header_PALZ(line)) {
-    return ERR_PALZEXTENSION;
+  phase = stats_now();
+  stats->time_io = phase - start;
+
+  if ((error = read_header(context, fpSourceFile, &header)) != 0) {
+    fclose(fpSourceFile);
+    return error;
   }
 
-  /* Get second line */
-  if (getline(&line, &len, fpSourceFile) == -1) {
-    return ERR_PALZCORRUPTED;
+  /**
+  * The decoded text is written under a partial name and renamed at the end.
+  * Without a .palz extension it replaces the source, so that name is a
+  * temporary file in the same directory.
+  */
+  final_filename = MALLOC(strlen(source_filename) + 8);
+  strcpy(final_filename, source_filename);
+  if (is_dot_palz(final_filename)) {
+    remove_dot_palz(final_filename);
+    output_filename = partial_filename(final_filename);
+    context->fpFinal = fopen(output_filename, "w");
+  } else {
+    output_filename = MALLOC(strlen(source_filename) + 8);
+    sprintf(output_filename, "%s.XXXXXX", source_filename);
+    if ((fd = mkstemp(output_filename)) != -1) {
+      context->fpFinal = fdopen(fd, "w");
+    }
   }
 
-  if ((val = is_valid_size(line)) == -1) {
-    return ERR_PALZCORRUPTED;
+  if (context->fpFinal == NULL) {
+    fclose(fpSourceFile);
+    if (output_filename != final_filename) {
+      FREE(output_filename);
+    }
+    FREE(final_filename);
+    return ERR_FOPEN;
   }
+  setvbuf(context->fpFinal, NULL, _IONBF, 0);
 
-  if (bytes_for_int(val+14) == -1) {
-    return ERR_PALZBIGDICTIONARY;
+  stats->time_header = stats_now() - phase;
+  phase = stats_now();
+
+  /* A stored text is copied by the kernel, unless its CRC-32C is checked */
+  if (header.version == PALZ_STORED && !header.checksums) {
+    error = copy_stored(context, &header, fpSourceFile);
+  } else if (decompress_threads > 1 && header.version != PALZ_STORED) {
+    error = decode_parallel(context, &header, fpSourceFile, source_filename,
+                                                             output_filename);
+  } else {
+    error = decode_body(context, &header, fpSourceFile);
   }
 
-  while (val != 0) {
-    nbytes = getline(&line, &len, fpSourceFile);
-    if ((element = malloc(sizeof(char)*nbytes)) == NULL) {
-      return ERR_PALZCORRUPTED;
-    }
-    strncpy(element, line, nbytes-1);
-    element[nbytes-1] = '\0';
-    dictionary_add_element(&dictWords, &element, nbytes);
-    FREE(element);
-    val--;
+  stats->time_decode = stats_now() - phase;
+  phase = stats_now();
+
+  fclose(fpSourceFile);
+  if (fclose(context->fpFinal) != 0 && !error) {
+    error = ERR_FOPEN;
   }
-  FREE(line);
+  context->fpFinal = NULL;
 
-  bytesForInt = bytes_for_int(dictWords->nElements + 14);
-  unsigned char elementN[bytesForInt];
+  if (!error && output_filename != final_filename &&
+                                 rename(output_filename, final_filename) != 0) {
+    error = ERR_FOPEN;
+  }
 
-  fpTempFile = tmpfile();
+  /* Never leave a partially decoded file behind */
+  if (error) {
+    unlink(output_filename);
+  }
+  if (output_filename != final_filename) {
+    FREE(output_filename);
+  }
+  if (error) {
+    FREE(final_filename);
+    return error;
+  }
 
-  while (!feof(fpSourceFile)) {
-    while (fread(&elementN, 1, bytesForInt, fpSourceFile)) {
+  if ((final_file_size = get_size(final_filename))==-1) {
+    FREE(final_filename);
+    return ERR_FSTATUS;
+  }
 
-      /**
-      * Check if number read from binary code is greater than dictionary entries
-      * or less than zero.
-      */
-      if (*(int *)elementN > (dictWords->nElements + 14) ||
-                                                         *(int *)elementN < 0) {
-        return ERR_PALZCORRUPTED;
-      }
+  stats->time_io += stats_now() - phase;
+  stats->time_total = stats_now() - start;
+  stats->distinct_words = dictWords->nElements;
+  stats->id_width = header.width;
+  stats->bytes_read = source_file_size;
+  stats->bytes_written = final_file_size;
 
-      /* Check for repetition */
-      if (*(int *)elementN == 0) {
+  if (stats_enabled) {
+    stats_print(stats, "decompress", final_filename);
+  }
 
-        /**
-        * We can't start with a repetition. So in this case,
-        * we verify if last_element exists to validate the repetition.
-        */
-        if (last_element == 0) {
-          return ERR_PALZCORRUPTED;
-        }
+  fprintf(stderr,"Compression ratio: %s ", final_filename);
+  FREE(final_filename);
 
-        /* Check how many times the last_element must be repeated */
-        if (fread(&elementN, 1, bytesForInt, fpSourceFile)
-                                                 != (unsigned int)bytesForInt) {
-          return ERR_PALZCORRUPTED;
-        }
+  return compress_ratio(source_file_size, final_file_size);
+}
 
-        /* last_element can't be repeated zero or less times */
-        if(*(int *)elementN <= 0) {
-          return ERR_PALZCORRUPTED;
-        }
+/**
+* Open a .palz file and read its header into the context.
+* @param context decompression context, reset here
+* @param source_filename
+* @param header header to fill
+* @param fp where to store the file, positioned at the binary code
+* @return 0 or an error code (the file is closed then)
+*/
+int decompress_open(TDecompressContext *context, const char *source_filename,
+                                               TPalzHeader *header, FILE **fp){
+  int error;
 
-        /* Repeat for elementN times */
-        while(*(int *)elementN != 0) {
-          if(last_element < 15){
-            fputs(aux->element[last_element-1].element, fpTempFile);
-          }else{
-            fputs(dictWords->element[last_element-15].element, fpTempFile);
-          }
-          *(int *)elementN -= 1;
-        }
-      }else{
-        if(*(int *)elementN < 15){
-          fputs(aux->element[*(int *)elementN-1].element, fpTempFile);
-        }else{
-          fputs(dictWords->element[*(int *)elementN - 15].element, fpTempFile);
-        }
-        last_element = *(int *)elementN;
+  decompress_context_reset(context);
+
+  if ((*fp = fopen(source_filename, "r")) == NULL) {
+    return ERR_FOPEN;
+  }
+  setvbuf(*fp, context->source_buffer, _IOFBF, DECOMPRESS_IO_BUFFER);
+
+  if ((error = read_header(context, *fp, header)) != 0) {
+    fclose(*fp);
+    *fp = NULL;
+  }
+
+  return error;
+}
+
+/**
+* Decode the binary code of a file opened with decompress_open(), handing
+* the elements to the context sink instead of writing text. Block checksums
+* are verified, the text checksum is not.
+* @param context decompression context with sink set
+* @param header file header
+* @param fp source file positioned at the binary code
+* @return 0 or an error code
+*/
+int decompress_scan(TDecompressContext *context, TPalzHeader *header,
+                                                                    FILE *fp){
+  context->fpFinal = NULL;
+
+  return decode_body(context, header, fp);
+}
+
+/**
+* Check a .palz file without writing anything: the header is parsed, every
+* token ID, count and copy is validated while decoding to a null sink and,
+* when the file has them, block and text checksums are verified.
+* @param context decompression context
+* @param source_filename
+* @return 0 or an error code
+*/
+int test_file(TDecompressContext *context, const char *source_filename){
+  TStats *stats = &context->stats;
+  TPalzHeader header;
+  FILE *fpSourceFile = NULL;
+  struct stat st;
+  int error = 0;
+  double start, phase;
+
+  start = stats_now();
+
+  if ((error = decompress_open(context, source_filename, &header,
+                                                        &fpSourceFile)) != 0) {
+    return error;
+  }
+  if (fstat(fileno(fpSourceFile), &st) != 0) {
+    fclose(fpSourceFile);
+    return ERR_FSTATUS;
+  }
+  phase = stats_now();
+  stats->time_header = phase - start;
+
+  /* Without checksums the text itself is not needed */
+  context->fpFinal = NULL;
+  if (!context->blocks) {
+    context->sink = discard_sink;
+  }
+  error = decode_body(context, &header, fpSourceFile);
+  stats->time_decode = stats_now() - phase;
+  fclose(fpSourceFile);
+
+  if (error) {
+    return error;
+  }
+
+  stats->time_total = stats_now() - start;
+  stats->distinct_words = context->words->nElements;
+  stats->id_width = header.width;
+  stats->bytes_read = st.st_size;
+  stats->bytes_written = context->output_size;
+
+  if (stats_enabled) {
+    stats_print(stats, "test", source_filename);
+  }
+
+  return 0;
+}
+
+/**
+* Walk the blocks of a checksummed file from the current position up to
+* offset end, or to its end block. Word blocks add their words and the end
+* block is read; data and index blocks are skipped without being read.
+* @param context decompression context
+* @param fp source file positioned at a block
+* @param end offset to stop at
+* @return 0 or ERR_PALZCORRUPTED
+*/
+int decompress_blocks(TDecompressContext *context, FILE *fp,
+                                                    unsigned long long end){
+  unsigned char *payload = context->input;
+  unsigned char header[PALZ_BLOCK_HEADER];
+  size_t length;
+  long offset;
+  int type, error;
+
+  context->code_end = 0;
+  while ((offset = ftell(fp)) >= 0 && (unsigned long long)offset < end) {
+    if (fread(header, 1, PALZ_BLOCK_HEADER, fp) != PALZ_BLOCK_HEADER) {
+      return ERR_PALZCORRUPTED;
+    }
+    if (header[0] == PALZ_BLOCK_DATA || header[0] == PALZ_BLOCK_INDEX) {
+      if (header[0] == PALZ_BLOCK_INDEX && context->code_end == 0) {
+        context->code_end = offset;
+      }
+      if (fseek(fp, le_load(header + 1, 4) + 4, SEEK_CUR) != 0) {
+        return ERR_PALZCORRUPTED;
+      }
+      continue;
+    }
+
+    if (fseek(fp, offset, SEEK_SET) != 0 ||
+          block_read(fp, &type, payload, PALZ_BLOCK_SIZE, &length) != 0) {
+      return ERR_PALZCORRUPTED;
+    }
+    if (type == PALZ_BLOCK_WORDS) {
+      if ((error = words_read(context, payload, length)) != 0) {
+        return error;
       }
+    } else if (type == PALZ_BLOCK_END) {
+      if (context->code_end == 0) {
+        context->code_end = offset;
+      }
+      return trailer_read(context, payload, length);
+    } else {
+      return ERR_PALZCORRUPTED;
     }
   }
 
-  fclose(fpSourceFile);
+  return offset < 0 ? ERR_PALZCORRUPTED : 0;
+}
 
-  int i;
-  for(i = 0; i< dictWords->nElements; i++){
-    FREE(dictWords->element[i].element);
+/**
+* Read the seek index of a file, located through its end block.
+* @param context decompression context
+* @param fp source file
+* @return 0 or ERR_PALZCORRUPTED
+*/
+int index_read(TDecompressContext *context, FILE *fp){
+  unsigned char *payload = context->input;
+  unsigned long long previous = 0;
+  TIndexEntry *entry = NULL;
+  size_t length, i;
+  int type;
+
+  if (fseek(fp, -(PALZ_BLOCK_HEADER + PALZ_INDEX_TRAILER_SIZE + 4),
+                                                           SEEK_END) != 0 ||
+          block_read(fp, &type, payload, PALZ_BLOCK_SIZE, &length) != 0 ||
+          type != PALZ_BLOCK_END || length != PALZ_INDEX_TRAILER_SIZE ||
+          trailer_read(context, payload, length) != 0) {
+    return ERR_PALZCORRUPTED;
   }
 
-  FREE(dictWords->element);
-  FREE(dictWords);
+  if (fseek(fp, context->trailer_index, SEEK_SET) != 0) {
+    return ERR_PALZCORRUPTED;
+  }
+  context->index_used = 0;
+  while (1) {
+    if (block_read(fp, &type, payload, PALZ_BLOCK_SIZE, &length) != 0) {
+      return ERR_PALZCORRUPTED;
+    }
+    if (type == PALZ_BLOCK_END) {
+      break;
+    }
+    if (type != PALZ_BLOCK_INDEX || length % PALZ_INDEX_ENTRY_SIZE != 0) {
+      return ERR_PALZCORRUPTED;
+    }
 
-  if ((source_file_size = get_size(source_filename))==-1) {
-    return ERR_FSTATUS;
+    for (i = 0; i < length; i += PALZ_INDEX_ENTRY_SIZE) {
+      if (context->index_used == context->index_size) {
+        context->index_size = context->index_size ? context->index_size*2 : 64;
+        context->index = realloc(context->index,
+                                      context->index_size*sizeof(TIndexEntry));
+      }
+      entry = &context->index[context->index_used++];
+      entry->block_offset = le_load(payload + i, 8);
+      entry->text_offset = le_load(payload + i + 8, 8);
+      entry->line = le_load(payload + i + 16, 8);
+
+      /* Restart points come in text order */
+      if (entry->text_offset < previous ||
+                                   entry->text_offset > context->trailer_size) {
+        return ERR_PALZCORRUPTED;
+      }
+      previous = entry->text_offset;
+    }
   }
-  /*
-  * Sets the file position indicator for the stream
-  * pointed to by stream to the beginning of the file.
-  */
-  rewind(fpTempFile);
 
-  if (is_dot_palz(source_filename)) {
-    final_filename = remove_dot_palz(source_filename);
-  } else {
-    final_filename = source_filename;
+  return 0;
+}
+
+/**
+* Decompress only a range of bytes or lines of a .palz file. With a seek index
+* decoding starts at the last restart point before the range, otherwise at the
+* beginning, and it stops once the range is written.
+* @param context decompression context
+* @param source_filename
+* @param lines 1 for a range of lines, 0 for bytes
+* @param first first byte or line, from 1 (negative counts from the end)
+* @param last last byte or line, included (negative counts from the end)
+* @param out where to write the range
+* @return 0, ERR_PALZUNSUPPORTED for a range from the end of a file without
+* index, or another error code
+*/
+int decompress_range(TDecompressContext *context, const char *source_filename,
+                     int lines, long long first, long long last, FILE *out){
+  TPalzHeader header;
+  TIndexEntry start;
+  FILE *fpSourceFile = NULL;
+  long long total = -1;
+  unsigned long long code;
+  int error = 0;
+  int i;
+
+  if ((error = decompress_open(context, source_filename, &header,
+                                                        &fpSourceFile)) != 0) {
+    return error;
+  }
+  start.block_offset = ftell(fpSourceFile);
+  start.text_offset = 0;
+  start.line = 0;
+  code = start.block_offset;
+
+  if (header.index != 0) {
+    if ((error = index_read(context, fpSourceFile)) != 0) {
+      fclose(fpSourceFile);
+      return error;
+    }
+    total = lines ? context->trailer_lines : context->trailer_size;
+  } else if (header.version == PALZ_STORED && !lines) {
+    total = header.size;
   }
 
-  fpFinalFile = fopen(final_filename, "w");
+  /* From 1-based, maybe negative, to 0-based positions */
+  if ((first < 0 || last < 0) && total < 0) {
+    fclose(fpSourceFile);
+    return ERR_PALZUNSUPPORTED;
+  }
+  first = first < 0 ? total + first : first - 1;
+  last = last < 0 ? total + last : last - 1;
+  if (first < 0) {
+    first = 0;
+  }
+  if (total >= 0 && last >= total) {
+    last = total - 1;
+  }
+  if (last < first) {
+    fclose(fpSourceFile);
+    return 0;
+  }
 
-  /* Copy data from tmpfile to destination file */
-  while((read = fgetc(fpTempFile)) != EOF) {
-    fputc(read, fpFinalFile);
+  /* A byte range of a stored text is read from where it starts */
+  if (header.version == PALZ_STORED && !lines) {
+    start.block_offset = code + first;
+    start.text_offset = first;
+    header.size -= first;
   }
 
-  fclose(fpTempFile);
-  fclose(fpFinalFile);
+  /* Last restart point before the range */
+  for (i = 0; i < context->index_used; i++) {
+    if (lines ? context->index[i].line >= (unsigned long long)first &&
+                                   context->index[i].text_offset > 0 :
+                  context->index[i].text_offset > (unsigned long long)first) {
+      break;
+    }
+    start = context->index[i];
+  }
 
-  if ((final_file_size = get_size(final_filename))==-1) {
-    return ERR_FSTATUS;
+  context->range = 1;
+  context->range_lines = lines;
+  context->range_first = first;
+  context->range_last = last;
+  if (lines) {
+    context->range_start = first == 0 ? 0 : ULLONG_MAX;
+    context->range_end = ULLONG_MAX;
+  } else {
+    context->range_start = first;
+    context->range_end = last + 1;
+  }
+  context->output_size = start.text_offset;
+  context->output_lines = start.line;
+
+  /* Words added by --append before the restart point */
+  if (context->blocks && start.block_offset > code &&
+      (fseek(fpSourceFile, code, SEEK_SET) != 0 ||
+      (error = decompress_blocks(context, fpSourceFile, start.block_offset)))) {
+    fclose(fpSourceFile);
+    return ERR_PALZCORRUPTED;
+  }
+  if (fseek(fpSourceFile, start.block_offset, SEEK_SET) != 0) {
+    fclose(fpSourceFile);
+    return ERR_PALZCORRUPTED;
   }
+  context->fpFinal = out;
+  error = decode_body(context, &header, fpSourceFile);
+  context->fpFinal = NULL;
+  fclose(fpSourceFile);
 
-  fprintf(stderr,"Compression ratio: %s ", final_filename);
+  if (!error && fflush(out) != 0) {
+    error = ERR_FOPEN;
+  }
 
-  return compress_ratio(source_file_size, final_file_size);
+  return error;
 }
 
 /**
-* Check if header_first_row contains "PALZ\n".
+* Check if header_first_row contains "PALZ\n", "PALZ2\n" or "PALZS\n".
 * @param header_first_row first row of file
-* @return 1 if true, 0 if false
+* @return format version (1, 2 or PALZ_STORED), 0 if it is not a palz header
 */
 int is_header_PALZ(const char *header_first_row){
   if (strcmp(header_first_row,MAGIC_PALZ) == 0) {
     return 1;
   }
+  if (strcmp(header_first_row,MAGIC_PALZ2) == 0) {
+    return 2;
+  }
+  if (strcmp(header_first_row,MAGIC_PALZ_STORED) == 0) {
+    return PALZ_STORED;
+  }
+  return 0;
+}
+
+/**
+* Decode a field value written as hexadecimal digit pairs.
+* @param hex value, ends at a space or the end of the line
+* @param output where to store the bytes (up to 256)
+* @param count where to store the number of bytes
+* @return end of the value or NULL if it is not valid
+*/
+static const char *parse_hex(const char *hex, char *output, int *count){
+  static const char digits[] = "0123456789abcdef";
+  const char *high, *low;
+
+  *count = 0;
+  while (*hex != ' ' && *hex != '\n' && *hex != '\0') {
+    if (*count == 256 || hex[1] == '\0' ||
+                          (high = strchr(digits, hex[0])) == NULL ||
+                          (low = strchr(digits, hex[1])) == NULL) {
+      return NULL;
+    }
+    output[(*count)++] = (high - digits) << 4 | (low - digits);
+    hex += 2;
+  }
+
+  return hex;
+}
+
+/**
+* Parse the second row of a format 2 header, a list of key=value fields
+* separated by spaces. "words" is required, the others ("width", 1 to 4 bytes
+* or 0 for varint IDs, "window", "separators", the separator characters in
+* hexadecimal, "check=crc32c" for checksummed blocks and "index", the tokens
+* between restart points of the seek index) default to the values format 1
+* implies.
+* @param fields second row of file
+* @param header header to fill (version already set)
+* @return 0, ERR_PALZCORRUPTED or ERR_PALZUNSUPPORTED for unknown fields
+*/
+int parse_header_fields(const char *fields, TPalzHeader *header){
+  const char *field = fields;
+  char *end = NULL;
+  size_t length;
+  long value;
+  int bytes;
+
+  header->words = -1;
+  header->width = -1;
+  header->window = 0;
+  header->checksums = 0;
+  header->index = 0;
+  header->nseparators = strlen(PALZ_SEPARATORS);
+  memcpy(header->separators, PALZ_SEPARATORS, header->nseparators);
+
+  while (*field != '\0' && *field != '\n') {
+    if (*field == ' ') {
+      field++;
+      continue;
+    }
+    if ((end = strchr(field, '=')) == NULL) {
+      return ERR_PALZCORRUPTED;
+    }
+    length = end - field;
+
+    if (length == 5 && strncmp(field, "check", 5) == 0) {
+      if (strncmp(end + 1, "crc32c", 6) != 0 ||
+                               (end[7] != ' ' && end[7] != '\n' && end[7] != '\0')) {
+        return ERR_PALZUNSUPPORTED;
+      }
+      header->checksums = 1;
+      field = end + 7;
+      continue;
+    }
+
+    if (length == 10 && strncmp(field, "separators", 10) == 0) {
+      if ((field = parse_hex(end + 1, header->separators,
+                                             &header->nseparators)) == NULL) {
+        return ERR_PALZCORRUPTED;
+      }
+      continue;
+    }
+
+    errno = 0;
+    value = strtol(end + 1, &end, 10);
+    if (errno != 0 || value < 0 || value > INT_MAX ||
+                        (*end != ' ' && *end != '\n' && *end != '\0')) {
+      return ERR_PALZCORRUPTED;
+    }
+
+    if (length == 5 && strncmp(field, "words", 5) == 0) {
+      header->words = value;
+    } else if (length == 5 && strncmp(field, "width", 5) == 0) {
+      header->width = value;
+    } else if (length == 6 && strncmp(field, "window", 6) == 0) {
+      header->window = value;
+    } else if (length == 5 && strncmp(field, "index", 5) == 0) {
+      header->index = value;
+    } else {
+      return ERR_PALZUNSUPPORTED;
+    }
+    field = end;
+  }
+
+  if (header->words < 0) {
+    return ERR_PALZCORRUPTED;
+  }
+  /* A width of 0 means varint token IDs */
+  bytes = bytes_for_int(header->words + header->nseparators);
+  if (header->width == -1) {
+    header->width = bytes;
+  }
+  if ((header->width != 0 && header->width < bytes) || header->width > 4) {
+    return ERR_PALZUNSUPPORTED;
+  }
+  if (header->window > PALZ_MAX_WINDOW) {
+    return ERR_PALZUNSUPPORTED;
+  }
+  /* The seek index is stored in checksummed blocks */
+  if (header->index != 0 && !header->checksums) {
+    return ERR_PALZCORRUPTED;
+  }
+
   return 0;
 }
 
+/**
+* Parse the fields of a stored file header: size, crc32c and separators.
+* @param fields second line of the header
+* @param header header to fill
+* @return 0 or an error code
+*/
+int parse_stored_fields(const char *fields, TPalzHeader *header){
+  const char *field = fields;
+  char *end = NULL;
+
+  header->words = 0;
+  header->width = 0;
+  header->window = 0;
+  header->checksums = 0;
+  header->index = 0;
+  header->size = ULLONG_MAX;
+  header->crc = 0;
+  header->nseparators = strlen(PALZ_SEPARATORS);
+  memcpy(header->separators, PALZ_SEPARATORS, header->nseparators);
+
+  while (*field != '\0' && *field != '\n') {
+    if (*field == ' ') {
+      field++;
+      continue;
+    }
+    errno = 0;
+    if (strncmp(field, "size=", 5) == 0 && isdigit((unsigned char)field[5])) {
+      header->size = strtoull(field + 5, &end, 10);
+    } else if (strncmp(field, "crc32c=", 7) == 0 &&
+                                      isxdigit((unsigned char)field[7])) {
+      header->crc = strtoul(field + 7, &end, 16);
+      header->checksums = 1;
+    } else if (strncmp(field, "separators=", 11) == 0) {
+      if ((end = (char *)parse_hex(field + 11, header->separators,
+                                           &header->nseparators)) == NULL) {
+        return ERR_PALZCORRUPTED;
+      }
+    } else {
+      return ERR_PALZUNSUPPORTED;
+    }
+    if (errno != 0 || (*end != ' ' && *end != '\n' && *end != '\0')) {
+      return ERR_PALZCORRUPTED;
+    }
+    field = end;
+  }
+
+  return header->size == ULLONG_MAX ? ERR_PALZCORRUPTED : 0;
+}
+
 /**
 * Check if a given string is a valid integer. Based on strtol page from manual.
 * @param size_str second row of file
@@ -224,14 +2244,12 @@ int is_valid_size(const char *size_str){
 /**
 * Search for palz files in a given folder and sub-folders. For every palz file
 * found, call decompress_file() function.
+* @param context decompression context
 * @param directory main directory where to start
-* @param dictionary
 * @return 0 at end
 * @see decompress_file()
 */
-int decompress_folder(TDictionary **dictionary, const char *directory){
-  TDictionary *aux = NULL;
-  aux = *dictionary;
+int decompress_folder(TDecompressContext *context, const char *directory){
   DIR *dir = NULL;
   struct dirent *dirent = NULL;
   char *nextDirent = NULL;
@@ -258,12 +2276,11 @@ int decompress_folder(TDictionary **dictionary, const char *directory){
 
       strcat(nextDirent, "/");
 
-      decompress_folder(&aux, nextDirent);
+      decompress_folder(context, nextDirent);
       /* DT_REG = regular file */
     } else if (dirent->d_type == DT_REG) {
       if (is_dot_palz(dirent->d_name)) {
-        dictionary_restart(&aux);
-        if ((output = decompress_file(&aux, nextDirent)) < 0) {
+        if ((output = decompress_file(context, nextDirent)) < 0) {
           get_error_msg(output, nextDirent);
         } else {
           fprintf(stderr,"%.2f %%\n", output);
@@ -278,16 +2295,17 @@ int decompress_folder(TDictionary **dictionary, const char *directory){
 }
 
 /**
-* Search for .palz files in a given folder and sub-folders. For every .palz file
-* found, call decompress_file() function using threads. Each file must be
-* decompressed by one thread only.
+* Search for .palz files in a given folder and sub-folders and hand them to
+* max_threads threads, each file to one thread only.
 * @param directory main directory where to start
 * @param max_threads maximum number of threads
-* @return 0 at end
-* @see decompress_file()
+* @param mode DECOMPRESS_MODE, TEST_MODE or GREP_MODE
+* @param matched where to store the number of lines found (GREP_MODE), or NULL
+* @return number of files that failed the test or search
+* @see consumer()
 */
-int parallel_folder_decompress(TDictionary **dictionary, char *directory,
-                                                               int max_threads){
+static int parallel_folder_run(char *directory, int max_threads, int mode,
+                                                               int *matched){
   char **files_to_decompress = NULL;
   int amount = 0;
   float output = 0;
@@ -313,8 +2331,25 @@ int parallel_folder_decompress(TDictionary **dictionary, char *directory,
   param.total = 0;
   param.stop = 0;
   param.max = max_threads;
-  param.mode = DECOMPRESS_MODE;
-  param.dictionary = dictionary;
+  param.mode = mode;
+  param.failed = 0;
+  param.matched = 0;
+  param.manifest = NULL;
+  param.archive = NULL;
+  param.io = NULL;
+  param.progress = NULL;
+  param.journal = NULL;
+
+  /* --journal: files finished by an interrupted run are skipped, and the
+  outputs are written by the workers so they are complete when journaled */
+  if (mode == DECOMPRESS_MODE && journal_enabled) {
+    param.journal = journal_open(directory, "decompress");
+  }
+
+  /* Only decompression writes files worth doing in the background */
+  if (mode == DECOMPRESS_MODE && param.journal == NULL) {
+    param.io = asyncio_create(asyncio_backend);
+  }
 
   int i;
 
@@ -335,8 +2370,17 @@ int parallel_folder_decompress(TDictionary **dictionary, char *directory,
     get_error_msg(output, NULL);
   }
 
-  /* Give all files to compress to write on buffer */
+  /* Give all files to compress to write on buffer, read ahead when they
+  are decompressed */
   for(i = 0; i<amount; i++){
+    if (param.journal != NULL &&
+                    journal_finished(param.journal, files_to_decompress[i])) {
+      FREE(files_to_decompress[i]);
+      continue;
+    }
+    if (param.io != NULL) {
+      asyncio_read(param.io, files_to_decompress[i]);
+    }
     write_on_buffer(files_to_decompress[i], &param);
     FREE(files_to_decompress[i]);
   }
@@ -386,7 +2430,63 @@ int parallel_folder_decompress(TDictionary **dictionary, char *directory,
   }
   FREE(param.buffer);
 
-  return 0;
+  /* Wait for the files still being written */
+  if (param.io != NULL) {
+    param.failed += asyncio_free(&param.io);
+  }
+
+  /* The journal of an interrupted job is kept for the next run */
+  if (param.journal != NULL) {
+    if (param.journal->resumed > 0) {
+      fprintf(stderr, "%d files done by an earlier run\n",
+                                                      param.journal->resumed);
+    }
+    journal_close(&param.journal, !got_signal);
+  }
+
+  if (matched != NULL) {
+    *matched = param.matched;
+  }
+
+  return param.failed;
+}
+
+/**
+* Search for .palz files in a given folder and sub-folders. For every .palz file
+* found, call decompress_file() function using threads. Each file must be
+* decompressed by one thread only.
+* @param directory main directory where to start
+* @param max_threads maximum number of threads
+* @return number of outputs written in the background that failed
+* @see decompress_file()
+*/
+int parallel_folder_decompress(char *directory, int max_threads){
+  return parallel_folder_run(directory, max_threads, DECOMPRESS_MODE, NULL);
+}
+
+/**
+* Test the .palz files of a folder and its sub-folders with test_file(),
+* using threads.
+* @param directory main directory where to start
+* @param max_threads maximum number of threads
+* @return number of files that failed the test
+* @see test_file()
+*/
+int parallel_folder_test(char *directory, int max_threads){
+  return parallel_folder_run(directory, max_threads, TEST_MODE, NULL);
+}
+
+/**
+* Search the .palz files of a folder and its sub-folders for the --grep query
+* with grep_file(), using threads.
+* @param directory main directory where to start
+* @param max_threads maximum number of threads
+* @param matched where to store the number of lines found
+* @return number of files that could not be searched
+* @see grep_file()
+*/
+int parallel_folder_grep(char *directory, int max_threads, int *matched){
+  return parallel_folder_run(directory, max_threads, GREP_MODE, matched);
 }
 
 /**
@@ -9,12 +9,179 @@
 #define __DECOMPRESS_H__
 
 #include "common.h"
+#include "crc32c.h"
+#include "hashtables.h"
+
+#define DECOMPRESS_IO_BUFFER            65536
+#define DECOMPRESS_OUTPUT_BUFFER        1048576
+/* Longest token sequence copied with output_repeat() instead of per token */
+#define DECOMPRESS_MAX_PERIOD           64
+/* Initial size of the word table of a stored file searched by --grep */
+#define DECOMPRESS_TABLE_SIZE           1024
+/* Text bytes per segment of a parallel decode (--decode-threads) */
+#define DECOMPRESS_SEGMENT_SIZE         (4 << 20)
+
+/* Fields of a .palz header */
+typedef struct palz_header{
+  /* format version (1 or 2, PALZ_STORED for stored files) */
+  int version;
+  /* number of words in the dictionary */
+  int words;
+  /* bytes per token ID, 0 for varints */
+  int width;
+  /* tokens a format 2 copy can reach back */
+  int window;
+  /* binary code in checksummed blocks */
+  int checksums;
+  /* tokens between restart points of the seek index, 0 without index */
+  int index;
+  /* separators, in token ID order */
+  int nseparators;
+  char separators[256];
+  /* stored files: size of the text and its CRC-32C (checksums) */
+  unsigned long long size;
+  unsigned int crc;
+}TPalzHeader;
+
+/* Part of the binary code decoded by one thread of a parallel decode */
+typedef struct decode_segment{
+  /* offsets in the binary code (header and block framing left out) and in
+  the text */
+  unsigned long long code;
+  unsigned long long text;
+  /* checksummed blocks: data block holding the code, and the code offset
+  where its payload starts */
+  unsigned long long block;
+  unsigned long long block_code;
+  /* format 1: token a repetition at the start repeats, 0 for none */
+  unsigned int last;
+  /* format 2: last token IDs, the ones copies at the start can reach */
+  unsigned int *history;
+  unsigned int history_count;
+  /* size and CRC-32C of the text decoded by the thread */
+  unsigned long long size;
+  unsigned int crc;
+}TDecodeSegment;
+
+/* Segments found by the first pass of a parallel decode */
+typedef struct decode_split{
+  TDecodeSegment *segments;
+  int used;
+  int size;
+  /* text bytes between segments and text offset of the next one */
+  unsigned long long step;
+  unsigned long long next;
+  /* data block being decoded and the code offset of its payload */
+  unsigned long long block;
+  unsigned long long block_code;
+}TDecodeSplit;
+
+/* Per-thread decompression state, kept between files */
+typedef struct decompress_context{
+  /* separators of the current file (IDs 1 to separators.count) */
+  TSeparators separators;
+  TElement separator_elements[256];
+  /* words read from the .palz header */
+  TDictionary *words;
+  /* getline() buffer */
+  char *line;
+  size_t line_len;
+  /* stdio buffer for the header */
+  char *source_buffer;
+  /* binary code read ahead */
+  unsigned char *input;
+  size_t input_pos;
+  size_t input_end;
+  /* binary code bytes left in the source (a member of an archive or a
+  segment of a parallel decode) and read so far */
+  unsigned long long input_left;
+  unsigned long long input_total;
+  /* checksummed blocks: end block read, first block error, and size and
+  CRC-32C of the original text from the end block */
+  int blocks;
+  int input_done;
+  int input_error;
+  unsigned long long trailer_size;
+  unsigned int trailer_crc;
+  unsigned long long trailer_index;
+  unsigned long long trailer_lines;
+  /* offset of the first index block or of the end block, from
+  decompress_blocks() */
+  unsigned long long code_end;
+  /* seek index read by index_read() */
+  TIndexEntry *index;
+  int index_used;
+  int index_size;
+  /* decoded text waiting to be written to fpFinal */
+  char *output;
+  size_t output_used;
+  FILE *fpFinal;
+  /* size and CRC-32C of the text written */
+  unsigned long long output_size;
+  unsigned int output_crc;
+  /* range extraction: text bytes range_start to range_end (excluded) are
+  written, for lines found while decoding by counting output_lines */
+  int range;
+  int range_lines;
+  int range_done;
+  unsigned long long range_first;
+  unsigned long long range_last;
+  unsigned long long range_start;
+  unsigned long long range_end;
+  unsigned long long output_lines;
+  /* receives the decoded elements (element number = token ID) instead of
+  the output buffer, with sink_data for its own state */
+  int (*sink)(struct decompress_context *context, TElement *element,
+                                                         unsigned int count);
+  void *sink_data;
+  /* parallel decode: segments marked by the first pass, or the segment a
+  thread decodes */
+  TDecodeSplit *split;
+  TDecodeSegment *segment;
+  /* last token IDs decoded, for format 2 copies */
+  unsigned int *history;
+  unsigned int history_size;
+  unsigned long long history_count;
+  /* text of a repeated token sequence */
+  char *sequence;
+  size_t sequence_size;
+  /* words of a stored file numbered by decompress_stored_words() (word ->
+  token ID, from the arena), NULL otherwise */
+  HASHTABLE_T *stored_words;
+  TArena *arena;
+  /* statistics of the last file */
+  TStats stats;
+}TDecompressContext;
+
+TDecompressContext *decompress_context_create(void);
+void decompress_context_reset(TDecompressContext *context);
+void decompress_context_free(TDecompressContext **context);
 
 int is_header_PALZ(const char *header_first_row);
 int is_valid_size(const char *size_str);
-int decompress_folder(TDictionary **dictionary, const char *directory);
-float decompress_file(TDictionary **dictionary, char *source_filename);
+int parse_header_fields(const char *fields, TPalzHeader *header);
+int parse_stored_fields(const char *fields, TPalzHeader *header);
+int decompress_folder(TDecompressContext *context, const char *directory);
+float decompress_file(TDecompressContext *context, char *source_filename);
+int test_file(TDecompressContext *context, const char *source_filename);
+int decompress_open(TDecompressContext *context, const char *source_filename,
+                                              TPalzHeader *header, FILE **fp);
+int decompress_scan(TDecompressContext *context, TPalzHeader *header,
+                                                                   FILE *fp);
+int decompress_stored_words(TDecompressContext *context, TPalzHeader *header,
+                                                                   FILE *fp);
+TElement *get_element(TDecompressContext *context, unsigned int id,
+                                                         TElement *element);
+int decompress_blocks(TDecompressContext *context, FILE *fp,
+                                                    unsigned long long end);
+int index_read(TDecompressContext *context, FILE *fp);
+int decompress_stream(TDecompressContext *context, FILE *fp,
+                                    unsigned long long size, FILE *fpOutput);
+int decompress_range(TDecompressContext *context, const char *source_filename,
+                     int lines, long long first, long long last, FILE *out);
 char* remove_dot_palz(const char *source_filename);
 
-int parallel_folder_decompress(TDictionary **dictionary, char *directory, int max_threads);
+int parallel_folder_decompress(char *directory, int max_threads);
+int parallel_folder_test(char *directory, int max_threads);
+int parallel_folder_grep(char *directory, int max_threads, int *matched);
 #endif
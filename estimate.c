@@ -0,0 +1,158 @@
+/**
+* @file estimate.c
+* @brief Quick estimate of how well a file compresses, from a few blocks
+* sampled across it, so folder runs can leave out the files that would not
+* shrink (--min-ratio).
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include "estimate.h"
+
+/**
+* Tokenize a sample: count the tokens written for it and add the words not
+* seen yet to the table. A word cut by the start or the end of the block is
+* left out, unless the block starts or ends the file.
+* @param estimate
+* @param separators
+* @param table words seen so far
+* @param block sample, with room for one more byte
+* @param length bytes in the block
+* @param first the block starts the file
+* @param last the block ends the file
+* @param word_bytes total length of the distinct words
+*/
+static void estimate_block(TEstimate *estimate, const TSeparators *separators,
+                           HASHTABLE_T *table, char *block, size_t length,
+                           int first, int last, unsigned long long *word_bytes){
+  const unsigned char *ids = separators->ids;
+  size_t i = 0, end = length, word;
+  char saved;
+
+  if (!first) {
+    while (i < end && !ids[(unsigned char)block[i]]) {
+      i++;
+    }
+  }
+  if (!last) {
+    while (end > i && !ids[(unsigned char)block[end-1]]) {
+      end--;
+    }
+  }
+
+  /* The text ends at a NUL: not worth compressing */
+  if (memchr(block + i, '\0', end - i) != NULL) {
+    estimate->binary = 1;
+    return;
+  }
+  estimate->sampled += end - i;
+
+  while (i < end) {
+    /* A run of the same separator is written as it, 0 and the count */
+    if (ids[(unsigned char)block[i]]) {
+      for (word = i++; i < end && block[i] == block[word]; i++);
+      estimate->tokens += i - word > 1 ? 3 : 1;
+      continue;
+    }
+    estimate->tokens++;
+    for (word = i; i < end && !ids[(unsigned char)block[i]]; i++);
+    saved = block[i];
+    block[i] = '\0';
+    if (tabela_consultar(table, block + word) == NULL) {
+      tabela_inserir(table, block + word, MALLOC(sizeof(int)));
+      estimate->distinct++;
+      *word_bytes += i - word;
+    }
+    block[i] = saved;
+    estimate->words++;
+  }
+}
+
+/**
+* Estimate the size of the .palz file of a text file (format 1, without
+* runs or matches, so it is an upper bound at higher levels). Up to
+* ESTIMATE_BLOCKS blocks spread over the file are tokenized; the
+* dictionary is extrapolated to the whole file at the rate new words were
+* still found in the second half of the samples, and every token costs the
+* ID width that dictionary needs.
+* @param path
+* @param separators
+* @param estimate filled with the samples and the result
+* @return 0 or an error code
+*/
+int estimate_file(const char *path, const TSeparators *separators,
+                                                        TEstimate *estimate){
+  HASHTABLE_T *table = NULL;
+  struct stat st;
+  char *block = NULL;
+  unsigned long long word_bytes = 0, offset, half_words = 0;
+  double scale, words, distinct;
+  int half_distinct = 0;
+  ssize_t nread;
+  size_t length;
+  int fd, b, blocks;
+
+  memset(estimate, 0, sizeof(TEstimate));
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return ERR_FOPEN;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return ERR_FSTATUS;
+  }
+  estimate->size = st.st_size;
+
+  blocks = estimate->size > ESTIMATE_BLOCKS * ESTIMATE_BLOCK_SIZE ?
+                                                            ESTIMATE_BLOCKS : 1;
+  length = blocks > 1 ? ESTIMATE_BLOCK_SIZE : estimate->size;
+  block = MALLOC(length + 1);
+  table = tabela_criar(ESTIMATE_TABLE_SIZE, free);
+
+  for (b = 0; b < blocks && !estimate->binary; b++) {
+    offset = blocks > 1 ? (estimate->size - length) / (blocks - 1) * b : 0;
+    if ((nread = pread(fd, block, length, offset)) < 0) {
+      tabela_destruir(&table);
+      FREE(block);
+      close(fd);
+      return ERR_FSTATUS;
+    }
+    estimate_block(estimate, separators, table, block, nread, offset == 0,
+                   offset + nread >= estimate->size, &word_bytes);
+    if (b == blocks / 2 - 1) {
+      half_words = estimate->words;
+      half_distinct = estimate->distinct;
+    }
+  }
+  tabela_destruir(&table);
+  FREE(block);
+  close(fd);
+
+  if (estimate->binary || estimate->sampled == 0) {
+    estimate->output = estimate->size;
+    estimate->ratio = 0;
+    return 0;
+  }
+
+  /* Words keep being new at the rate of the second half of the samples */
+  if (estimate->words > half_words) {
+    estimate->growth = (double)(estimate->distinct - half_distinct) /
+                                               (estimate->words - half_words);
+  }
+  scale = (double)estimate->size / estimate->sampled;
+  words = estimate->words * scale;
+  distinct = estimate->distinct + estimate->growth * (words - estimate->words);
+  if (distinct > words) {
+    distinct = words;
+  }
+
+  /* Dictionary (a word per line) and one ID per token */
+  estimate->output = estimate->tokens * scale *
+                     bytes_for_int((unsigned int)distinct + separators->count);
+  if (estimate->distinct > 0) {
+    estimate->output += distinct *
+                        ((double)word_bytes / estimate->distinct + 1);
+  }
+  estimate->ratio = 100 * (1 - estimate->output / estimate->size);
+
+  return 0;
+}
@@ -0,0 +1,40 @@
+/**
+* @file estimate.h
+* @brief The header file for estimate.c
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#ifndef __ESTIMATE_H__
+#define __ESTIMATE_H__
+
+#include "common.h"
+#include "hashtables.h"
+
+/* Blocks read from a file and their size; smaller files are read whole */
+#define ESTIMATE_BLOCKS                 8
+#define ESTIMATE_BLOCK_SIZE             16384
+#define ESTIMATE_TABLE_SIZE             1024
+
+/* Expected compression of a file, from samples of it */
+typedef struct estimate{
+  unsigned long long size;
+  /* bytes sampled, and tokens (words and separators) and words in them */
+  unsigned long long sampled;
+  unsigned long long tokens;
+  unsigned long long words;
+  /* distinct words, and new ones per word in the second half of the
+  samples */
+  int distinct;
+  double growth;
+  /* a NUL byte was found: not a text file */
+  int binary;
+  /* expected size of the .palz file and ratio (%) */
+  double output;
+  double ratio;
+}TEstimate;
+
+int estimate_file(const char *path, const TSeparators *separators,
+                                                        TEstimate *estimate);
+
+#endif
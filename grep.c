@@ -0,0 +1,536 @@
+/**
+* @file grep.c
+* @brief Search .palz files for words and phrases without writing their text.
+* Query words are looked up in the dictionary of each file and the token
+* stream is matched by ID; only the lines printed are turned back into text.
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include "grep.h"
+
+/* A token ID of a line and how many times it repeats */
+typedef struct grep_token{
+  unsigned int id;
+  unsigned int count;
+}TGrepToken;
+
+/* Tokens of one line of text, without its newline */
+typedef struct grep_line{
+  TGrepToken *tokens;
+  int used;
+  int size;
+  unsigned long long number;
+}TGrepLine;
+
+/* Search state of one file, the sink data of its decompression context */
+typedef struct grep_state{
+  const TGrepQuery *query;
+  const char *path;
+  FILE *out;
+  /* token IDs of query words (sorted), with the word positions each can
+  take; seen has a bit per token ID for a quick test */
+  unsigned int *ids;
+  unsigned int *positions;
+  int nids;
+  int ids_size;
+  unsigned char *seen;
+  /* first and last positions of every term, and the term ending at each */
+  unsigned int starts;
+  unsigned int ends;
+  unsigned int term_of[GREP_MAX_WORDS];
+  /* positions reached by the words just read, and terms found on the line */
+  unsigned int state;
+  unsigned int found;
+  unsigned int newline;
+  /* the line being read and the context lines before it */
+  TGrepLine *ring;
+  int ring_size;
+  int current;
+  unsigned long long number;
+  /* last line printed and lines still to print after a match */
+  unsigned long long printed;
+  int after;
+  int matches;
+}TGrepState;
+
+/* The query of --grep */
+TGrepQuery grep_query;
+
+/**
+* Parse a query: terms separated by spaces, "quoted phrases" as one term and
+* OR between clauses, so 'error disk OR "out of memory"' finds lines with
+* both error and disk, or the phrase.
+* @param text query
+* @param query where to store the terms and clauses
+* @return 0 or -1 if the query is empty or not valid
+*/
+int grep_query_parse(const char *text, TGrepQuery *query){
+  const char *end = NULL;
+  size_t length;
+
+  query->nterms = 0;
+  query->nclauses = 1;
+  query->clauses[0] = 0;
+
+  while (*text != '\0') {
+    if (isspace((unsigned char)*text)) {
+      text++;
+      continue;
+    }
+    if (*text == '"') {
+      text++;
+      if ((end = strchr(text, '"')) == NULL) {
+        return -1;
+      }
+    } else {
+      for (end = text; *end != '\0' && !isspace((unsigned char)*end); end++);
+    }
+    length = end - text;
+
+    if (*end != '"' && length == 2 && strncmp(text, "OR", 2) == 0) {
+      /* A clause needs terms and there are at most GREP_MAX_TERMS */
+      if (query->clauses[query->nclauses-1] == 0) {
+        return -1;
+      }
+      query->clauses[query->nclauses++] = 0;
+    } else {
+      if (length == 0 || query->nterms == GREP_MAX_TERMS) {
+        return -1;
+      }
+      query->terms[query->nterms] = MALLOC(length + 1);
+      memcpy(query->terms[query->nterms], text, length);
+      query->terms[query->nterms][length] = '\0';
+      query->clauses[query->nclauses-1] |= 1u << query->nterms;
+      query->nterms++;
+    }
+    text = *end == '"' ? end + 1 : end;
+  }
+
+  return query->clauses[query->nclauses-1] != 0 ? 0 : -1;
+}
+
+/**
+* Release the terms of a query.
+* @param query
+*/
+void grep_query_free(TGrepQuery *query){
+  int i;
+
+  for (i = 0; i < query->nterms; i++) {
+    FREE(query->terms[i]);
+  }
+  query->nterms = 0;
+}
+
+/**
+* Find a word in the first count words of a dictionary, sorted with strcmp().
+* @param words dictionary
+* @param count number of sorted words
+* @param word
+* @param length
+* @return index of the word or -1
+*/
+static int word_search(TDictionary *words, int count, const char *word,
+                                                               size_t length){
+  int low = 0, high = count, middle, cmp;
+  size_t size;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    size = words->offset[middle+1] - words->offset[middle];
+    cmp = memcmp(words->text + words->offset[middle], word,
+                                              size < length ? size : length);
+    if (cmp == 0) {
+      cmp = size < length ? -1 : size > length;
+    }
+    if (cmp == 0) {
+      return middle;
+    }
+    if (cmp < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return -1;
+}
+
+/**
+* Let a token ID take a word position.
+* @param grep search state
+* @param id token ID
+* @param position word position in the query
+*/
+static void id_add(TGrepState *grep, unsigned int id, int position){
+  int i;
+
+  for (i = 0; i < grep->nids && grep->ids[i] != id; i++);
+  if (i == grep->nids) {
+    if (grep->nids == grep->ids_size) {
+      grep->ids_size = grep->ids_size ? grep->ids_size * 2 : 64;
+      grep->ids = realloc(grep->ids, grep->ids_size * sizeof(unsigned int));
+      grep->positions = realloc(grep->positions,
+                                         grep->ids_size * sizeof(unsigned int));
+    }
+    grep->ids[i] = id;
+    grep->positions[i] = 0;
+    grep->nids++;
+  }
+  grep->positions[i] |= 1u << position;
+  grep->seen[id >> 3] |= 1 << (id & 7);
+}
+
+/**
+* Find the token IDs of a query word: the word itself and its composites
+* (the word and one separator other than the newline).
+* @param grep search state
+* @param context decompression context with the dictionary of the file
+* @param header file header
+* @param word
+* @param length
+* @param position word position in the query
+* @return 1 if the file has the word, 0 if not
+*/
+static int word_ids(TGrepState *grep, TDecompressContext *context,
+                    TPalzHeader *header, const char *word, size_t length,
+                                                              int position){
+  TDictionary *words = context->words;
+  TSeparators *set = &context->separators;
+  char composite[length + 1];
+  size_t size;
+  int sorted = header->width == 0 ? 0 : header->words;
+  int i, index, found = 0;
+
+  /* Varint files list the words by number of occurrences, and words added
+  by --append follow the sorted ones */
+  for (i = sorted; i < words->nElements; i++) {
+    size = words->offset[i+1] - words->offset[i];
+    if ((size == length || (size == length + 1 &&
+                set->ids[(unsigned char)words->text[words->offset[i+1]-1]]
+                && words->text[words->offset[i+1]-1] != '\n')) &&
+                memcmp(words->text + words->offset[i], word, length) == 0) {
+      id_add(grep, i + set->count + 1, position);
+      found = 1;
+    }
+  }
+  if (sorted == 0) {
+    return found;
+  }
+
+  if ((index = word_search(words, sorted, word, length)) >= 0) {
+    id_add(grep, index + set->count + 1, position);
+    found = 1;
+  }
+  memcpy(composite, word, length);
+  for (i = 0; i < set->count; i++) {
+    if (set->chars[i] == '\n') {
+      continue;
+    }
+    composite[length] = set->chars[i];
+    if ((index = word_search(words, sorted, composite, length + 1)) >= 0) {
+      id_add(grep, index + set->count + 1, position);
+      found = 1;
+    }
+  }
+
+  return found;
+}
+
+/**
+* Split the terms of the query into the words of a file (its separators
+* split them too) and find their token IDs.
+* @param grep search state
+* @param context decompression context with the header of the file read
+* @param header file header
+* @return 1 if a line of the file can match, 0 if not, ERR_PALZUNSUPPORTED
+* if the query has too many words for this file
+*/
+static int grep_prepare(TGrepState *grep, TDecompressContext *context,
+                                                         TPalzHeader *header){
+  const TGrepQuery *query = grep->query;
+  TSeparators *set = &context->separators;
+  unsigned int ids = set->count + context->words->nElements + 1;
+  unsigned int present = 0;
+  const char *word = NULL;
+  int term, position = 0, first, found, i;
+  size_t length;
+
+  grep->seen = MALLOC(ids / 8 + 1);
+  memset(grep->seen, 0, ids / 8 + 1);
+  grep->newline = set->ids['\n'];
+
+  for (term = 0; term < query->nterms; term++) {
+    first = position;
+    found = 1;
+    for (word = query->terms[term]; *word != '\0'; word += length) {
+      for (length = 0; word[length] != '\0' &&
+                           !set->ids[(unsigned char)word[length]]; length++);
+      if (length == 0) {
+        length = 1;
+        continue;
+      }
+      if (position == GREP_MAX_WORDS) {
+        return ERR_PALZUNSUPPORTED;
+      }
+      found &= word_ids(grep, context, header, word, length, position);
+      grep->term_of[position++] = term;
+    }
+    /* A term of separators only is never found */
+    if (position > first && found) {
+      grep->starts |= 1u << first;
+      grep->ends |= 1u << (position - 1);
+      present |= 1u << term;
+    }
+  }
+
+  for (i = 0; i < query->nclauses; i++) {
+    if ((query->clauses[i] & present) == query->clauses[i]) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+* Write a line with its number (and file name for folders).
+* @param grep search state
+* @param context decompression context
+* @param line
+* @param mark ':' for matches, '-' for context lines
+*/
+static void line_print(TGrepState *grep, TDecompressContext *context,
+                                                 TGrepLine *line, char mark){
+  TElement word;
+  TElement *element = NULL;
+  unsigned int j;
+  int i;
+
+  if (grep->query->show_path) {
+    fprintf(grep->out, "%s%c", grep->path, mark);
+  }
+  fprintf(grep->out, "%llu%c", line->number, mark);
+  for (i = 0; i < line->used; i++) {
+    element = get_element(context, line->tokens[i].id, &word);
+    for (j = 0; j < line->tokens[i].count; j++) {
+      fwrite(element->element, 1, element->length, grep->out);
+    }
+  }
+  fputc('\n', grep->out);
+  grep->printed = line->number;
+}
+
+/**
+* End the current line: print it if it matches, with the context lines
+* before it, or as a context line after a match, and start the next one.
+* @param grep search state
+* @param context decompression context
+*/
+static void line_end(TGrepState *grep, TDecompressContext *context){
+  const TGrepQuery *query = grep->query;
+  TGrepLine *line = &grep->ring[grep->current];
+  TGrepLine *before = NULL;
+  int i, match = 0;
+
+  line->number = grep->number;
+  for (i = 0; i < query->nclauses && !match; i++) {
+    match = (grep->found & query->clauses[i]) == query->clauses[i];
+  }
+
+  if (match) {
+    for (i = query->context; i > 0; i--) {
+      before = &grep->ring[(grep->current + grep->ring_size - i)
+                                                         % grep->ring_size];
+      if (before->number + i != line->number || before->number <=
+                                                             grep->printed) {
+        continue;
+      }
+      if (grep->printed != 0 && before->number > grep->printed + 1) {
+        fputs("--\n", grep->out);
+      }
+      line_print(grep, context, before, '-');
+    }
+    if (query->context > 0 && grep->printed != 0 &&
+                                         line->number > grep->printed + 1) {
+      fputs("--\n", grep->out);
+    }
+    line_print(grep, context, line, ':');
+    grep->after = query->context;
+    grep->matches++;
+  } else if (grep->after > 0) {
+    line_print(grep, context, line, '-');
+    grep->after--;
+  }
+
+  grep->current = (grep->current + 1) % grep->ring_size;
+  grep->ring[grep->current].used = 0;
+  grep->number++;
+  grep->state = 0;
+  grep->found = 0;
+}
+
+/**
+* Decompression sink: follow the words of the query through the token IDs
+* of each line. Separators other than the newline are skipped, so the
+* words of a phrase can be separated by any of them.
+* @param context decompression context
+* @param element element decoded (element number = token ID)
+* @param count number of repetitions
+* @return 0
+*/
+static int grep_sink(TDecompressContext *context, TElement *element,
+                                                          unsigned int count){
+  TGrepState *grep = context->sink_data;
+  TGrepLine *line = NULL;
+  unsigned int id = element->nElement, positions = 0, ended, skip, i;
+  int low, high, middle;
+
+  if (id == grep->newline) {
+    line_end(grep, context);
+    /* Empty lines: only the ones printed as context need to be seen */
+    for (i = 1; i < count; i++) {
+      skip = count - i;
+      if (grep->after == 0 && skip > (unsigned int)grep->query->context) {
+        skip -= grep->query->context;
+        grep->number += skip;
+        i += skip - 1;
+        continue;
+      }
+      line_end(grep, context);
+    }
+    return 0;
+  }
+
+  line = &grep->ring[grep->current];
+  if (line->used > 0 && line->tokens[line->used-1].id == id) {
+    line->tokens[line->used-1].count += count;
+  } else {
+    if (line->used == line->size) {
+      line->size = line->size ? line->size * 2 : 256;
+      line->tokens = realloc(line->tokens, line->size * sizeof(TGrepToken));
+    }
+    line->tokens[line->used].id = id;
+    line->tokens[line->used++].count = count;
+  }
+
+  if (id <= (unsigned int)context->separators.count) {
+    return 0;
+  }
+  if (grep->seen[id >> 3] & (1 << (id & 7))) {
+    for (low = 0, high = grep->nids; low < high; ) {
+      middle = (low + high) / 2;
+      if (grep->ids[middle] < id) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    positions = grep->positions[low];
+  }
+  if (positions == 0) {
+    grep->state = 0;
+    return 0;
+  }
+
+  /* After GREP_MAX_WORDS repetitions the state does not change */
+  for (i = 0; i < count && i < GREP_MAX_WORDS; i++) {
+    grep->state = ((grep->state << 1) | grep->starts) & positions;
+    for (ended = grep->state & grep->ends; ended != 0; ended &= ended - 1) {
+      grep->found |= 1u << grep->term_of[__builtin_ctz(ended)];
+    }
+  }
+
+  return 0;
+}
+
+/**
+* Print the lines of a .palz file that match a query, grep style
+* (number:line, number-line for context lines, -- between groups). The
+* output of a file is written at once, so files searched by several threads
+* do not mix.
+* @param context decompression context
+* @param query parsed query
+* @param path .palz file
+* @return number of matching lines or an error code
+*/
+int grep_file(TDecompressContext *context, const TGrepQuery *query,
+                                                          const char *path){
+  TGrepState grep;
+  TPalzHeader header;
+  FILE *fp = NULL;
+  char *output = NULL;
+  size_t output_size = 0;
+  unsigned int swap;
+  long code;
+  int error, i, j;
+
+  if ((error = decompress_open(context, path, &header, &fp)) != 0) {
+    return error;
+  }
+
+  /* Words added by --append are in word blocks */
+  if (context->blocks && ((code = ftell(fp)) < 0 ||
+          (error = decompress_blocks(context, fp, ULLONG_MAX)) != 0 ||
+          fseek(fp, code, SEEK_SET) != 0)) {
+    fclose(fp);
+    return error ? error : ERR_PALZCORRUPTED;
+  }
+  /* A stored text has no dictionary: its words are numbered here */
+  if (header.version == PALZ_STORED &&
+              (error = decompress_stored_words(context, &header, fp)) != 0) {
+    fclose(fp);
+    return error;
+  }
+
+  memset(&grep, 0, sizeof(grep));
+  grep.query = query;
+  grep.path = path;
+  grep.number = 1;
+
+  if ((error = grep_prepare(&grep, context, &header)) > 0) {
+    /* Sort the IDs (a few, with their positions) for the sink */
+    for (i = 1; i < grep.nids; i++) {
+      for (j = i; j > 0 && grep.ids[j-1] > grep.ids[j]; j--) {
+        swap = grep.ids[j];
+        grep.ids[j] = grep.ids[j-1];
+        grep.ids[j-1] = swap;
+        swap = grep.positions[j];
+        grep.positions[j] = grep.positions[j-1];
+        grep.positions[j-1] = swap;
+      }
+    }
+    grep.ring_size = query->context + 1;
+    grep.ring = MALLOC(grep.ring_size * sizeof(TGrepLine));
+    memset(grep.ring, 0, grep.ring_size * sizeof(TGrepLine));
+    grep.out = open_memstream(&output, &output_size);
+
+    context->sink = grep_sink;
+    context->sink_data = &grep;
+    error = decompress_scan(context, &header, fp);
+    context->sink = NULL;
+
+    /* A last line without newline */
+    if (!error && grep.ring[grep.current].used > 0) {
+      line_end(&grep, context);
+    }
+
+    fclose(grep.out);
+    flockfile(stdout);
+    fwrite(output, 1, output_size, stdout);
+    funlockfile(stdout);
+    free(output);
+
+    for (i = 0; i < grep.ring_size; i++) {
+      free(grep.ring[i].tokens);
+    }
+    FREE(grep.ring);
+  }
+  fclose(fp);
+  free(grep.ids);
+  free(grep.positions);
+  FREE(grep.seen);
+
+  return error < 0 ? error : grep.matches;
+}
@@ -0,0 +1,37 @@
+/**
+* @file grep.h
+* @brief The header file for grep.c
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#ifndef __GREP_H__
+#define __GREP_H__
+
+#include "common.h"
+#include "decompress.h"
+
+/* Terms of a query, and words of all its terms (one bit each) */
+#define GREP_MAX_TERMS                  32
+#define GREP_MAX_WORDS                  32
+
+/* A --grep query: clauses joined by OR, each the AND of its terms */
+typedef struct grep_query{
+  /* terms as given: a word or a quoted phrase */
+  int nterms;
+  char *terms[GREP_MAX_TERMS];
+  /* mask of the terms a line needs, per clause */
+  int nclauses;
+  unsigned int clauses[GREP_MAX_TERMS];
+  /* lines printed before and after each match */
+  int context;
+  /* print the file name before each line (folders) */
+  int show_path;
+}TGrepQuery;
+
+int grep_query_parse(const char *text, TGrepQuery *query);
+void grep_query_free(TGrepQuery *query);
+int grep_file(TDecompressContext *context, const TGrepQuery *query,
+                                                          const char *path);
+
+#endif
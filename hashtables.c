@@ -15,6 +15,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef HASHTABLE_STATS
+#include <time.h>
+
+/* Comparacao de chaves contabilizada nos contadores da tabela */
+#define COMPARAR(t, a, b) ((t)->stats.comparacoes++, strcmp((a), (b)))
+#else
+#define COMPARAR(t, a, b) strcmp((a), (b))
+#endif
 
 /* Funcao que devolve o primo mais proximo do valor dado*/
 static int proximo_primo(int);
@@ -49,10 +57,25 @@ HASHTABLE_T* tabela_criar(int tamanho, LIBERTAR_FUNC liberta_elem) {
 
 	tabela->total_activos = tabela->total_inactivos = 0;
 	tabela->liberta_elemento = liberta_elem;
+	tabela->arena = NULL;
+#ifdef HASHTABLE_STATS
+	tabela_limpar_estatisticas(tabela);
+#endif
 
 	return tabela;
 }
 
+/**
+ * Funcao que passa a alocar as entradas e as chaves de uma tabela vazia
+ * numa arena. Sao libertadas com a arena (arena_reset()), depois de
+ * tabela_remover_todos() ou tabela_destruir().
+ * @param tabela ponteiro para a tabela de hash
+ * @param arena arena do dono da tabela
+ */
+void tabela_usar_arena(HASHTABLE_T* tabela, TArena* arena) {
+	tabela->arena = arena;
+}
+
 /**
  * Funcao que insere um elemento na tabela
  * @param tabela ponteiro para a tabela de hash
@@ -64,7 +87,7 @@ void tabela_inserir(HASHTABLE_T* tabela, char* chave, void* elem) {
 	int i = posicao_chave(tabela, chave);
 	ENTRADA_T* entrada = tabela->entradas[i];
 
-	if (entrada != NULL && strcmp(entrada->chave, chave) == 0) {
+	if (entrada != NULL && COMPARAR(tabela, entrada->chave, chave) == 0) {
 		if (entrada->activo) {
 			/* se o elemento ja' existe substitui o seu valor */
 			if (tabela->liberta_elemento != NULL)
@@ -76,6 +99,12 @@ void tabela_inserir(HASHTABLE_T* tabela, char* chave, void* elem) {
 		entrada->elemento = elem;
 		entrada->activo = 1;
 		tabela->total_inactivos--;
+	} else if (tabela->arena != NULL) {
+		entrada = (ENTRADA_T*)arena_alloc(tabela->arena, sizeof(ENTRADA_T));
+		entrada->chave = arena_strdup(tabela->arena, chave);
+		entrada->elemento = elem;
+		entrada->activo = 1;
+		tabela->entradas[i] = entrada;
 	} else {
 		entrada = (ENTRADA_T*)malloc(sizeof(ENTRADA_T));
 		entrada->chave = (char*)malloc(strlen(chave)+1);
@@ -102,7 +131,7 @@ void* tabela_remover(HASHTABLE_T* tabela, char* chave) {
 	ENTRADA_T* entrada = tabela->entradas[i];
 
 	if (entrada != NULL &&
-		strcmp(entrada->chave, chave) == 0 &&
+		COMPARAR(tabela, entrada->chave, chave) == 0 &&
 	    entrada->activo)
 	{
 		entrada->activo = 0;
@@ -125,19 +154,36 @@ void tabela_remover_todos(HASHTABLE_T* tabela) {
 	for (i = 0; i < tabela->tamanho; i++) {
 		aux = tabela->entradas[i];
 		if (aux != NULL) {
-			/* liberta a mem�ria alocada para a chave */
-			free(aux->chave);
 			/* liberta a mem�ria alocada para o elemento */
 			if (aux->activo && tabela->liberta_elemento != NULL)
 			tabela->liberta_elemento(aux->elemento);
-			/* liberta a mem�ria alocada para a entrada */
-			free(aux);
+			/* a chave e a entrada de uma arena sao libertadas com ela */
+			if (tabela->arena == NULL) {
+				free(aux->chave);
+				free(aux);
+			}
 			tabela->entradas[i] = NULL;
 		}
 	}
 	tabela->total_activos = tabela->total_inactivos = 0;
 }
 
+/**
+ * Funcao que remove todos os elementos da tabela e, se o vector de
+ * entradas cresceu para alem do tamanho indicado, volta a esse tamanho.
+ * @param tabela ponteiro para a tabela de hash
+ * @param tamanho tamanho da hashtable vazia
+ */
+void tabela_encolher(HASHTABLE_T* tabela, int tamanho) {
+	tabela_remover_todos(tabela);
+	tamanho = proximo_primo(tamanho);
+	if (tabela->tamanho > tamanho) {
+		free(tabela->entradas);
+		tabela->tamanho = tamanho;
+		tabela->entradas = criar_vector_entradas(tabela->tamanho);
+	}
+}
+
 
 
 /**
@@ -171,7 +217,7 @@ void* tabela_consultar(HASHTABLE_T* tabela, char* chave) {
 	int i = posicao_chave(tabela, chave);
 	ENTRADA_T* entrada = tabela->entradas[i];
 
-	if (entrada != NULL && strcmp(entrada->chave, chave) == 0 && entrada->activo){
+	if (entrada != NULL && COMPARAR(tabela, entrada->chave, chave) == 0 && entrada->activo){
 			if(entrada->elemento == NULL){
 				return (int *)-1; /* if elemento not defined */
 			} else {
@@ -182,6 +228,16 @@ void* tabela_consultar(HASHTABLE_T* tabela, char* chave) {
 }
 
 
+#ifdef HASHTABLE_STATS
+/**
+ * Funcao que coloca a zero os contadores de instrumentacao.
+ * @param tabela ponteiro para a tabela de hash
+ */
+void tabela_limpar_estatisticas(HASHTABLE_T* tabela) {
+	memset(&tabela->stats, 0, sizeof(HASHTABLE_STATS_T));
+}
+#endif
+
 /**
  * Funcao que devolve uma lista com as chaves da tabela.
  * @param tabela ponteiro para a tabela de hash
@@ -246,14 +302,20 @@ int proximo_primo(int n) {
 */
 int posicao_chave(HASHTABLE_T *t, char* chave) {
 	int i = hashing_string(chave) % t->tamanho, pos = -1, inicial = i, inc = 1;
+#ifdef HASHTABLE_STATS
+	int sondagens = 1;
+#endif
 
-	while (t->entradas[i] != NULL && strcmp(t->entradas[i]->chave, chave) != 0) {
+	while (t->entradas[i] != NULL && COMPARAR(t, t->entradas[i]->chave, chave) != 0) {
 		if (!t->entradas[i]->activo) {
 			pos = i;
 			break;
 		}
 		i = (i + inc) % t->tamanho;
 		inc += 2;
+#ifdef HASHTABLE_STATS
+		sondagens++;
+#endif
 		if (i == inicial) {
 			fprintf(stderr, "Sondagem circular");
 			exit(1);
@@ -263,11 +325,21 @@ int posicao_chave(HASHTABLE_T *t, char* chave) {
 		do {
 			i = (i + inc) % t->tamanho;
 			inc += 2;
+#ifdef HASHTABLE_STATS
+			sondagens++;
+#endif
 			if (i == inicial) {
 				fprintf(stderr, "Sondagem circular");
 				exit(1);
 			}
-		} while (t->entradas[i] != NULL && strcmp(t->entradas[i]->chave, chave) != 0);
+		} while (t->entradas[i] != NULL && COMPARAR(t, t->entradas[i]->chave, chave) != 0);
+
+#ifdef HASHTABLE_STATS
+	t->stats.pesquisas++;
+	if (sondagens > HASHTABLE_CLASSES_SONDAGEM)
+		sondagens = HASHTABLE_CLASSES_SONDAGEM;
+	t->stats.sondagens[sondagens - 1]++;
+#endif
 
 	if (t->entradas[i] == NULL  &&  pos != -1)
 		return pos;
@@ -282,6 +354,11 @@ static void rehash(HASHTABLE_T* tabela) {
 		int tamanho_novo = proximo_primo(tabela->tamanho * 2);
 		int i;
 		ENTRADA_T** entradas_antigas = tabela->entradas;
+#ifdef HASHTABLE_STATS
+		struct timespec inicio, fim;
+
+		clock_gettime(CLOCK_MONOTONIC, &inicio);
+#endif
 
 		tabela->tamanho = tamanho_novo;
 		tabela->entradas = criar_vector_entradas(tabela->tamanho);
@@ -289,13 +366,22 @@ static void rehash(HASHTABLE_T* tabela) {
 
 		for (i = 0; i < tamanho_antigo; i++) {
 			entrada = entradas_antigas[i];
+			/* as entradas activas passam para o novo vector */
 			if (entrada != NULL && entrada->activo) {
-				tabela_inserir(tabela, entrada->chave, entrada->elemento);
+				tabela->entradas[posicao_chave(tabela, entrada->chave)] = entrada;
+				tabela->total_activos++;
+			} else if (entrada != NULL && tabela->arena == NULL) {
 				free(entrada->chave);
 				free(entrada);
 			}
 		}
 		free(entradas_antigas);
+#ifdef HASHTABLE_STATS
+		clock_gettime(CLOCK_MONOTONIC, &fim);
+		tabela->stats.rehashes++;
+		tabela->stats.tempo_rehash += (fim.tv_sec - inicio.tv_sec) +
+			(fim.tv_nsec - inicio.tv_nsec) / 1e9;
+#endif
 }
 
 /* Funcao que calcula o factor de carga */
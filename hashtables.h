@@ -13,6 +13,7 @@
 #define _HASHTABLES_H
 
 #include "listas.h"
+#include "arena.h"
 
 typedef struct entrada {
 	char* chave;
@@ -20,10 +21,31 @@ typedef struct entrada {
 	int activo;
 } ENTRADA_T;
 
+#ifdef HASHTABLE_STATS
+/* Numero de classes do histograma de sondagens (a ultima acumula o resto) */
+#define HASHTABLE_CLASSES_SONDAGEM 16
+
+/**
+ * Contadores de instrumentacao (apenas com -D HASHTABLE_STATS)
+ */
+typedef struct hashtable_stats {
+	long long pesquisas;
+	long long sondagens[HASHTABLE_CLASSES_SONDAGEM];
+	long long comparacoes;
+	long long rehashes;
+	double tempo_rehash;
+} HASHTABLE_STATS_T;
+#endif
+
 typedef struct hashtable {
 	ENTRADA_T** entradas;
 	int total_activos, total_inactivos, tamanho;
 	LIBERTAR_FUNC liberta_elemento;
+	/* arena das entradas e chaves (NULL: malloc) */
+	TArena* arena;
+#ifdef HASHTABLE_STATS
+	HASHTABLE_STATS_T stats;
+#endif
 } HASHTABLE_T;
 
 
@@ -35,6 +57,15 @@ typedef struct hashtable {
  */
 HASHTABLE_T* tabela_criar(int tamanho, LIBERTAR_FUNC liberta_elem);
 
+/**
+ * Funcao que passa a alocar as entradas e as chaves de uma tabela vazia
+ * numa arena. Sao libertadas com a arena (arena_reset()), depois de
+ * tabela_remover_todos() ou tabela_destruir().
+ * @param tabela ponteiro para a tabela de hash
+ * @param arena arena do dono da tabela
+ */
+void tabela_usar_arena(HASHTABLE_T* tabela, TArena* arena);
+
 /**
  * Funcao que insere um elemento na tabela
  * @param tabela ponteiro para a tabela de hash
@@ -60,6 +91,14 @@ void* tabela_remover(HASHTABLE_T* tabela, char* chave);
  */
 void tabela_remover_todos(HASHTABLE_T* tabela);
 
+/**
+ * Funcao que remove todos os elementos da tabela e, se o vector de
+ * entradas cresceu para alem do tamanho indicado, volta a esse tamanho.
+ * @param tabela ponteiro para a tabela de hash
+ * @param tamanho tamanho da hashtable vazia
+ */
+void tabela_encolher(HASHTABLE_T* tabela, int tamanho);
+
 
 
 /**
@@ -85,6 +124,14 @@ void tabela_destruir(HASHTABLE_T** tabela);
 void* tabela_consultar(HASHTABLE_T* tabela, char* chave);
 
 
+#ifdef HASHTABLE_STATS
+/**
+ * Funcao que coloca a zero os contadores de instrumentacao.
+ * @param tabela ponteiro para a tabela de hash
+ */
+void tabela_limpar_estatisticas(HASHTABLE_T* tabela);
+#endif
+
 /**
  * Funcao que devolve uma lista com as chaves da tabela.
  * @param tabela ponteiro para a tabela de hash
@@ -0,0 +1,207 @@
+/**
+* @file journal.c
+* @brief Journal of the files finished by a folder job (--journal), so a run
+* that was interrupted can be started again and resume where it stopped.
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include "journal.h"
+
+/* Global vars */
+int journal_enabled = 0;
+
+/**
+* Path of a file relative to the directory of the journal.
+* @param journal
+* @param path
+* @return path without the directory
+*/
+static const char *relative_path(TJournal *journal, const char *path){
+  size_t length = strlen(journal->directory);
+
+  if (strncmp(path, journal->directory, length) == 0) {
+    return path + length;
+  }
+  return path;
+}
+
+/**
+* Remove the partial outputs a killed run left in a directory and its
+* sub-directories.
+* @param directory ending in '/'
+*/
+static void remove_partials(const char *directory){
+  struct dirent *dirent = NULL;
+  DIR *dir = NULL;
+  char *path = NULL;
+
+  if ((dir = opendir(directory)) == NULL) {
+    return;
+  }
+  while ((dirent = readdir(dir)) != NULL) {
+    if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+      continue;
+    }
+    path = MALLOC(strlen(directory) + strlen(dirent->d_name) + 2);
+    strcpy(path, directory);
+    strcat(path, dirent->d_name);
+    if (dirent->d_type == DT_DIR) {
+      strcat(path, "/");
+      remove_partials(path);
+    } else if (dirent->d_type == DT_REG && is_partial(dirent->d_name) &&
+                                                         unlink(path) == 0) {
+      fprintf(stderr, "%s: partial output removed\n", path);
+    }
+    FREE(path);
+  }
+  closedir(dir);
+}
+
+/**
+* Open the journal of a folder job. The files of a journal left by an
+* interrupted run of the same mode are loaded, and the journal is extended
+* from there; otherwise a new one is started. Partial outputs are removed.
+* Without a journal file (it can't be written) the job runs unjournaled.
+* @param directory
+* @param mode "compress" or "decompress"
+* @return journal
+*/
+TJournal *journal_open(const char *directory, const char *mode){
+  TJournal *journal = MALLOC(sizeof(TJournal));
+  TJournalEntry entry;
+  TJournalEntry *added = NULL;
+  char *magic = MALLOC(strlen(JOURNAL_MAGIC) + strlen(mode) + 2);
+  char *line = NULL;
+  size_t line_len = 0;
+  ssize_t nread;
+  off_t end = 0;
+  FILE *fp = NULL;
+  int path;
+
+  journal->directory = MALLOC(strlen(directory) + 2);
+  strcpy(journal->directory, directory);
+  if (directory[0] != '\0' && directory[strlen(directory)-1] != '/') {
+    strcat(journal->directory, "/");
+  }
+  journal->filename = MALLOC(strlen(journal->directory) +
+                                                    strlen(JOURNAL_NAME) + 1);
+  strcpy(journal->filename, journal->directory);
+  strcat(journal->filename, JOURNAL_NAME);
+  journal->table = tabela_criar(JOURNAL_TABLE_SIZE, free);
+  journal->resumed = 0;
+  sprintf(magic, "%s%s\n", JOURNAL_MAGIC, mode);
+
+  /* size mtime path, one finished file per line */
+  if ((fp = fopen(journal->filename, "r")) != NULL) {
+    if (getline(&line, &line_len, fp) != -1 && strcmp(line, magic) == 0) {
+      end = ftello(fp);
+      while ((nread = getline(&line, &line_len, fp)) > 0 &&
+                                                     line[nread-1] == '\n') {
+        end += nread;
+        line[nread-1] = '\0';
+        path = 0;
+        if (sscanf(line, "%llu %lld.%ld %n", &entry.size, &entry.mtime_sec,
+                   &entry.mtime_nsec, &path) < 3 || path == 0 ||
+                                                        line[path] == '\0') {
+          continue;
+        }
+        added = malloc(sizeof(TJournalEntry));
+        *added = entry;
+        tabela_inserir(journal->table, line + path, added);
+      }
+    }
+    free(line);
+    fclose(fp);
+  }
+
+  /* A line cut by a killed run is dropped, a journal of another mode or
+  version replaced */
+  if ((journal->fd = open(journal->filename, O_WRONLY | O_CREAT | O_APPEND,
+                                                                 0666)) < 0 ||
+      ftruncate(journal->fd, end) != 0 || (end == 0 &&
+        write(journal->fd, magic, strlen(magic)) != (ssize_t)strlen(magic))) {
+    fprintf(stderr, "Failed: could not write %s, the run can't be resumed\n",
+                                                            journal->filename);
+    if (journal->fd >= 0) {
+      close(journal->fd);
+      journal->fd = -1;
+    }
+  }
+  FREE(magic);
+
+  remove_partials(journal->directory);
+
+  return journal;
+}
+
+/**
+* Check if an earlier run finished a file, which has not changed since.
+* Called by the producer only.
+* @param journal
+* @param path file found in the directory
+* @return 1 if the file can be skipped, 0 if not
+*/
+int journal_finished(TJournal *journal, const char *path){
+  TJournalEntry *entry = tabela_consultar(journal->table,
+                                          (char *)relative_path(journal, path));
+  struct stat st;
+
+  if (entry == NULL || stat(path, &st) != 0 ||
+            entry->size != (unsigned long long)st.st_size ||
+            entry->mtime_sec != (long long)st.st_mtim.tv_sec ||
+            entry->mtime_nsec != st.st_mtim.tv_nsec) {
+    return 0;
+  }
+  journal->resumed++;
+
+  return 1;
+}
+
+/**
+* Record a file whose output is complete (renamed to its final name). Each
+* line is a single write() to the end of the journal, so the threads don't
+* mix their lines and a killed run leaves at most a cut last line.
+* @param journal
+* @param path
+*/
+void journal_record(TJournal *journal, const char *path){
+  const char *name = relative_path(journal, path);
+  struct stat st;
+  char *line = NULL;
+  int length;
+
+  /* A newline in the name would end the line */
+  if (journal->fd < 0 || strchr(name, '\n') != NULL || stat(path, &st) != 0) {
+    return;
+  }
+  line = MALLOC(strlen(name) + 64);
+  length = sprintf(line, "%llu %lld.%09ld %s\n",
+                   (unsigned long long)st.st_size, (long long)st.st_mtim.tv_sec,
+                   (long)st.st_mtim.tv_nsec, name);
+  if (write(journal->fd, line, length) != length) {
+    WARNING("write() to the journal failed");
+  }
+  FREE(line);
+}
+
+/**
+* Close a journal. The journal of a job that went through all its files is
+* removed; an interrupted one is kept for the next run.
+* @param journal
+* @param complete 1 if the job was not interrupted
+*/
+void journal_close(TJournal **journal, int complete){
+  TJournal *aux = *journal;
+
+  if (aux->fd >= 0) {
+    close(aux->fd);
+    if (complete) {
+      unlink(aux->filename);
+    }
+  }
+  tabela_destruir(&aux->table);
+  FREE(aux->filename);
+  FREE(aux->directory);
+  FREE(*journal);
+}
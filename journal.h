@@ -0,0 +1,46 @@
+/**
+* @file journal.h
+* @brief The header file for journal.c
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include "common.h"
+#include "hashtables.h"
+
+/**
+* File kept in the directory of a folder job while it runs, and its first
+* line (followed by the mode). Then one line per file finished: its size,
+* modification time and path relative to the directory.
+*/
+#define JOURNAL_NAME                    ".palz-journal"
+#define JOURNAL_MAGIC                   "PALZJOURNAL 1 "
+#define JOURNAL_TABLE_SIZE              1024
+
+/* stat() of a file when a run finished it */
+typedef struct journal_entry{
+  unsigned long long size;
+  long long mtime_sec;
+  long mtime_nsec;
+}TJournalEntry;
+
+/* Journal of a folder job, appended to by the worker threads */
+typedef struct journal{
+  char *directory;
+  char *filename;
+  int fd;
+  /* files finished by earlier runs (path -> TJournalEntry) */
+  HASHTABLE_T *table;
+  /* files skipped because an earlier run finished them */
+  int resumed;
+}TJournal;
+
+TJournal *journal_open(const char *directory, const char *mode);
+int journal_finished(TJournal *journal, const char *path);
+void journal_record(TJournal *journal, const char *path);
+void journal_close(TJournal **journal, int complete);
+
+#endif
@@ -8,10 +8,21 @@
 #include "common.h"
 #include "decompress.h"
 #include "compress.h"
+#include "grep.h"
+#include "manifest.h"
+#include "archive.h"
+#include "asyncio.h"
 #include <pthread.h>
 
 /* External variables */
 extern int got_signal;
+extern int stats_enabled;
+extern int asyncio_backend;
+extern int decompress_threads;
+extern int progress_enabled;
+extern int journal_enabled;
+extern TCompressOptions compress_options;
+extern TGrepQuery grep_query;
 
 /**
 * Signal handling.
@@ -23,6 +34,38 @@ static void signal_handler(int signal){
 	}
 }
 
+/**
+* Parse a range given as FIRST:LAST, FIRST:, :LAST or a single position.
+* @param text range
+* @param first where to store the first position (1 if omitted)
+* @param last where to store the last position (-1, the end, if omitted)
+* @return 0 or -1 if the range is not valid
+*/
+static int parse_range(const char *text, long long *first, long long *last){
+	const char *colon = strchr(text, ':');
+	char *end = NULL;
+
+	*first = 1;
+	*last = -1;
+	if(colon == NULL){
+		*first = *last = strtoll(text, &end, 10);
+		return *end == '\0' && end != text && *first != 0 ? 0 : -1;
+	}
+	if(colon != text){
+		*first = strtoll(text, &end, 10);
+		if(end != colon || *first == 0){
+			return -1;
+		}
+	}
+	if(colon[1] != '\0'){
+		*last = strtoll(colon + 1, &end, 10);
+		if(*end != '\0' || *last == 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /**
 * Main function.
 * @param argc number of parameters
@@ -43,11 +86,13 @@ int main(int argc, char *argv[]){
 	act.sa_flags = 0;
 
 	float output = 0;
+	int exit_status = EXIT_SUCCESS;
 
 	struct timeval tb, te;
 	gettimeofday(&tb, NULL);
 
-	TDictionary *dictionary = NULL;
+	TDecompressContext *decompress_context = NULL;
+	TCompressContext *compress_context = NULL;
 
 	if (sigaction (SIGINT, &act, NULL) < 0){ /* -1 = error */
 		ERROR(1, "sigaction - SIGINT");
@@ -60,13 +105,74 @@ int main(int argc, char *argv[]){
 	if (cmdline_parser(argc, argv, &args) != 0) {
 		exit(1);
 	}
+	stats_enabled = args.stats_flag;
+	progress_enabled = args.parallel_folder_compress_given && args.progress_flag;
+	journal_enabled = args.journal_flag;
+	if (strcmp(args.io_arg, "uring") == 0) {
+		asyncio_backend = ASYNCIO_URING;
+	} else if (strcmp(args.io_arg, "threads") == 0) {
+		asyncio_backend = ASYNCIO_THREADS;
+	} else if (strcmp(args.io_arg, "off") == 0) {
+		asyncio_backend = ASYNCIO_OFF;
+	} else {
+		asyncio_backend = ASYNCIO_AUTO;
+	}
+	if (args.runs_flag) {
+		compress_options.format = 2;
+	}
+	compress_options.composites = args.composites_flag;
+	if (args.level_arg < 0 || args.level_arg > COMPRESS_MAX_LEVEL) {
+		fprintf(stderr, "palz: --level must be between 0 and %d\n",
+																							COMPRESS_MAX_LEVEL);
+		exit(EXIT_FAILURE);
+	}
+	if (args.separators_given) {
+		TSeparators set;
+
+		if (compress_separators(&set, args.separators_arg) != 0) {
+			fprintf(stderr, "palz: invalid --separators\n");
+			exit(EXIT_FAILURE);
+		}
+		if (!separators_is_default(&set)) {
+			compress_options.format = 2;
+			compress_options.separators = args.separators_arg;
+		}
+	}
+	if (args.varint_ids_flag) {
+		compress_options.format = 2;
+		compress_options.varint_ids = 1;
+	}
+	if (args.level_arg > 0) {
+		compress_options.format = 2;
+		compress_options.level = args.level_arg;
+	}
+	if (args.incremental_given) {
+		compress_options.incremental = strcmp(args.incremental_arg, "hash") == 0 ?
+														MANIFEST_CHECK_HASH : MANIFEST_CHECK_STAT;
+	}
+	if (args.min_ratio_given) {
+		compress_options.min_ratio = args.min_ratio_arg;
+	}
+	/* --append needs checksummed blocks to extend a file later */
+	if (args.checksum_flag || args.index_flag || args.append_given) {
+		compress_options.format = 2;
+		compress_options.checksums = 1;
+		compress_options.index = args.index_flag;
+	}
+
 	/* Check for at least one parameter */
 	if (argc > 1) {
 
 		/* --decompress <file> */
 		if (args.decompress_given) {
-			decompress_resources_init(&dictionary);
-			if ((output = decompress_file(&dictionary, args.decompress_arg)) < 0){
+			if (args.decode_threads_arg < 1) {
+				fprintf(stderr, "palz: --decode-threads must be at least 1\n");
+				exit(EXIT_FAILURE);
+			}
+			decompress_threads = args.decode_threads_arg;
+			decompress_context = decompress_context_create();
+			if ((output = decompress_file(decompress_context,
+																							args.decompress_arg)) < 0){
 				get_error_msg(output, args.decompress_arg);
 			}else{
 				fprintf(stderr,"%.2f %%\n", output);
@@ -75,24 +181,39 @@ int main(int argc, char *argv[]){
 
 		/* --folder-decompress <folder> */
 		else if (args.folder_decompress_given) {
-			decompress_resources_init(&dictionary);
-			decompress_folder(&dictionary, args.folder_decompress_arg);
+			decompress_context = decompress_context_create();
+			decompress_folder(decompress_context, args.folder_decompress_arg);
 		}
 
 		/* --compress <file> */
 		else if (args.compress_given) {
-			if ((output = compress_file(args.compress_arg)) < 0){
+			compress_context = compress_context_create();
+			if ((output = compress_file(compress_context, args.compress_arg)) < 0){
 				get_error_msg(output, args.compress_arg);
 			}else{
 				fprintf(stderr,"%.2f %%\n", output);
 			}
 		}
 
+		/* --append <file> */
+		else if (args.append_given) {
+			compress_context = compress_context_create();
+			if ((output = append_file(compress_context, args.append_arg)) < 0){
+				get_error_msg(output, args.append_arg);
+				exit_status = EXIT_FAILURE;
+			}else{
+				fprintf(stderr,"%.2f %%\n", output);
+			}
+		}
+
 		/* --parallel-folder-compress <folder> --compress-max-threads <nthreads> */
 		else if (args.parallel_folder_compress_given) {
 			int max_threads = args.compress_max_threads_arg;
 
-			parallel_folder_compress(args.parallel_folder_compress_arg, max_threads);
+			if (parallel_folder_compress(args.parallel_folder_compress_arg,
+																										max_threads) != 0) {
+				exit_status = EXIT_FAILURE;
+			}
 		}
 
 		/**
@@ -101,11 +222,156 @@ int main(int argc, char *argv[]){
 		else if (args.parallel_folder_decompress_given) {
 			int max_threads = args.decompress_max_threads_arg;
 
-			decompress_resources_init(&dictionary);
-			parallel_folder_decompress(&dictionary,
-															args.parallel_folder_decompress_arg, max_threads);
+			if (parallel_folder_decompress(args.parallel_folder_decompress_arg,
+																										max_threads) != 0) {
+				exit_status = EXIT_FAILURE;
+			}
 		}
 		
+		/* --archive <folder> --archive-file <file> --archive-max-threads <n> */
+		else if (args.archive_given) {
+			char *folder = MALLOC(strlen(args.archive_arg) + 2);
+			char *archive = NULL;
+
+			strcpy(folder, args.archive_arg);
+			while (strlen(folder) > 1 && folder[strlen(folder)-1] == '/') {
+				folder[strlen(folder)-1] = '\0';
+			}
+			if (args.archive_file_given) {
+				archive = MALLOC(strlen(args.archive_file_arg) + 1);
+				strcpy(archive, args.archive_file_arg);
+			} else {
+				archive = MALLOC(strlen(folder) + strlen(ARCHIVE_EXTENSION) + 1);
+				strcpy(archive, folder);
+				strcat(archive, ARCHIVE_EXTENSION);
+			}
+			strcat(folder, "/");
+			if ((output = parallel_folder_archive(folder, archive,
+																			args.archive_max_threads_arg)) != 0) {
+				if (output < 0) {
+					get_error_msg(output, archive);
+				}
+				exit_status = EXIT_FAILURE;
+			}
+			FREE(archive);
+			FREE(folder);
+		}
+
+		/* --archive-list <file> */
+		else if (args.archive_list_given) {
+			if ((output = archive_list(args.archive_list_arg, stdout)) < 0) {
+				get_error_msg(output, args.archive_list_arg);
+				exit_status = EXIT_FAILURE;
+			}
+		}
+
+		/* --archive-extract <file> --member <path> | --archive-dir <folder> */
+		else if (args.archive_extract_given) {
+			char *folder = MALLOC(strlen(args.archive_dir_arg) + 2);
+
+			strcpy(folder, args.archive_dir_arg);
+			if (folder[strlen(folder)-1] != '/') {
+				strcat(folder, "/");
+			}
+			decompress_context = decompress_context_create();
+			if ((output = archive_extract(decompress_context,
+												args.archive_extract_arg, args.member_given ?
+												args.member_arg : NULL, folder)) != 0) {
+				if (output < 0) {
+					get_error_msg(output, args.member_given && output ==
+												ERR_ARCHIVEMEMBER ? args.member_arg :
+												args.archive_extract_arg);
+				}
+				exit_status = EXIT_FAILURE;
+			}
+			FREE(folder);
+		}
+
+		/* --test <file|folder> --test-max-threads <nthreads> */
+		else if (args.test_given) {
+			struct stat st;
+			char *folder = NULL;
+			int failed = 0;
+
+			if (stat(args.test_arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+				folder = MALLOC(strlen(args.test_arg) + 2);
+				strcpy(folder, args.test_arg);
+				if (folder[strlen(folder)-1] != '/') {
+					strcat(folder, "/");
+				}
+				failed = parallel_folder_test(folder, args.test_max_threads_arg);
+				FREE(folder);
+			} else {
+				decompress_context = decompress_context_create();
+				if ((output = test_file(decompress_context, args.test_arg)) < 0) {
+					get_error_msg(output, args.test_arg);
+					failed = 1;
+				} else {
+					fprintf(stderr, "%s: OK\n", args.test_arg);
+				}
+			}
+			exit_status = failed ? EXIT_FAILURE : EXIT_SUCCESS;
+		}
+
+		/* --extract <file> --bytes <range> | --lines <range> */
+		else if (args.extract_given) {
+			long long first, last;
+			int error;
+
+			if (args.bytes_given == args.lines_given ||
+						parse_range(args.bytes_given ? args.bytes_arg : args.lines_arg,
+																						&first, &last) != 0) {
+				fprintf(stderr, "palz: --extract needs one valid --bytes or "
+																								"--lines range\n");
+				exit(EXIT_FAILURE);
+			}
+			decompress_context = decompress_context_create();
+			if ((error = decompress_range(decompress_context, args.extract_arg,
+															args.lines_given, first, last, stdout)) < 0) {
+				get_error_msg(error, args.extract_arg);
+				exit_status = EXIT_FAILURE;
+			}
+		}
+
+		/* --grep <query> --grep-path <file|folder> --grep-context <lines>
+		--grep-max-threads <nthreads> */
+		else if (args.grep_given) {
+			struct stat st;
+			char *folder = NULL;
+			int matched = 0, failed = 0;
+
+			if (grep_query_parse(args.grep_arg, &grep_query) != 0 ||
+																			args.grep_context_arg < 0) {
+				fprintf(stderr, "palz: --grep needs terms (at most %d) and OR "
+																"between them, and a valid context\n", GREP_MAX_TERMS);
+				exit(EXIT_FAILURE);
+			}
+			grep_query.context = args.grep_context_arg;
+
+			if (stat(args.grep_path_arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+				folder = MALLOC(strlen(args.grep_path_arg) + 2);
+				strcpy(folder, args.grep_path_arg);
+				if (folder[strlen(folder)-1] != '/') {
+					strcat(folder, "/");
+				}
+				grep_query.show_path = 1;
+				failed = parallel_folder_grep(folder, args.grep_max_threads_arg,
+																												&matched);
+				FREE(folder);
+			} else {
+				decompress_context = decompress_context_create();
+				if ((matched = grep_file(decompress_context, &grep_query,
+																							args.grep_path_arg)) < 0) {
+					get_error_msg(matched, args.grep_path_arg);
+					failed = 1;
+					matched = 0;
+				}
+			}
+			grep_query_free(&grep_query);
+			/* grep: 0 if a line was found, 1 if not, 2 on errors */
+			exit_status = failed ? 2 : matched > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+
 		/* --about */
 		else if (args.about_given) {
 			printf("*************************************\n");
@@ -130,9 +396,12 @@ int main(int argc, char *argv[]){
 		/* Release allocated memory */
 		cmdline_parser_free(&args);
 
-		/* Free decompress resources */
-		if(dictionary != NULL) {
-			decompress_resources_free(&dictionary);
+		/* Free contexts */
+		if(decompress_context != NULL) {
+			decompress_context_free(&decompress_context);
+		}
+		if(compress_context != NULL) {
+			compress_context_free(&compress_context);
 		}
 
 		/* Code based on strftime page from manual */
@@ -150,13 +419,16 @@ int main(int argc, char *argv[]){
 	/* Release allocated memory */
 	cmdline_parser_free(&args);
 
-	if(dictionary != NULL) {
-		decompress_resources_free(&dictionary);
+	if(decompress_context != NULL) {
+		decompress_context_free(&decompress_context);
+	}
+	if(compress_context != NULL) {
+		compress_context_free(&compress_context);
 	}
 
 	gettimeofday(&te, NULL);
 	fprintf(stderr, "Execution time: %.2f s\n", (((te.tv_sec-tb.tv_sec) * 1000 +
 																				(te.tv_usec-tb.tv_usec)/1000.0))*0.001);
 
-	return 0;
+	return exit_status;
 }
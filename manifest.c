@@ -0,0 +1,352 @@
+/**
+* @file manifest.c
+* @brief Manifest of the files of a directory compressed by an earlier run of
+* --parallel-folder-compress --incremental, so unchanged files are skipped.
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include "manifest.h"
+
+/**
+* Path of a file relative to the directory of the manifest.
+* @param manifest
+* @param path
+* @return path without the directory
+*/
+static const char *relative_path(TManifest *manifest, const char *path){
+  size_t length = strlen(manifest->directory);
+
+  if (strncmp(path, manifest->directory, length) == 0) {
+    return path + length;
+  }
+  return path;
+}
+
+/**
+* Find the entry of a file. Call with the manifest mutex locked.
+* @param manifest
+* @param path path relative to the directory
+* @return index in the entries or -1
+*/
+static int entry_find(TManifest *manifest, const char *path){
+  int *index = tabela_consultar(manifest->table, (char *)path);
+
+  return index != NULL ? *index : -1;
+}
+
+/**
+* Find the entry of a file or add an empty one. Call with the manifest mutex
+* locked.
+* @param manifest
+* @param path path relative to the directory
+* @return entry
+*/
+static TManifestEntry *entry_get(TManifest *manifest, const char *path){
+  TManifestEntry *entry = NULL;
+  int i = entry_find(manifest, path);
+  int *index = NULL;
+
+  if (i >= 0) {
+    return &manifest->entries[i];
+  }
+
+  if (manifest->used == manifest->size) {
+    manifest->size = manifest->size ? manifest->size * 2 : 64;
+    manifest->entries = realloc(manifest->entries,
+                                   manifest->size * sizeof(TManifestEntry));
+  }
+  entry = &manifest->entries[manifest->used];
+  memset(entry, 0, sizeof(TManifestEntry));
+  entry->path = MALLOC(strlen(path) + 1);
+  strcpy(entry->path, path);
+
+  index = malloc(sizeof(int));
+  *index = manifest->used++;
+  tabela_inserir(manifest->table, entry->path, index);
+
+  return entry;
+}
+
+/**
+* Check the stat() fields of a file against its entry.
+* @param entry
+* @param st
+* @return 1 if they are the same, 0 if not
+*/
+static int stat_matches(const TManifestEntry *entry, const struct stat *st){
+  return entry->size == (unsigned long long)st->st_size &&
+         entry->mtime_sec == (long long)st->st_mtim.tv_sec &&
+         entry->mtime_nsec == st->st_mtim.tv_nsec &&
+         entry->inode == (unsigned long long)st->st_ino;
+}
+
+/**
+* Size of the .palz file of a text.
+* @param path text file
+* @return size or -1 if there is none
+*/
+static long long palz_size_of(const char *path){
+  char palz[strlen(path) + 6];
+  struct stat st;
+
+  strcpy(palz, path);
+  strcat(palz, ".palz");
+
+  return stat(palz, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+/**
+* Check that the .palz file of a text is the one written by the last run
+* (same size).
+* @param path text file
+* @param palz_size size of its .palz file when it was written
+* @return 1 if it is, 0 if not
+*/
+static int palz_matches(const char *path, unsigned long long palz_size){
+  return palz_size_of(path) == (long long)palz_size;
+}
+
+/**
+* Compute the CRC-32C of the contents of a file.
+* @param path
+* @param buffer buffer of COMPRESS_IO_BUFFER bytes
+* @param crc where to store the CRC-32C
+* @return 0 or ERR_FOPEN
+*/
+static int file_crc(const char *path, unsigned char *buffer, unsigned int *crc){
+  size_t nread;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return ERR_FOPEN;
+  }
+  *crc = 0;
+  while ((nread = read(fd, buffer, COMPRESS_IO_BUFFER)) > 0 &&
+                                                   nread != (size_t)-1) {
+    *crc = crc32c(*crc, buffer, nread);
+  }
+  close(fd);
+
+  return nread == 0 ? 0 : ERR_FOPEN;
+}
+
+/**
+* Load the manifest of a directory. A missing or unreadable manifest gives an
+* empty one (every file is compressed).
+* @param directory
+* @param check MANIFEST_CHECK_STAT or MANIFEST_CHECK_HASH
+* @return manifest
+*/
+TManifest *manifest_load(const char *directory, int check){
+  TManifest *manifest = MALLOC(sizeof(TManifest));
+  TManifestEntry entry;
+  TManifestEntry *added = NULL;
+  char *line = NULL;
+  size_t line_len = 0;
+  ssize_t nread;
+  FILE *fp = NULL;
+  int path;
+
+  manifest->directory = MALLOC(strlen(directory) + 2);
+  strcpy(manifest->directory, directory);
+  if (directory[0] != '\0' && directory[strlen(directory)-1] != '/') {
+    strcat(manifest->directory, "/");
+  }
+  manifest->check = check;
+  manifest->entries = NULL;
+  manifest->used = 0;
+  manifest->size = 0;
+  manifest->table = tabela_criar(COMPRESS_TABLE_SIZE, free);
+  manifest->unchanged = 0;
+  manifest->compressed = 0;
+  if ((errno = pthread_mutex_init(&manifest->mutex, NULL)) != 0) {
+    ERROR(C_ERRO_MUTEX_INIT, "pthread_mutex_init() failed!");
+  }
+
+  line = MALLOC(strlen(manifest->directory) + strlen(MANIFEST_NAME) + 1);
+  strcpy(line, manifest->directory);
+  strcat(line, MANIFEST_NAME);
+  fp = fopen(line, "r");
+  FREE(line);
+  if (fp == NULL) {
+    return manifest;
+  }
+
+  /* size mtime inode crc palz_size path, one file per line */
+  if ((nread = getline(&line, &line_len, fp)) != -1 &&
+                                       strcmp(line, MANIFEST_MAGIC) == 0) {
+    while ((nread = getline(&line, &line_len, fp)) > 1) {
+      line[nread-1] = '\0';
+      path = 0;
+      if (sscanf(line, "%llu %lld.%ld %llu %x %llu %n", &entry.size,
+                 &entry.mtime_sec, &entry.mtime_nsec, &entry.inode,
+                 &entry.crc, &entry.palz_size, &path) < 6 || path == 0 ||
+                                                        line[path] == '\0') {
+        continue;
+      }
+      added = entry_get(manifest, line + path);
+      entry.path = added->path;
+      entry.seen = 0;
+      *added = entry;
+    }
+  }
+  free(line);
+  fclose(fp);
+
+  return manifest;
+}
+
+/**
+* Write the manifest, with the files found by this run only, to a temporary
+* file renamed over the old one.
+* @param manifest
+* @return 0 or ERR_FOPEN
+*/
+int manifest_save(TManifest *manifest){
+  TManifestEntry *entry = NULL;
+  size_t length = strlen(manifest->directory) + strlen(MANIFEST_NAME);
+  char filename[length + 1], temporary[length + 5];
+  FILE *fp = NULL;
+  int i, error = 0;
+
+  strcpy(filename, manifest->directory);
+  strcat(filename, MANIFEST_NAME);
+  strcpy(temporary, filename);
+  strcat(temporary, ".tmp");
+
+  if ((fp = fopen(temporary, "w")) == NULL) {
+    return ERR_FOPEN;
+  }
+  fputs(MANIFEST_MAGIC, fp);
+  for (i = 0; i < manifest->used; i++) {
+    entry = &manifest->entries[i];
+    /* A newline in the name would end the line */
+    if (entry->seen && strchr(entry->path, '\n') == NULL) {
+      fprintf(fp, "%llu %lld.%09ld %llu %08x %llu %s\n", entry->size,
+              entry->mtime_sec, entry->mtime_nsec, entry->inode, entry->crc,
+              entry->palz_size, entry->path);
+    }
+  }
+  if (ferror(fp)) {
+    error = ERR_FOPEN;
+  }
+  if (fclose(fp) != 0 || error || rename(temporary, filename) != 0) {
+    unlink(temporary);
+    return ERR_FOPEN;
+  }
+
+  return 0;
+}
+
+/**
+* Free a manifest.
+* @param manifest
+*/
+void manifest_free(TManifest **manifest){
+  TManifest *aux = *manifest;
+  int i;
+
+  for (i = 0; i < aux->used; i++) {
+    FREE(aux->entries[i].path);
+  }
+  free(aux->entries);
+  tabela_destruir(&aux->table);
+  pthread_mutex_destroy(&aux->mutex);
+  FREE(aux->directory);
+  FREE(*manifest);
+}
+
+/**
+* Stat-only check of a file: same size, modification time and inode as when
+* it was compressed, and the same .palz file. Always 0 with
+* MANIFEST_CHECK_HASH.
+* @param manifest
+* @param path file found in the directory
+* @return 1 if the file can be skipped, 0 if it must be checked
+*/
+int manifest_current(TManifest *manifest, const char *path){
+  TManifestEntry *entry = NULL;
+  struct stat st;
+  int i, current = 0;
+
+  if (manifest->check != MANIFEST_CHECK_STAT || stat(path, &st) != 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&manifest->mutex);
+  if ((i = entry_find(manifest, relative_path(manifest, path))) >= 0) {
+    entry = &manifest->entries[i];
+    if (stat_matches(entry, &st) && palz_matches(path, entry->palz_size)) {
+      entry->seen = 1;
+      manifest->unchanged++;
+      current = 1;
+    }
+  }
+  pthread_mutex_unlock(&manifest->mutex);
+
+  return current;
+}
+
+/**
+* Compress a file unless its contents (CRC-32C and size) are still the ones
+* of the manifest and its .palz file is still there, and record it.
+* @param manifest
+* @param context compression context
+* @param path file found in the directory
+* @param ratio where to store the compression ratio
+* @return 1 if the file was unchanged, 0 if it was compressed, or an error
+* code
+*/
+int manifest_compress(TManifest *manifest, TCompressContext *context,
+                                                 char *path, float *ratio){
+  const char *name = relative_path(manifest, path);
+  TManifestEntry *entry = NULL;
+  unsigned long long palz_size = 0;
+  struct stat st;
+  unsigned int crc;
+  int i, error, unchanged = 0;
+
+  if (stat(path, &st) != 0) {
+    return ERR_FSTATUS;
+  }
+  if ((error = file_crc(path, context->code, &crc)) != 0) {
+    return error;
+  }
+
+  pthread_mutex_lock(&manifest->mutex);
+  if ((i = entry_find(manifest, name)) >= 0) {
+    entry = &manifest->entries[i];
+    unchanged = entry->crc == crc &&
+                entry->size == (unsigned long long)st.st_size &&
+                palz_matches(path, entry->palz_size);
+    palz_size = entry->palz_size;
+  }
+  pthread_mutex_unlock(&manifest->mutex);
+
+  if (!unchanged) {
+    if ((*ratio = compress_file(context, path)) < 0) {
+      return *ratio;
+    }
+    palz_size = palz_size_of(path);
+  }
+
+  /* Touched files keep their entry with the new stat() fields */
+  pthread_mutex_lock(&manifest->mutex);
+  entry = entry_get(manifest, name);
+  entry->size = st.st_size;
+  entry->mtime_sec = st.st_mtim.tv_sec;
+  entry->mtime_nsec = st.st_mtim.tv_nsec;
+  entry->inode = st.st_ino;
+  entry->crc = crc;
+  entry->palz_size = palz_size;
+  entry->seen = 1;
+  if (unchanged) {
+    manifest->unchanged++;
+  } else {
+    manifest->compressed++;
+  }
+  pthread_mutex_unlock(&manifest->mutex);
+
+  return unchanged;
+}
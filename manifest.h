@@ -0,0 +1,60 @@
+/**
+* @file manifest.h
+* @brief The header file for manifest.c
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include "common.h"
+#include "compress.h"
+
+/* File kept in the compressed directory and its first line */
+#define MANIFEST_NAME                   ".palz-manifest"
+#define MANIFEST_MAGIC                  "PALZMANIFEST 1\n"
+
+/* --incremental checks: stat() fields only, or always the contents */
+#define MANIFEST_CHECK_STAT             1
+#define MANIFEST_CHECK_HASH             2
+
+/* A file compressed by an earlier run */
+typedef struct manifest_entry{
+  /* path relative to the directory */
+  char *path;
+  /* stat() of the text when it was compressed */
+  unsigned long long size;
+  long long mtime_sec;
+  long mtime_nsec;
+  unsigned long long inode;
+  /* CRC-32C of the text and size of its .palz file */
+  unsigned int crc;
+  unsigned long long palz_size;
+  /* found again by this run */
+  int seen;
+}TManifestEntry;
+
+/* Manifest of a directory, shared by the compression threads */
+typedef struct manifest{
+  char *directory;
+  int check;
+  TManifestEntry *entries;
+  int used;
+  int size;
+  /* path -> index in entries */
+  HASHTABLE_T *table;
+  /* files skipped and compressed by this run */
+  int unchanged;
+  int compressed;
+  pthread_mutex_t mutex;
+}TManifest;
+
+TManifest *manifest_load(const char *directory, int check);
+int manifest_save(TManifest *manifest);
+void manifest_free(TManifest **manifest);
+int manifest_current(TManifest *manifest, const char *path);
+int manifest_compress(TManifest *manifest, TCompressContext *context,
+                                                 char *path, float *ratio);
+
+#endif
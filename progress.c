@@ -0,0 +1,247 @@
+/**
+* @file progress.c
+* @brief Live progress of --parallel-folder-compress --progress: each worker
+* counts the bytes and files it has done and a reporter thread prints the
+* totals, the throughput and the time left.
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include <sys/ioctl.h>
+
+#include "progress.h"
+
+/* Global vars */
+int progress_enabled = 0;
+
+/**
+* Format a number of seconds as h:mm:ss.
+* @param seconds
+* @param text buffer of 32 bytes
+* @return text
+*/
+static char *format_time(double seconds, char *text){
+  long long s = seconds > 0 ? (long long)(seconds + 0.5) : 0;
+
+  snprintf(text, 32, "%lld:%02lld:%02lld", s / 3600, s / 60 % 60, s % 60);
+
+  return text;
+}
+
+/**
+* Print the progress: files and bytes done out of the ones found, bytes
+* written, throughput and time left at that rate, and what every thread is
+* compressing. Call with the mutex locked.
+* @param progress
+* @param last 1 for the summary at the end
+*/
+static void progress_report(TProgress *progress, int last){
+  TProgressSlot *slot = NULL;
+  unsigned long long in = 0, out = 0, total;
+  double elapsed = stats_now() - progress->start, rate;
+  char line[1024], eta[32];
+  const char *name = NULL;
+  struct winsize ws;
+  size_t length, width = 80;
+  int i, files = 0;
+  int used = __atomic_load_n(&progress->used, __ATOMIC_RELAXED);
+
+  if (used > progress->nslots) {
+    used = progress->nslots;
+  }
+  for (i = 0; i < used; i++) {
+    slot = &progress->slots[i];
+    in += __atomic_load_n(&slot->bytes_in, __ATOMIC_RELAXED);
+    out += __atomic_load_n(&slot->bytes_out, __ATOMIC_RELAXED);
+    files += __atomic_load_n(&slot->files, __ATOMIC_RELAXED);
+  }
+  total = __atomic_load_n(&progress->total_bytes, __ATOMIC_RELAXED);
+  rate = elapsed > 0 ? in / elapsed : 0;
+
+  if (last) {
+    format_time(elapsed, eta);
+  } else if (rate > 0 && total >= in) {
+    format_time((total - in) / rate, eta);
+  } else {
+    strcpy(eta, "-:--:--");
+  }
+  snprintf(line, sizeof(line), "%3.0f%% %d/%d files, %.1f/%.1f MB in, "
+           "%.1f MB out, %.1f MB/s, %s %s",
+           total > 0 ? 100.0 * in / total : 100.0, files,
+           __atomic_load_n(&progress->total_files, __ATOMIC_RELAXED),
+           in / 1e6, total / 1e6, out / 1e6, rate / 1e6,
+           last ? "in" : "ETA", eta);
+
+  if (!progress->tty) {
+    fprintf(stderr, "%s\n", line);
+    for (i = 0; !last && i < used; i++) {
+      if (progress->slots[i].current[0] != '\0') {
+        fprintf(stderr, "  thread %d: %s (%.1f MB)\n", i + 1,
+                progress->slots[i].current,
+                progress->slots[i].current_size / 1e6);
+      }
+    }
+    return;
+  }
+
+  /* One line, with the file of each thread, cut at the terminal width */
+  if (ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 1) {
+    width = ws.ws_col - 1;
+  }
+  for (i = 0; !last && i < used; i++) {
+    if (progress->slots[i].current[0] == '\0') {
+      continue;
+    }
+    name = strrchr(progress->slots[i].current, '/');
+    name = name != NULL ? name + 1 : progress->slots[i].current;
+    length = strlen(line);
+    snprintf(line + length, sizeof(line) - length, " | %s", name);
+  }
+  if (strlen(line) > width) {
+    line[width] = '\0';
+  }
+  fprintf(stderr, "\r\033[K%s%s", line, last ? "\n" : "");
+  fflush(stderr);
+}
+
+/**
+* Reporter thread: print the progress every PROGRESS_INTERVAL seconds on a
+* terminal, PROGRESS_LOG_INTERVAL seconds otherwise, until stopped.
+* @param arg progress
+* @return NULL
+*/
+static void *progress_reporter(void *arg){
+  TProgress *progress = arg;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&progress->mutex);
+  while (!progress->stop) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += progress->tty ? PROGRESS_INTERVAL :
+                                                      PROGRESS_LOG_INTERVAL;
+    while (!progress->stop && pthread_cond_timedwait(&progress->cond,
+                                   &progress->mutex, &deadline) != ETIMEDOUT);
+    if (!progress->stop) {
+      progress_report(progress, 0);
+    }
+  }
+  pthread_mutex_unlock(&progress->mutex);
+
+  return NULL;
+}
+
+/**
+* Start the progress of a folder job and its reporter thread.
+* @param nslots number of workers
+* @return progress
+*/
+TProgress *progress_create(int nslots){
+  TProgress *progress = MALLOC(sizeof(TProgress));
+
+  progress->slots = MALLOC(nslots * sizeof(TProgressSlot));
+  memset(progress->slots, 0, nslots * sizeof(TProgressSlot));
+  progress->nslots = nslots;
+  progress->used = 0;
+  progress->total_files = 0;
+  progress->total_bytes = 0;
+  progress->start = stats_now();
+  progress->tty = isatty(STDERR_FILENO);
+  progress->stop = 0;
+
+  if ((errno = pthread_mutex_init(&progress->mutex, NULL)) != 0) {
+    ERROR(C_ERRO_MUTEX_INIT, "pthread_mutex_init() failed!");
+  }
+  if ((errno = pthread_cond_init(&progress->cond, NULL)) != 0) {
+    ERROR(C_ERRO_CONDITION_INIT, "pthread_cond_init() failed!");
+  }
+  if ((errno = pthread_create(&progress->reporter, NULL, progress_reporter,
+                                                            progress)) != 0) {
+    ERROR(C_ERRO_PTHREAD_CREATE, "pthread_create() failed!");
+  }
+
+  return progress;
+}
+
+/**
+* Stop the reporter thread, print the summary and free the progress.
+* @param progress
+*/
+void progress_free(TProgress **progress){
+  TProgress *aux = *progress;
+
+  pthread_mutex_lock(&aux->mutex);
+  aux->stop = 1;
+  pthread_cond_signal(&aux->cond);
+  pthread_mutex_unlock(&aux->mutex);
+  if ((errno = pthread_join(aux->reporter, NULL)) != 0) {
+    ERROR(C_ERRO_PTHREAD_JOIN, "pthread_join() failed!");
+  }
+
+  progress_report(aux, 1);
+
+  pthread_mutex_destroy(&aux->mutex);
+  pthread_cond_destroy(&aux->cond);
+  FREE(aux->slots);
+  FREE(*progress);
+}
+
+/**
+* Count a file found by the producer in the total.
+* @param progress
+* @param path
+*/
+void progress_add(TProgress *progress, const char *path){
+  struct stat st;
+
+  __atomic_add_fetch(&progress->total_files, 1, __ATOMIC_RELAXED);
+  if (stat(path, &st) == 0) {
+    __atomic_add_fetch(&progress->total_bytes, st.st_size, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+* Give a worker its counters.
+* @param progress
+* @return slot of the worker, -1 if there are no more
+*/
+int progress_slot(TProgress *progress){
+  int slot = __atomic_fetch_add(&progress->used, 1, __ATOMIC_RELAXED);
+
+  return slot < progress->nslots ? slot : -1;
+}
+
+/**
+* Show the file a worker starts.
+* @param progress
+* @param slot slot of the worker
+* @param path
+*/
+void progress_start(TProgress *progress, int slot, const char *path){
+  TProgressSlot *aux = &progress->slots[slot];
+  struct stat st;
+  unsigned long long size = stat(path, &st) == 0 ? st.st_size : 0;
+
+  pthread_mutex_lock(&progress->mutex);
+  aux->current_size = size;
+  strncpy(aux->current, path, PROGRESS_NAME_SIZE - 1);
+  aux->current[PROGRESS_NAME_SIZE - 1] = '\0';
+  pthread_mutex_unlock(&progress->mutex);
+}
+
+/**
+* Count the file a worker finished, whether it was compressed or not.
+* @param progress
+* @param slot slot of the worker
+* @param out bytes written for it
+*/
+void progress_done(TProgress *progress, int slot, unsigned long long out){
+  TProgressSlot *aux = &progress->slots[slot];
+
+  __atomic_add_fetch(&aux->bytes_in, aux->current_size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&aux->bytes_out, out, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&aux->files, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&progress->mutex);
+  aux->current[0] = '\0';
+  pthread_mutex_unlock(&progress->mutex);
+}
@@ -0,0 +1,56 @@
+/**
+* @file progress.h
+* @brief The header file for progress.c
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#ifndef __PROGRESS_H__
+#define __PROGRESS_H__
+
+#include "common.h"
+
+/* Seconds between reports on a terminal, and in a log */
+#define PROGRESS_INTERVAL               1
+#define PROGRESS_LOG_INTERVAL           10
+/* Longest file name kept for a thread */
+#define PROGRESS_NAME_SIZE              256
+
+/**
+* Counters of one worker. The worker adds to them with atomic operations and
+* the reporter thread reads them; the file name is copied under the mutex.
+*/
+typedef struct progress_slot{
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+  int files;
+  /* size and name of the file being compressed, "" when idle */
+  unsigned long long current_size;
+  char current[PROGRESS_NAME_SIZE];
+}TProgressSlot;
+
+/* Progress of a folder job, sampled by a reporter thread */
+typedef struct progress{
+  TProgressSlot *slots;
+  int nslots;
+  int used;
+  /* files and bytes found by the producer */
+  int total_files;
+  unsigned long long total_bytes;
+  double start;
+  /* stderr is a terminal: one line redrawn in place */
+  int tty;
+  int stop;
+  pthread_t reporter;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+}TProgress;
+
+TProgress *progress_create(int nslots);
+void progress_free(TProgress **progress);
+void progress_add(TProgress *progress, const char *path);
+int progress_slot(TProgress *progress);
+void progress_start(TProgress *progress, int slot, const char *path);
+void progress_done(TProgress *progress, int slot, unsigned long long out);
+
+#endif
@@ -0,0 +1,108 @@
+/**
+* @file stats.c
+* @brief Per-file statistics printed by --stats.
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+/* Global vars */
+int stats_enabled = 0;
+
+/**
+* Clear all timings and counters.
+* @param stats
+*/
+void stats_reset(TStats *stats){
+  memset(stats, 0, sizeof(TStats));
+}
+
+/**
+* Monotonic clock used to time the phases.
+* @return seconds
+*/
+double stats_now(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+* Write a string as a JSON string literal.
+* @param fp
+* @param str
+*/
+static void json_string(FILE *fp, const char *str){
+  const unsigned char *c = NULL;
+
+  fputc('"', fp);
+  for (c = (const unsigned char *)str; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(fp, "\\%c", *c);
+    } else if (*c < 0x20) {
+      fprintf(fp, "\\u%04x", *c);
+    } else {
+      fputc(*c, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+/**
+* Print the statistics of one file as a single JSON line on stdout. The line
+* is written while holding the stdout lock, so lines from different threads
+* never interleave. Builds with -D HASHTABLE_STATS add a "hashtable" object;
+* probes_histogram[i] counts the lookups that inspected i+1 slots (the last
+* class also counts longer probe chains).
+* @param stats
+* @param operation "compress" or "decompress"
+* @param filename
+*/
+void stats_print(TStats *stats, const char *operation, const char *filename){
+  flockfile(stdout);
+
+  printf("{\"file\":");
+  json_string(stdout, filename);
+  printf(",\"operation\":\"%s\",\"time_ms\":{\"dictionary\":%.3f,"
+         "\"sort\":%.3f,\"header\":%.3f,\"encode\":%.3f,\"decode\":%.3f,"
+         "\"io\":%.3f,\"total\":%.3f},\"tokens\":%lld,\"distinct_words\":%lld,"
+         "\"composites\":%lld,\"id_width\":%d,\"repetitions\":%lld,"
+         "\"bytes_read\":%lld,\"bytes_written\":%lld",
+         operation, stats->time_dictionary * 1e3, stats->time_sort * 1e3,
+         stats->time_header * 1e3, stats->time_encode * 1e3,
+         stats->time_decode * 1e3, stats->time_io * 1e3,
+         stats->time_total * 1e3, stats->tokens, stats->distinct_words,
+         stats->composites, stats->id_width, stats->repetitions,
+         stats->bytes_read, stats->bytes_written);
+
+#ifdef HASHTABLE_STATS
+  /* Only the compressor uses a hashtable */
+  if (stats->table_capacity > 0) {
+    int i;
+
+    printf(",\"hashtable\":{\"lookups\":%lld,\"strcmp\":%lld,"
+           "\"rehashes\":%lld,\"rehash_ms\":%.3f,\"capacity\":%d,"
+           "\"active\":%d,\"tombstones\":%d,\"tombstone_ratio\":%.4f,"
+           "\"probes_histogram\":[",
+           stats->table.pesquisas, stats->table.comparacoes,
+           stats->table.rehashes, stats->table.tempo_rehash * 1e3,
+           stats->table_capacity, stats->table_active, stats->table_tombstones,
+           (double)stats->table_tombstones / stats->table_capacity);
+    for (i = 0; i < HASHTABLE_CLASSES_SONDAGEM; i++) {
+      printf(i ? ",%lld" : "%lld", stats->table.sondagens[i]);
+    }
+    printf("]}");
+  }
+#endif
+
+  printf("}\n");
+  fflush(stdout);
+
+  funlockfile(stdout);
+}
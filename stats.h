@@ -0,0 +1,44 @@
+/**
+* @file stats.h
+* @brief The header file for stats.c
+* @date 2014-2015
+* @author Fabio Santos <ffsantos92@gmail.com>
+* @author Eurico Sousa <2110133@my.ipleiria.pt>
+*/
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#ifdef HASHTABLE_STATS
+#include "hashtables.h"
+#endif
+
+/* Per-file phase timings (seconds) and counters */
+typedef struct stats{
+  double time_dictionary;
+  double time_sort;
+  double time_header;
+  double time_encode;
+  double time_decode;
+  double time_io;
+  double time_total;
+  long long tokens;
+  long long distinct_words;
+  long long composites;
+  int id_width;
+  long long repetitions;
+  long long bytes_read;
+  long long bytes_written;
+#ifdef HASHTABLE_STATS
+  /* hashtable counters and final shape */
+  HASHTABLE_STATS_T table;
+  int table_capacity;
+  int table_active;
+  int table_tombstones;
+#endif
+}TStats;
+
+void stats_reset(TStats *stats);
+double stats_now(void);
+void stats_print(TStats *stats, const char *operation, const char *filename);
+
+#endif
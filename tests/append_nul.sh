@@ -0,0 +1,24 @@
+#!/bin/sh
+# --append of a text whose new tail has a NUL byte: the .palz file must pass
+# --test and decompress to the whole text.
+set -e
+PALZ=${PALZ:-./palz}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+i=0
+while [ $i -lt 200 ]; do
+  echo "line $i of a growing log file" >> "$dir/log.txt"
+  i=$((i + 1))
+done
+$PALZ --compress "$dir/log.txt" --checksum >/dev/null 2>&1
+printf 'more text\000after nul\n' >> "$dir/log.txt"
+cp "$dir/log.txt" "$dir/expected"
+
+$PALZ --append "$dir/log.txt" >/dev/null 2>&1
+$PALZ --test "$dir/log.txt.palz" >/dev/null 2>&1
+rm "$dir/log.txt"
+$PALZ --decompress "$dir/log.txt.palz" >/dev/null 2>&1
+cmp "$dir/log.txt" "$dir/expected"
+
+echo "append_nul: OK"